@@ -0,0 +1,630 @@
+// bigint.hpp --- arbitrary-precision integer library
+// Copyright (C) 2026 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <climits>
+#include <cassert>
+
+//////////////////////////////////////////////////////////////////////////////
+// overflow checks
+//
+// These return true if the result overflows. Otherwise they store the result.
+
+inline bool
+bigint_add_overflow(long long a, long long b, long long& ret)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_add_overflow(a, b, &ret);
+#else
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b))
+        return true;
+    ret = a + b;
+    return false;
+#endif
+}
+
+inline bool
+bigint_sub_overflow(long long a, long long b, long long& ret)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_sub_overflow(a, b, &ret);
+#else
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b))
+        return true;
+    ret = a - b;
+    return false;
+#endif
+}
+
+inline bool
+bigint_mul_overflow(long long a, long long b, long long& ret)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_mul_overflow(a, b, &ret);
+#else
+    if (a > 0)
+    {
+        if (b > 0 ? (a > LLONG_MAX / b) : (b < LLONG_MIN / a))
+            return true;
+    }
+    else if (a < 0)
+    {
+        if (b > 0 ? (a < LLONG_MIN / b) : (b != 0 && a < LLONG_MAX / b))
+            return true;
+    }
+    ret = a * b;
+    return false;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// BigInt --- sign and magnitude
+//
+// The magnitude is a little-endian vector of base 10^9 limbs without leading
+// zeros, so converting from/to decimal text takes linear time. Zero is an
+// empty vector and never negative.
+
+class BigInt
+{
+public:
+    typedef std::uint32_t limb_t;
+    typedef std::vector<limb_t> limbs_t;
+
+    enum { BASE = 1000000000, BASE_DIGITS = 9, KARATSUBA_THRESHOLD = 32 };
+
+    BigInt() : m_negative(false)
+    {
+    }
+
+    BigInt(long long value) : m_negative(value < 0)
+    {
+        unsigned long long u = value;
+        if (m_negative)
+            u = 0 - u;
+        while (u)
+        {
+            m_limbs.push_back(limb_t(u % BASE));
+            u /= BASE;
+        }
+    }
+
+    // Makes a value from the decimal digits (no sign).
+    static BigInt from_digits(const char *digits, size_t len, bool negative = false)
+    {
+        BigInt ret;
+        ret.m_limbs.reserve(len / BASE_DIGITS + 1);
+        for (size_t end = len; end > 0; )
+        {
+            size_t begin = (end > BASE_DIGITS) ? end - BASE_DIGITS : 0;
+            limb_t limb = 0;
+            for (size_t i = begin; i < end; ++i)
+                limb = limb * 10 + limb_t(digits[i] - '0');
+            ret.m_limbs.push_back(limb);
+            end = begin;
+        }
+        ret.m_negative = negative;
+        ret.normalize();
+        return ret;
+    }
+
+    bool is_zero() const
+    {
+        return m_limbs.empty();
+    }
+
+    bool is_negative() const
+    {
+        return m_negative;
+    }
+
+    // Returns false if the value doesn't fit in long long.
+    bool to_ll(long long& value) const
+    {
+        if (m_limbs.size() > 3)
+            return false;
+
+        unsigned long long u = 0;
+        for (size_t i = m_limbs.size(); i-- > 0; )
+        {
+            if (u > (ULLONG_MAX - m_limbs[i]) / BASE)
+                return false;
+            u = u * BASE + m_limbs[i];
+        }
+
+        if (m_negative)
+        {
+            if (u > (unsigned long long)LLONG_MAX + 1)
+                return false;
+            value = (u == (unsigned long long)LLONG_MAX + 1) ? LLONG_MIN : -(long long)u;
+        }
+        else
+        {
+            if (u > (unsigned long long)LLONG_MAX)
+                return false;
+            value = (long long)u;
+        }
+        return true;
+    }
+
+    std::string to_string() const
+    {
+        if (is_zero())
+            return "0";
+
+        std::string ret;
+        ret.reserve(m_limbs.size() * BASE_DIGITS + 1);
+        if (m_negative)
+            ret += '-';
+
+        char buf[BASE_DIGITS];
+        limb_t limb = m_limbs.back();
+        int k = BASE_DIGITS;
+        do
+        {
+            buf[--k] = char('0' + limb % 10);
+            limb /= 10;
+        } while (limb);
+        ret.append(buf + k, BASE_DIGITS - k);
+
+        for (size_t i = m_limbs.size() - 1; i-- > 0; )
+        {
+            limb = m_limbs[i];
+            for (k = BASE_DIGITS; k-- > 0; )
+            {
+                buf[k] = char('0' + limb % 10);
+                limb /= 10;
+            }
+            ret.append(buf, BASE_DIGITS);
+        }
+        return ret;
+    }
+
+    // Uppercase hexadecimal of the magnitude, with '-' if negative.
+    std::string to_hex() const
+    {
+        if (is_zero())
+            return "0";
+
+        static const char s_hex[] = "0123456789ABCDEF";
+        const limb_t divisor = 0x10000000; // 7 hex digits per division
+
+        std::string ret;
+        limbs_t quot = m_limbs;
+        while (!quot.empty())
+        {
+            limb_t rem = div_small(quot, divisor);
+            for (int k = 0; k < 7; ++k)
+            {
+                ret += s_hex[rem & 0xF];
+                rem >>= 4;
+            }
+        }
+        while (ret.size() > 1 && ret.back() == '0')
+            ret.pop_back();
+        if (m_negative)
+            ret += '-';
+        return std::string(ret.rbegin(), ret.rend());
+    }
+
+    int compare(const BigInt& other) const
+    {
+        if (m_negative != other.m_negative)
+            return m_negative ? -1 : 1;
+        int cmp = compare_mag(m_limbs, other.m_limbs);
+        return m_negative ? -cmp : cmp;
+    }
+
+    BigInt operator-() const
+    {
+        BigInt ret(*this);
+        if (!ret.is_zero())
+            ret.m_negative = !ret.m_negative;
+        return ret;
+    }
+
+    BigInt& operator+=(const BigInt& other)
+    {
+        if (m_negative == other.m_negative)
+        {
+            add_mag(m_limbs, other.m_limbs);
+        }
+        else if (compare_mag(m_limbs, other.m_limbs) >= 0)
+        {
+            sub_mag(m_limbs, other.m_limbs);
+        }
+        else
+        {
+            limbs_t limbs = other.m_limbs;
+            sub_mag(limbs, m_limbs);
+            m_limbs.swap(limbs);
+            m_negative = other.m_negative;
+        }
+        normalize();
+        return *this;
+    }
+
+    BigInt& operator-=(const BigInt& other)
+    {
+        return *this += -other;
+    }
+
+    BigInt& operator*=(const BigInt& other)
+    {
+        m_limbs = mul_mag(m_limbs, other.m_limbs);
+        m_negative = (m_negative != other.m_negative);
+        normalize();
+        return *this;
+    }
+
+    friend BigInt operator+(BigInt a, const BigInt& b)
+    {
+        return a += b;
+    }
+
+    friend BigInt operator-(BigInt a, const BigInt& b)
+    {
+        return a -= b;
+    }
+
+    friend BigInt operator*(const BigInt& a, const BigInt& b)
+    {
+        BigInt ret(a);
+        return ret *= b;
+    }
+
+    // Truncates toward zero (the remainder has the sign of a) like C++.
+    // Returns false on division by zero.
+    static bool divmod(const BigInt& a, const BigInt& b, BigInt& quot, BigInt& rem)
+    {
+        if (b.is_zero())
+            return false;
+
+        limbs_t q, r;
+        divmod_mag(a.m_limbs, b.m_limbs, q, r);
+        quot.m_limbs.swap(q);
+        quot.m_negative = (a.m_negative != b.m_negative);
+        quot.normalize();
+        rem.m_limbs.swap(r);
+        rem.m_negative = a.m_negative;
+        rem.normalize();
+        return true;
+    }
+
+protected:
+    bool m_negative;
+    limbs_t m_limbs;
+
+    void normalize()
+    {
+        trim(m_limbs);
+        if (m_limbs.empty())
+            m_negative = false;
+    }
+
+    static void trim(limbs_t& a)
+    {
+        while (!a.empty() && !a.back())
+            a.pop_back();
+    }
+
+    static int compare_mag(const limbs_t& a, const limbs_t& b)
+    {
+        if (a.size() != b.size())
+            return (a.size() < b.size()) ? -1 : 1;
+        for (size_t i = a.size(); i-- > 0; )
+        {
+            if (a[i] != b[i])
+                return (a[i] < b[i]) ? -1 : 1;
+        }
+        return 0;
+    }
+
+    // a += b
+    static void add_mag(limbs_t& a, const limbs_t& b)
+    {
+        if (a.size() < b.size())
+            a.resize(b.size(), 0);
+
+        limb_t carry = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            if (i >= b.size() && !carry)
+                break;
+            limb_t sum = a[i] + carry + (i < b.size() ? b[i] : 0);
+            carry = (sum >= BASE);
+            if (carry)
+                sum -= BASE;
+            a[i] = sum;
+        }
+        if (carry)
+            a.push_back(1);
+    }
+
+    // a -= b, where a >= b
+    static void sub_mag(limbs_t& a, const limbs_t& b)
+    {
+        limb_t borrow = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            if (i >= b.size() && !borrow)
+                break;
+            long long diff = (long long)a[i] - borrow - (i < b.size() ? b[i] : 0);
+            borrow = (diff < 0);
+            if (borrow)
+                diff += BASE;
+            a[i] = limb_t(diff);
+        }
+        trim(a);
+    }
+
+    // a[shift...] += b. a must be large enough.
+    static void add_shifted(limbs_t& a, const limbs_t& b, size_t shift)
+    {
+        limb_t carry = 0;
+        size_t i;
+        for (i = 0; i < b.size(); ++i)
+        {
+            limb_t sum = a[i + shift] + b[i] + carry;
+            carry = (sum >= BASE);
+            if (carry)
+                sum -= BASE;
+            a[i + shift] = sum;
+        }
+        for (i += shift; carry; ++i)
+        {
+            limb_t sum = a[i] + carry;
+            carry = (sum >= BASE);
+            if (carry)
+                sum -= BASE;
+            a[i] = sum;
+        }
+    }
+
+    static limbs_t mul_mag(const limbs_t& a, const limbs_t& b)
+    {
+        if (a.empty() || b.empty())
+            return limbs_t();
+        if (a.size() < KARATSUBA_THRESHOLD || b.size() < KARATSUBA_THRESHOLD)
+            return mul_school(a, b);
+        return mul_karatsuba(a, b);
+    }
+
+    static limbs_t mul_school(const limbs_t& a, const limbs_t& b)
+    {
+        limbs_t ret(a.size() + b.size(), 0);
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            unsigned long long carry = 0;
+            for (size_t j = 0; j < b.size(); ++j)
+            {
+                unsigned long long cur = ret[i + j] + (unsigned long long)a[i] * b[j] + carry;
+                ret[i + j] = limb_t(cur % BASE);
+                carry = cur / BASE;
+            }
+            for (size_t k = i + b.size(); carry; ++k)
+            {
+                unsigned long long cur = ret[k] + carry;
+                ret[k] = limb_t(cur % BASE);
+                carry = cur / BASE;
+            }
+        }
+        trim(ret);
+        return ret;
+    }
+
+    static void split(const limbs_t& a, size_t m, limbs_t& lo, limbs_t& hi)
+    {
+        if (a.size() <= m)
+        {
+            lo = a;
+            hi.clear();
+        }
+        else
+        {
+            lo.assign(a.begin(), a.begin() + m);
+            hi.assign(a.begin() + m, a.end());
+        }
+        trim(lo);
+    }
+
+    // (a1 B^m + a0)(b1 B^m + b0)
+    //   = a1 b1 B^2m + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^m + a0 b0
+    static limbs_t mul_karatsuba(const limbs_t& a, const limbs_t& b)
+    {
+        size_t m = ((a.size() > b.size()) ? a.size() : b.size()) / 2;
+
+        limbs_t a0, a1, b0, b1;
+        split(a, m, a0, a1);
+        split(b, m, b0, b1);
+
+        limbs_t z0 = mul_mag(a0, b0);
+        limbs_t z2 = mul_mag(a1, b1);
+        add_mag(a0, a1);
+        add_mag(b0, b1);
+        limbs_t z1 = mul_mag(a0, b0);
+        sub_mag(z1, z0);
+        sub_mag(z1, z2);
+
+        limbs_t ret(a.size() + b.size() + 1, 0);
+        add_shifted(ret, z0, 0);
+        add_shifted(ret, z1, m);
+        add_shifted(ret, z2, 2 * m);
+        trim(ret);
+        return ret;
+    }
+
+    static limbs_t mul_small(const limbs_t& a, limb_t b)
+    {
+        limbs_t ret(a.size() + 1, 0);
+        unsigned long long carry = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            unsigned long long cur = (unsigned long long)a[i] * b + carry;
+            ret[i] = limb_t(cur % BASE);
+            carry = cur / BASE;
+        }
+        ret[a.size()] = limb_t(carry);
+        return ret;
+    }
+
+    // a /= b. Returns the remainder.
+    static limb_t div_small(limbs_t& a, limb_t b)
+    {
+        unsigned long long rem = 0;
+        for (size_t i = a.size(); i-- > 0; )
+        {
+            unsigned long long cur = rem * BASE + a[i];
+            a[i] = limb_t(cur / b);
+            rem = cur % b;
+        }
+        trim(a);
+        return limb_t(rem);
+    }
+
+    // Knuth's Algorithm D in base 10^9.
+    static void divmod_mag(const limbs_t& a, const limbs_t& b, limbs_t& quot, limbs_t& rem)
+    {
+        if (compare_mag(a, b) < 0)
+        {
+            quot.clear();
+            rem = a;
+            return;
+        }
+
+        if (b.size() == 1)
+        {
+            quot = a;
+            limb_t r = div_small(quot, b[0]);
+            rem.clear();
+            if (r)
+                rem.push_back(r);
+            return;
+        }
+
+        // Normalize so that the top limb of the divisor is at least BASE / 2.
+        limb_t d = limb_t(BASE / ((unsigned long long)b.back() + 1));
+        limbs_t u = mul_small(a, d);
+        limbs_t v = mul_small(b, d);
+        trim(v);
+        size_t n = v.size(), m = a.size() - n;
+        assert(n == b.size());
+
+        quot.assign(m + 1, 0);
+        for (size_t j = m + 1; j-- > 0; )
+        {
+            unsigned long long num = (unsigned long long)u[j + n] * BASE + u[j + n - 1];
+            unsigned long long qhat = num / v[n - 1];
+            unsigned long long rhat = num % v[n - 1];
+            while (qhat >= BASE || qhat * v[n - 2] > rhat * BASE + u[j + n - 2])
+            {
+                --qhat;
+                rhat += v[n - 1];
+                if (rhat >= BASE)
+                    break;
+            }
+
+            // u[j...j+n] -= qhat * v
+            unsigned long long carry = 0;
+            long long borrow = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                unsigned long long p = qhat * v[i] + carry;
+                carry = p / BASE;
+                long long t = (long long)u[i + j] - borrow - (long long)(p % BASE);
+                borrow = (t < 0);
+                if (borrow)
+                    t += BASE;
+                u[i + j] = limb_t(t);
+            }
+            long long t = (long long)u[j + n] - borrow - (long long)carry;
+
+            if (t < 0)
+            {
+                // qhat was one too large. Add v back.
+                u[j + n] = limb_t(t + BASE);
+                --qhat;
+                limb_t c = 0;
+                for (size_t i = 0; i < n; ++i)
+                {
+                    limb_t sum = u[i + j] + v[i] + c;
+                    c = (sum >= BASE);
+                    if (c)
+                        sum -= BASE;
+                    u[i + j] = sum;
+                }
+                u[j + n] = limb_t((u[j + n] + c) % BASE);
+            }
+            else
+            {
+                u[j + n] = limb_t(t);
+            }
+            quot[j] = limb_t(qhat);
+        }
+        trim(quot);
+
+        u.resize(n);
+        trim(u);
+        div_small(u, d);
+        rem.swap(u);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+inline void
+bigint_unittest(void)
+{
+    long long ll;
+    assert(!bigint_add_overflow(1, 2, ll) && ll == 3);
+    assert(bigint_add_overflow(LLONG_MAX, 1, ll));
+    assert(bigint_sub_overflow(LLONG_MIN, 1, ll));
+    assert(bigint_mul_overflow(LLONG_MIN, -1, ll));
+    assert(!bigint_mul_overflow(-3, 4, ll) && ll == -12);
+
+    assert(BigInt(0).to_string() == "0");
+    assert(BigInt(-12).to_string() == "-12");
+    assert(BigInt(LLONG_MIN).to_string() == "-9223372036854775808");
+    assert(BigInt(LLONG_MIN).to_ll(ll) && ll == LLONG_MIN);
+    assert(!(BigInt(LLONG_MAX) + BigInt(1)).to_ll(ll));
+    assert((BigInt(LLONG_MAX) + BigInt(1)).to_string() == "9223372036854775808");
+    assert(BigInt(1000000000).to_string() == "1000000000");
+    assert(BigInt(255).to_hex() == "FF");
+    assert(BigInt(-4096).to_hex() == "-1000");
+
+    BigInt fact(1);
+    for (int i = 2; i <= 25; ++i)
+        fact *= BigInt(i);
+    assert(fact.to_string() == "15511210043330985984000000");
+
+    BigInt two64 = BigInt(4294967296LL) * BigInt(4294967296LL);
+    assert(two64.to_string() == "18446744073709551616");
+    assert(two64.to_hex() == "10000000000000000");
+
+    std::string digits = "-1234567890123456789012345678901234567890";
+    BigInt big = BigInt::from_digits(digits.c_str() + 1, digits.size() - 1, true);
+    assert(big.to_string() == digits);
+    assert(big.compare(BigInt(-1)) < 0);
+    assert(BigInt(0).compare(-big) < 0);
+
+    // Karatsuba and the division against each other
+    std::string str;
+    for (int i = 0; i < 700; ++i)
+        str += char('0' + (i * 7 + 3) % 10);
+    BigInt a = BigInt::from_digits(str.c_str(), str.size());
+    BigInt b = BigInt::from_digits(str.c_str() + 50, 400, true);
+    BigInt prod = a * b;
+    BigInt quot, rem;
+    assert(BigInt::divmod(prod, b, quot, rem));
+    assert(quot.compare(a) == 0 && rem.is_zero());
+    BigInt c = a * -b + BigInt(12345);
+    assert(BigInt::divmod(c, a, quot, rem));
+    assert(quot.compare(-b) == 0 && rem.compare(BigInt(12345)) == 0);
+    assert(BigInt::divmod(-BigInt(7), BigInt(2), quot, rem));
+    assert(quot.compare(BigInt(-3)) == 0 && rem.compare(BigInt(-1)) == 0);
+    assert(!BigInt::divmod(a, BigInt(0), quot, rem));
+}
@@ -4,18 +4,29 @@
 
 #include "ega.hpp"
 #include "mstr.hpp"
+#include "utfvec.hpp"
+#include "regex.hpp"
+#include "intvec.hpp"
 #ifdef _WIN32
-    #define UTF_WIDE_IS_UTF16
     #include <windows.h>
 #endif
-#include "UTF/utf.hpp"
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <list>
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
 #include <cctype>
 #include <ctime>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <chrono>
+#include <exception>
 
 namespace EGA
 {
@@ -23,16 +34,112 @@ namespace EGA
 typedef std::unordered_map<std::string, fn_t> fn_map_t;
 typedef std::unordered_map<std::string, arg_t> var_map_t;
 
-static fn_map_t s_fn_map;
-static var_map_t s_var_map;
-static bool s_interactive = false;
-static bool s_echo_input = false;
-static volatile bool s_stopping = false;
+
+// A frame of the evaluation stack: a container whose children are being
+// evaluated in order, and the values of them.
+struct EvalFrame
+{
+    const AstContainer *node;
+    size_t index;
+    bool sequence;
+    args_t values;
+};
+
+typedef std::list<std::pair<std::string, arg_t>> program_list_t;
+typedef std::unordered_map<std::string, program_list_t::iterator> program_map_t;
+
+typedef std::list<std::pair<std::string, std::shared_ptr<const Regex>>> regex_list_t;
+typedef std::unordered_map<std::string, regex_list_t::iterator> regex_map_t;
+
+typedef std::list<std::pair<std::string, arg_t>> memo_list_t;
+
+struct EGA_Memo
+{
+    memo_list_t list;
+    std::unordered_map<std::string, memo_list_t::iterator> map;
+    size_t max_size = 0;
+    long long hits = 0;
+    long long misses = 0;
+};
+
+// The state of an interpreter. See EGA_Context.
+struct EGA_CONTEXT_DATA
+{
+    // Shared by the child contexts. Copied on write (see EGA_add_fn).
+    std::shared_ptr<fn_map_t> fn_map;
+    var_map_t var_map;
+    bool interactive = false;
+    bool echo_input = false;
+    // Set by the other threads or a signal handler.
+    std::atomic<bool> stopping;
+    size_t max_depth = 100000;
+    size_t eval_nesting = 0;
+
+    // The frames are recycled to keep the capacity of the value lists.
+    // std::deque doesn't move the lower frames while growing.
+    std::deque<EvalFrame> eval_frames;
+    size_t eval_depth = 0;
+
+    EGA_INPUT_FN input_fn = EGA_default_input;
+    EGA_PRINT_FN print_fn = EGA_default_print;
+
+    program_list_t program_list;
+    program_map_t program_map;
+    size_t program_cache_size = 64;
+
+    regex_list_t regex_list;
+    regex_map_t regex_map;
+    size_t regex_cache_size = 64;
+
+    std::unordered_map<std::string, EGA_Memo> memo_map;
+
+    // The context whose stopping also stops this one, or nullptr.
+    const EGA_CONTEXT_DATA *parent = nullptr;
+
+    EGA_CONTEXT_DATA() : fn_map(std::make_shared<fn_map_t>()), stopping(false)
+    {
+    }
+};
+
+// The current context of this thread, or nullptr for the default context.
+static thread_local EGA_Context *s_current_context = nullptr;
+
+// The number of the living contexts.
+static std::atomic<int> s_context_count(0);
+
+static EGA_Context s_default_context;
+
+inline EGA_CONTEXT_DATA& EGA_state()
+{
+    EGA_Context *context = s_current_context;
+    return (context ? *context : s_default_context).data();
+}
+
+// Makes to run like from: the same functions, variables and settings.
+// The functions are shared.
+static void EGA_copy_context(EGA_CONTEXT_DATA& to, const EGA_CONTEXT_DATA& from)
+{
+    to.fn_map = from.fn_map;
+    to.var_map = from.var_map;
+    to.max_depth = from.max_depth;
+    to.input_fn = from.input_fn;
+    to.print_fn = from.print_fn;
+}
+
+// The limit of the recursion of the evaluator on the C++ stack.
+#ifndef EGA_MAX_RECURSION
+    #ifdef _WIN32
+        #define EGA_MAX_RECURSION 2000 // The default stack is 1 MiB
+    #else
+        #define EGA_MAX_RECURSION 10000
+    #endif
+#endif
 
 fn_t EGA_get_fn(const std::string& name);
 arg_t EGA_eval_fn(const std::string& name, const args_t& args, int lineno);
 arg_t EGA_eval_var(const std::string& name, int lineno);
 arg_t EGA_eval_program(const args_t& args);
+void EGA_clear_program_cache(void);
 arg_t EGA_eval_arg(const arg_t& ast, int lineno, bool do_check);
 arg_t EGA_eval_arg(const arg_t& ast, bool do_check);
 arg_t EGA_eval_arg(const arg_t& ast);
@@ -46,6 +153,8 @@ static std::string str_right(const std::string& str, size_t length)
 
 std::string AstInt::dump(bool q) const
 {
+    if (m_big)
+        return m_big->to_string();
     return mstr_to_string(m_value);
 }
 
@@ -54,9 +163,10 @@ inline int is_cntrl(unsigned char c)
     return c < 0x20 || c >= 0x7F;
 }
 
+// strchr finds the terminator, so '\0' is checked first.
 inline int is_space(unsigned char c)
 {
-    return strchr(" \t\n\r\f\v", c) != nullptr;
+    return c != 0 && strchr(" \t\n\r\f\v", c) != nullptr;
 }
 
 bool mstr_is_binary(const std::string& str)
@@ -178,7 +288,7 @@ inline bool is_ident_char(unsigned char ch)
     return is_alnum(ch) || ega_ident_extra_table()[ch];
 }
 
-/*static*/ int Token::s_alive_count = 0;
+/*static*/ std::atomic<int> Token::s_alive_count(0);
 
 /*static*/ void Token::alive_count(bool add)
 {
@@ -194,19 +304,21 @@ inline bool is_ident_char(unsigned char ch)
     }
 }
 
-/*static*/ int AstBase::s_alive_count = 0;
+/*static*/ std::atomic<int> AstBase::s_alive_count(0);
 
 /*static*/ void AstBase::alive_count(bool add)
 {
     if (add)
     {
-        assert(s_alive_count >= 0);
-        ++s_alive_count;
+        int count = ++s_alive_count;
+        assert(count > 0);
+        (void)count;
     }
     else
     {
-        --s_alive_count;
-        assert(s_alive_count >= 0);
+        int count = --s_alive_count;
+        assert(count >= 0);
+        (void)count;
     }
 }
 
@@ -220,17 +332,15 @@ bool EGA_default_input(char *buf, size_t buflen)
     return fgets(buf, int(buflen), stdin) != nullptr;
 }
 
-static EGA_INPUT_FN s_input_fn = EGA_default_input;
-
 void EGA_set_input_fn(EGA_INPUT_FN fn)
 {
-    s_input_fn = fn;
+    EGA_state().input_fn = fn;
 }
 
 bool EGA_do_input(char *buf, size_t buflen)
 {
     buf[0] = 0;
-    return (*s_input_fn)(buf, buflen);
+    return (*EGA_state().input_fn)(buf, buflen);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -241,18 +351,16 @@ void EGA_default_print(const char *fmt, va_list va)
     vprintf(fmt, va);
 }
 
-static EGA_PRINT_FN s_print_fn = EGA_default_print;
-
 void EGA_set_print_fn(EGA_PRINT_FN fn)
 {
-    s_print_fn = fn;
+    EGA_state().print_fn = fn;
 }
 
 void EGA_do_print(const char *fmt, ...)
 {
     va_list va;
     va_start(va, fmt);
-    s_print_fn(fmt, va);
+    EGA_state().print_fn(fmt, va);
     fflush(stdout);
     va_end(va);
 }
@@ -279,32 +387,352 @@ void AstBase::print() const
     EGA_do_print("%s\n", dump(true).c_str());
 }
 
+inline bool is_container(const arg_t& ast)
+{
+    if (!ast)
+        return false;
+
+    switch (ast->get_type())
+    {
+    case AST_ARRAY:
+    case AST_CALL:
+    case AST_PROGRAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+AstContainer::~AstContainer()
+{
+    // Destroy the nested containers owned only by this node one by one,
+    // so that a deeply nested tree doesn't overflow the C++ stack.
+    std::vector<arg_t> stack;
+    for (auto& child : m_children)
+    {
+        if (is_container(child) && child.use_count() == 1)
+            stack.push_back(std::move(child));
+    }
+
+    while (stack.size())
+    {
+        arg_t ast = std::move(stack.back());
+        stack.pop_back();
+
+        auto& children = static_cast<AstContainer&>(*ast).m_children;
+        for (auto& child : children)
+        {
+            if (is_container(child) && child.use_count() == 1)
+                stack.push_back(std::move(child));
+        }
+    }
+}
+
 std::string AstContainer::dump(bool q) const
 {
+    // Walk the nested arrays by an explicit stack, not by recursion.
+    std::vector<std::pair<const AstContainer *, size_t>> stack;
+    stack.emplace_back(this, 0);
+
     std::string ret = "{ ";
-    if (size() > 0)
+    while (stack.size())
     {
-        ret += m_children[0]->dump(q);
-        for (size_t i = 1; i < size(); ++i)
+        auto node = stack.back().first;
+        size_t index = stack.back().second++;
+        if (index == node->size())
         {
+            ret += " }";
+            stack.pop_back();
+            continue;
+        }
+
+        if (index > 0)
             ret += ", ";
-            ret += m_children[i]->dump(q);
+
+        const arg_t& child = node->m_children[index];
+        if (is_container(child))
+        {
+            ret += "{ ";
+            stack.emplace_back(static_cast<const AstContainer *>(child.get()), 0);
+        }
+        else if (child->get_type() == AST_INT && !static_cast<AstInt *>(child.get())->is_big())
+        {
+            mstr_append_int(ret, static_cast<AstInt *>(child.get())->get_int());
+        }
+        else
+        {
+            ret += child->dump(q);
         }
     }
-    ret += " }";
     return ret;
 }
 
 arg_t AstContainer::clone() const
 {
-    auto ret = make_arg<AstContainer>(m_type, m_lineno, m_str);
-    for (size_t i = 0; i < size(); ++i)
+    // Copy the nested containers by an explicit stack, not by recursion.
+    auto ret = make_arg<AstContainer>(m_type, m_lineno, m_str, m_fn);
+
+    std::vector<std::pair<const AstContainer *, AstContainer *>> stack;
+    stack.emplace_back(this, ret.get());
+    while (stack.size())
+    {
+        auto from = stack.back().first;
+        auto to = stack.back().second;
+        stack.pop_back();
+
+        to->m_children.reserve(from->size());
+        for (const auto& child : from->m_children)
+        {
+            if (is_container(child))
+            {
+                auto src = static_cast<const AstContainer *>(child.get());
+                auto dest = make_arg<AstContainer>(src->m_type, src->m_lineno, src->m_str,
+                                                   src->m_fn);
+                to->add(dest);
+                stack.emplace_back(src, dest.get());
+            }
+            else
+            {
+                to->add(child->clone());
+            }
+        }
+    }
+
+    return ret;
+}
+
+static size_t EGA_hash_mix(unsigned long long x)
+{
+    // The finalizer of SplitMix64
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return size_t(x);
+}
+
+static size_t EGA_hash_key(const arg_t& key)
+{
+    switch (key->get_type())
+    {
+    case AST_INT:
+        {
+            auto ai = static_cast<const AstInt *>(key.get());
+            if (ai->is_big())
+                return EGA_hash_mix(std::hash<std::string>()(ai->get_big().to_string()));
+            return EGA_hash_mix((unsigned long long)ai->get_int());
+        }
+    case AST_STR:
+        return EGA_hash_mix(std::hash<std::string>()(static_cast<AstStr *>(key.get())->get_str()));
+    default:
+        throw EGA_type_mismatch(key->get_lineno());
+    }
+}
+
+static bool EGA_key_equal(const arg_t& key1, const arg_t& key2)
+{
+    if (key1->get_type() != key2->get_type())
+        return false;
+
+    if (key1->get_type() == AST_STR)
+    {
+        return static_cast<AstStr *>(key1.get())->get_str() ==
+               static_cast<AstStr *>(key2.get())->get_str();
+    }
+
+    auto ai1 = static_cast<const AstInt *>(key1.get());
+    auto ai2 = static_cast<const AstInt *>(key2.get());
+    if (ai1->is_big() || ai2->is_big())
+        return ai1->is_big() && ai2->is_big() && ai1->get_big().compare(ai2->get_big()) == 0;
+    return ai1->get_int() == ai2->get_int();
+}
+
+size_t AstDict::find_slot(const arg_t& key, size_t hash) const
+{
+    size_t mask = m_table.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        int k = m_table[i];
+        if (k < 0)
+            return i;
+
+        const Entry& entry = m_entries[k];
+        if (entry.key && entry.hash == hash && EGA_key_equal(entry.key, key))
+            return i;
+    }
+}
+
+// Drops the deleted entries and makes the table for count entries.
+void AstDict::rehash(size_t count)
+{
+    size_t capacity = 8;
+    while (capacity < count * 2)
+        capacity *= 2;
+
+    if (m_count != m_entries.size())
+    {
+        std::vector<Entry> entries;
+        entries.reserve(m_count);
+        for (auto& entry : m_entries)
+        {
+            if (entry.key)
+                entries.push_back(std::move(entry));
+        }
+        m_entries.swap(entries);
+    }
+
+    m_table.assign(capacity, -1);
+    size_t mask = capacity - 1;
+    for (size_t k = 0; k < m_entries.size(); ++k)
+    {
+        size_t i = m_entries[k].hash & mask;
+        while (m_table[i] >= 0)
+            i = (i + 1) & mask;
+        m_table[i] = int(k);
+    }
+}
+
+arg_t AstDict::get(const arg_t& key) const
+{
+    size_t hash = EGA_hash_key(key);
+    if (m_table.empty())
+        return nullptr;
+
+    int k = m_table[find_slot(key, hash)];
+    if (k < 0)
+        return nullptr;
+    return m_entries[k].value;
+}
+
+void AstDict::set(const arg_t& key, const arg_t& value)
+{
+    size_t hash = EGA_hash_key(key);
+    if (m_table.empty())
+        rehash(1);
+
+    size_t slot = find_slot(key, hash);
+    if (m_table[slot] >= 0)
+    {
+        m_entries[m_table[slot]].value = value;
+        return;
+    }
+
+    // Keep the load factor (with the tombstones) at most 3/4.
+    if ((m_entries.size() + 1) * 4 > m_table.size() * 3)
+    {
+        rehash(m_count + 1);
+        slot = find_slot(key, hash);
+    }
+
+    m_table[slot] = int(m_entries.size());
+    Entry entry = { hash, key, value };
+    m_entries.push_back(std::move(entry));
+    ++m_count;
+}
+
+bool AstDict::del(const arg_t& key)
+{
+    size_t hash = EGA_hash_key(key);
+    if (m_table.empty())
+        return false;
+
+    int k = m_table[find_slot(key, hash)];
+    if (k < 0)
+        return false;
+
+    m_entries[k].key = nullptr;
+    m_entries[k].value = nullptr;
+    --m_count;
+    return true;
+}
+
+std::string AstDict::dump(bool q) const
+{
+    if (m_count == 0)
+        return "dict()";
+
+    std::string ret = "{ ";
+    bool first = true;
+    for (auto& entry : m_entries)
+    {
+        if (!entry.key)
+            continue;
+        if (!first)
+            ret += ", ";
+        first = false;
+        ret += entry.key->dump(q);
+        ret += ": ";
+        ret += entry.value->dump(q);
+    }
+    ret += " }";
+    return ret;
+}
+
+arg_t AstDict::clone() const
+{
+    auto ret = make_arg<AstDict>(m_lineno);
+    ret->m_entries = m_entries;
+    ret->m_table = m_table;
+    ret->m_count = m_count;
+    return ret;
+}
+
+std::string AstIntArray::dump(bool) const
+{
+    std::string ret;
+    ret.reserve(m_values.size() * 8 + 4);
+    ret += "{ ";
+    for (size_t i = 0; i < m_values.size(); ++i)
     {
-        ret->add(m_children[i]->clone());
+        if (i > 0)
+            ret += ", ";
+        mstr_append_int(ret, m_values[i]);
     }
+    ret += " }";
     return ret;
 }
 
+arg_t AstIntArray::clone() const
+{
+    return make_arg<AstIntArray>(m_values, m_lineno);
+}
+
+arg_t AstBuffer::slice(size_t offset, size_t size) const
+{
+    assert(offset + size <= m_size);
+    return make_arg<AstBuffer>(m_bytes, m_offset + offset, size, m_lineno);
+}
+
+char *AstBuffer::writable()
+{
+    if (m_bytes.use_count() > 1)
+    {
+        m_bytes = std::make_shared<std::string>(data(), size());
+        m_offset = 0;
+    }
+    return &(*m_bytes)[m_offset];
+}
+
+std::string AstBuffer::dump(bool q) const
+{
+    if (q)
+        return "buffer(" + mstr_quote2(str()) + ")";
+    return str();
+}
+
+arg_t AstBuffer::clone() const
+{
+    return make_arg<AstBuffer>(m_bytes, m_offset, m_size, m_lineno);
+}
+
+std::string AstStrBuf::dump(bool q) const
+{
+    if (q)
+        return "strbuf(" + mstr_quote2(m_str) + ")";
+    return m_str;
+}
+
 std::string EGA_dump_token_type(TokenType type)
 {
     switch (type)
@@ -365,6 +793,11 @@ std::string EGA_dump_ast_type(AstType type)
     case AST_VAR: return "AST_VAR";
     case AST_CALL: return "AST_CALL";
     case AST_PROGRAM: return "AST_PROGRAM";
+    case AST_DICT: return "AST_DICT";
+    case AST_INTARRAY: return "AST_INTARRAY";
+    case AST_BUFFER: return "AST_BUFFER";
+    case AST_STRBUF: return "AST_STRBUF";
+    case AST_GENERATOR: return "AST_GENERATOR";
     }
     return "(AST_none)";
 }
@@ -399,6 +832,14 @@ bool TokenStream::do_lexical(const char *input, int& lineno)
             continue;
 
         std::string str;
+
+        // A lone ':' separates a key and a value in a dict literal.
+        if (*pch == ':' && pch[1] != '=')
+        {
+            add(TOK_SYMBOL, lineno, ":");
+            continue;
+        }
+
         if (is_ident_fchar(*pch))
         {
             const char *start = pch;
@@ -527,230 +968,351 @@ arg_t TokenStream::visit_translation_unit()
     }
 }
 
-arg_t TokenStream::visit_expression()
+inline bool is_symbol(TokenStream& stream, char ch)
 {
-    PARSE_DEBUG();
-
-    char ch;
-    std::string name;
+    return stream.token_type() == TOK_SYMBOL && stream.token_str()[0] == ch;
+}
 
-    switch (token_type())
+static void EGA_check_arity(const AstContainer& list)
+{
+    if (const auto& fn = list.get_fn())
     {
-    case TOK_EOF:
-        return nullptr;
+        if (list.size() < fn->min_args || fn->max_args < list.size())
+            throw EGA_arity_exception(fn->name, list.get_lineno());
+    }
+}
 
-    case TOK_INT:
-        return visit_integer_literal();
+arg_t TokenStream::visit_expression()
+{
+    PARSE_DEBUG();
 
-    case TOK_STR:
-        return visit_string_literal();
+    // The calls and the array literals being parsed are kept on an explicit
+    // stack instead of the C++ stack, so deeply nested input cannot crash.
+    std::vector<std::shared_ptr<AstContainer>> stack;
+    // Whether each array literal on the stack is a dict literal.
+    std::vector<char> dicts;
 
-    case TOK_IDENT:
-        name = token()->get_str();
-        if (EGA_get_fn(name))
-        {
-            go_next();
-            return visit_call(name);
-        }
-        else
-        {
-            auto var = make_arg<AstVar>(name, get_lineno());
-            go_next();
-            if (token()->get_str() == "(")
-                throw EGA_syntax_error(get_lineno());
-            return var;
-        }
+    for (;;)
+    {
+        arg_t expr;
+        std::shared_ptr<AstContainer> list;
+        std::string name;
 
-    case TOK_SYMBOL:
-        ch = token()->get_str()[0];
-        switch (ch)
+        switch (token_type())
         {
-        case '(':
-            return visit_call("");
+        case TOK_EOF:
+            return nullptr;
 
-        case ')':
+        case TOK_INT:
+            expr = visit_integer_literal();
             break;
 
-        case ',':
+        case TOK_STR:
+            expr = visit_string_literal();
             break;
 
-        case '{':
-            return visit_array_literal();
-
-        case '}':
+        case TOK_IDENT:
+            name = token_str();
+            if (auto fn = EGA_get_fn(name))
+            {
+                go_next();
+                if (!is_symbol(*this, '('))
+                    return nullptr;
+                list = make_arg<AstContainer>(AST_CALL, get_lineno(), name, fn);
+            }
+            else
+            {
+                expr = make_arg<AstVar>(name, get_lineno());
+                go_next();
+                if (is_symbol(*this, '('))
+                    throw EGA_syntax_error(get_lineno());
+            }
             break;
 
-        case ';':
+        case TOK_SYMBOL:
+            if (is_symbol(*this, '('))
+                list = make_arg<AstContainer>(AST_CALL, get_lineno());
+            else if (is_symbol(*this, '{'))
+                list = make_arg<AstContainer>(AST_ARRAY, get_lineno());
+            else
+                return nullptr;
             break;
 
         default:
-            break;
+            return nullptr;
         }
-        break;
 
-    default:
-        break;
-    }
+        if (list)
+        {
+            if (stack.size() >= EGA_get_max_depth())
+                throw EGA_nesting_too_deep(get_lineno());
 
-    return nullptr;
-}
+            go_next();
 
-arg_t TokenStream::visit_integer_literal()
-{
-    PARSE_DEBUG();
+            if (!is_symbol(*this, (list->get_type() == AST_ARRAY) ? '}' : ')'))
+            {
+                stack.push_back(list);
+                dicts.push_back(false);
+                continue;
+            }
 
-    if (token_type() != TOK_INT)
-        return nullptr;
+            go_next();
+            EGA_check_arity(*list);
+            expr = list;
+        }
 
-    auto ai = make_arg<AstInt>(token()->get_int(), get_lineno());
-    go_next();
-    return ai;
-}
+        // Add the expression to the innermost list and close the lists
+        // that have been completed.
+        for (;;)
+        {
+            if (stack.empty())
+                return expr;
 
-arg_t TokenStream::visit_string_literal()
-{
-    PARSE_DEBUG();
+            auto& top = stack.back();
+            top->add(expr);
 
-    if (token_type() != TOK_STR)
-        return nullptr;
-    auto as = make_arg<AstStr>(token()->get_str(), get_lineno());
-    go_next();
-    return as;
-}
+            if (top->get_type() == AST_ARRAY)
+            {
+                // { key1: value1, key2: value2, ... }
+                if ((top->size() == 1 || dicts.back()) && (top->size() % 2) == 1)
+                {
+                    if (is_symbol(*this, ':'))
+                    {
+                        dicts.back() = true;
+                        go_next();
+                        break;
+                    }
+                    if (dicts.back())
+                    {
+                        EGA_do_print("ERROR: unexpected token (3): '%s'\n", token_str().c_str());
+                        return nullptr;
+                    }
+                }
 
-arg_t TokenStream::visit_array_literal()
-{
-    PARSE_DEBUG();
+                while (is_symbol(*this, ','))
+                    go_next();
 
-    if (token_type() != TOK_SYMBOL || token_str() != "{")
-        return nullptr;
+                if (is_symbol(*this, ')'))
+                {
+                    EGA_do_print("ERROR: unexpected token (3): '%s'\n", token_str().c_str());
+                    return nullptr;
+                }
 
-    go_next();
+                if (!is_symbol(*this, '}'))
+                    break;
+            }
+            else
+            {
+                if (is_symbol(*this, ','))
+                {
+                    go_next();
+                    break;
+                }
 
-    if (token_type() == TOK_SYMBOL && token_str() == "}")
-    {
-        go_next();
-        return make_arg<AstContainer>(AST_ARRAY, get_lineno());
-    }
+                if (!is_symbol(*this, ')'))
+                    return nullptr;
+            }
 
-    if (auto list = visit_expression_list(AST_ARRAY, "array"))
-    {
-        if (token_type() == TOK_SYMBOL && token_str() == "}")
-        {
             go_next();
-            return list;
+            if (dicts.back())
+            {
+                // A dict literal is a call of dict.
+                auto call = make_arg<AstContainer>(AST_CALL, top->get_lineno(), "dict",
+                                                   EGA_get_fn("dict"));
+                call->children().swap(top->children());
+                top = call;
+            }
+            EGA_check_arity(*top);
+            expr = top;
+            stack.pop_back();
+            dicts.pop_back();
         }
-
-        EGA_do_print("ERROR: unexpected token (3): '%s'\n", token_str().c_str());
     }
-
-    return nullptr;
 }
 
-arg_t TokenStream::visit_call(const std::string& name)
+arg_t TokenStream::visit_integer_literal()
 {
     PARSE_DEBUG();
 
-    if (token_type() != TOK_SYMBOL || token_str() != "(")
+    if (token_type() != TOK_INT)
         return nullptr;
 
+    const std::string& str = token()->get_str();
+    auto ai = make_arg<AstInt>(BigInt::from_digits(str.c_str(), str.size()), get_lineno());
     go_next();
+    return ai;
+}
 
-    auto list = make_arg<AstContainer>(AST_CALL, get_lineno(), name);
+arg_t TokenStream::visit_string_literal()
+{
+    PARSE_DEBUG();
 
-    if (token_type() == TOK_SYMBOL)
-    {
-        if (token_str() == ")")
-        {
-            go_next();
-            return list;
-        }
-    }
+    if (token_type() != TOK_STR)
+        return nullptr;
+    auto as = make_arg<AstStr>(token()->get_str(), get_lineno());
+    go_next();
+    return as;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Evaluation
+
+#if defined(NDEBUG) || 1
+    #define EVAL_DEBUG()
+#else
+    #define EVAL_DEBUG() do { puts(__func__); fflush(stdout); } while (0)
+#endif
 
-    if (auto expr = visit_expression())
+void EGA_set_max_depth(size_t depth)
+{
+    EGA_state().max_depth = depth;
+}
+
+size_t EGA_get_max_depth(void)
+{
+    return EGA_state().max_depth;
+}
+
+// Guards the real recursion of the evaluator (the special functions and the
+// defined variables), which still consumes the C++ stack.
+class EvalNesting
+{
+public:
+    EvalNesting(int lineno) : m_state(EGA_state())
     {
-        list->add(expr);
+        if (m_state.eval_nesting >= EGA_MAX_RECURSION || m_state.eval_nesting >= m_state.max_depth)
+            throw EGA_nesting_too_deep(lineno);
+        ++m_state.eval_nesting;
     }
-    else
+
+    ~EvalNesting()
     {
-        return nullptr;
+        --m_state.eval_nesting;
     }
 
-    for (;;)
+protected:
+    EGA_CONTEXT_DATA& m_state;
+};
+
+// Returns the container if its children are to be evaluated on the stack.
+static const AstContainer *EGA_stacked(const arg_t& ast)
+{
+    switch (ast->get_type())
     {
-        if (token_str() == ")")
-        {
-            go_next();
-            break;
-        }
-        else if (token_str() != ",")
+    case AST_ARRAY:
+    case AST_PROGRAM:
+        return static_cast<const AstContainer *>(ast.get());
+
+    case AST_CALL:
         {
+            auto call = static_cast<const AstContainer *>(ast.get());
+            const auto& fn = call->get_fn();
+            if (!fn || fn->normal)
+                return call;
             return nullptr;
         }
-        go_next();
 
-        if (auto expr = visit_expression())
-        {
-            list->add(expr);
-        }
-        else
-        {
-            break;
-        }
+    default:
+        return nullptr;
     }
+}
+
+static EvalFrame *EGA_push_frame(const AstContainer *node)
+{
+    auto& state = EGA_state();
+
+    if (state.eval_depth >= state.max_depth)
+        throw EGA_nesting_too_deep(node->get_lineno());
+
+    if (EGA_is_stopping())
+        throw EGA_control_break(0);
+
+    if (state.eval_depth == state.eval_frames.size())
+        state.eval_frames.emplace_back();
 
-    return list;
+    auto frame = &state.eval_frames[state.eval_depth++];
+    frame->node = node;
+    frame->index = 0;
+    frame->sequence = (node->get_type() != AST_ARRAY && !node->get_fn());
+    return frame;
 }
 
-arg_t TokenStream::visit_expression_list(AstType type, const std::string& name)
+inline void EGA_push_value(EvalFrame *frame, arg_t value)
 {
-    PARSE_DEBUG();
+    if (frame->sequence && frame->values.size())
+        frame->values[0] = std::move(value);
+    else
+        frame->values.push_back(std::move(value));
+}
 
-    size_t index = get_index();
+static arg_t EGA_eval_frame(EvalFrame *frame)
+{
+    auto node = frame->node;
 
-    auto expr = visit_expression();
-    if (!expr)
-        return nullptr;
+    if (node->get_type() == AST_ARRAY)
+    {
+        auto ret = make_arg<AstContainer>(AST_ARRAY);
+        ret->children().swap(frame->values);
+        return ret;
+    }
 
-    auto list = make_arg<AstContainer>(type, get_lineno(), name);
-    list->add(expr);
+    if (frame->sequence)
+        return frame->values.size() ? frame->values[0] : nullptr;
 
-    for (;;)
+    try
     {
-        if (token_type() == TOK_SYMBOL)
-        {
-            if (token_str() == ",")
-            {
-                go_next();
-                continue;
-            }
+        return (*(node->get_fn()->proc))(frame->values);
+    }
+    catch (EGA_exception& e)
+    {
+        if (e.get_lineno() == 0)
+            e.set_lineno(node->get_lineno());
+        throw;
+    }
+}
 
-            if (token_str() == ")" || token_str() == "}")
-            {
-                break;
-            }
+// Evaluates the tree of the normal function calls, the sequences and the
+// arrays by the evaluation stack, without recursion.
+static arg_t EGA_eval_stack(const AstContainer *root)
+{
+    auto& state = EGA_state();
+
+    struct Unwind
+    {
+        EGA_CONTEXT_DATA& state;
+        size_t base;
+
+        ~Unwind()
+        {
+            while (state.eval_depth > base)
+                state.eval_frames[--state.eval_depth].values.clear();
         }
+    } unwind = { state, state.eval_depth };
+
+    auto frame = EGA_push_frame(root);
 
-        expr = visit_expression();
-        if (!expr)
+    for (;;)
+    {
+        if (frame->index < frame->node->size())
         {
-            get_index() = index;
-            return nullptr;
+            const arg_t& child = (*frame->node)[frame->index++];
+            if (auto node = EGA_stacked(child))
+                frame = EGA_push_frame(node);
+            else
+                EGA_push_value(frame, child->eval());
+            continue;
         }
-        list->add(expr);
-    }
 
-    return list;
-}
+        auto value = EGA_eval_frame(frame);
+        frame->values.clear();
 
-//////////////////////////////////////////////////////////////////////////////
-// Evaluation
+        if (--state.eval_depth == unwind.base)
+            return value;
 
-#if defined(NDEBUG) || 1
-    #define EVAL_DEBUG()
-#else
-    #define EVAL_DEBUG() do { puts(__func__); fflush(stdout); } while (0)
-#endif
+        frame = &state.eval_frames[state.eval_depth - 1];
+        EGA_push_value(frame, std::move(value));
+    }
+}
 
 arg_t AstVar::eval() const
 {
@@ -759,65 +1321,44 @@ arg_t AstVar::eval() const
 
 arg_t AstContainer::eval() const
 {
-    if (EGA_is_stopping())
-        throw EGA_control_break(0);
+    EvalNesting nesting(m_lineno);
 
-    switch (m_type)
+    if (m_fn && !m_fn->normal)
     {
-    case AST_ARRAY:
-        if (auto ret = make_arg<AstContainer>(AST_ARRAY))
-        {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                ret->add(m_children[i]->eval());
-            }
-            return ret;
-        }
-        break;
-
-    case AST_CALL:
-        if (m_str.empty())
-            return EGA_eval_program(m_children);
-
-        if (!m_fn_cache)
-            m_fn_cache = EGA_get_fn(m_str);
-
-        if (m_fn_cache)
-        {
-            if (m_fn_cache->min_args <= m_children.size() && m_children.size() <= m_fn_cache->max_args)
-                return (*(m_fn_cache->proc))(m_children);
-            else
-                throw EGA_arity_exception(m_str, m_lineno);
-        }
-        return nullptr;
-
-    case AST_PROGRAM:
-        return EGA_eval_program(m_children);
+        if (EGA_is_stopping())
+            throw EGA_control_break(0);
 
-    default:
-        assert(0);
-        break;
+        return (*(m_fn->proc))(m_children);
     }
 
-    return nullptr;
+    return EGA_eval_stack(this);
 }
 
-
 fn_t EGA_get_fn(const std::string& name)
 {
     EVAL_DEBUG();
-    fn_map_t::iterator it = s_fn_map.find(name);
-    if (it == s_fn_map.end())
+    auto& state = EGA_state();
+
+    fn_map_t::iterator it = state.fn_map->find(name);
+    if (it == state.fn_map->end())
         return nullptr;
     return it->second;
 }
 
 bool
 EGA_add_fn(const std::string& name, size_t min_args, size_t max_args,
-           EGA_PROC proc, const std::string& help)
+           EGA_PROC proc, const std::string& help, bool normal)
 {
-    auto fn = std::make_shared<EGA_FUNCTION>(name, min_args, max_args, proc, help);
-    s_fn_map[name] = fn;
+    auto fn = std::make_shared<EGA_FUNCTION>(name, min_args, max_args, proc, help, normal);
+
+    // Copy on write. The child contexts may share the table.
+    auto& fn_map = EGA_state().fn_map;
+    if (fn_map.use_count() > 1)
+        fn_map = std::make_shared<fn_map_t>(*fn_map);
+    (*fn_map)[name] = fn;
+
+    // The cached programs were parsed with the old function table.
+    EGA_clear_program_cache();
     return true;
 }
 
@@ -825,10 +1366,30 @@ arg_t EGA_eval_var(const std::string& name, int lineno)
 {
     EVAL_DEBUG();
 
-    var_map_t::iterator it = s_var_map.find(name);
-    if (it == s_var_map.end() || !it->second)
+    auto& state = EGA_state();
+
+    var_map_t::iterator it = state.var_map.find(name);
+    if (it == state.var_map.end() || !it->second)
         throw EGA_undefined_variable(name, lineno);
 
+    // A dict is shared, not copied. It is copied on write (see EGA_set).
+    // An intarray is never modified, so it is shared too.
+    // A buffer is copied on write (see EGA_write_int).
+    // A strbuf is copied on write (see EGA_append).
+    // The copies of a generator share the state anyway.
+    switch (it->second->get_type())
+    {
+    case AST_DICT:
+    case AST_INTARRAY:
+    case AST_BUFFER:
+    case AST_STRBUF:
+    case AST_GENERATOR:
+        return it->second;
+    default:
+        break;
+    }
+
+    EvalNesting nesting(lineno);
     return it->second->eval();
 }
 
@@ -857,9 +1418,22 @@ EGA_eval_fn(const std::string& name, const args_t& args, int lineno)
         if (auto fn = EGA_get_fn(name))
         {
             if (fn->min_args <= args.size() && args.size() <= fn->max_args)
-                return (*(fn->proc))(args);
+            {
+                if (!fn->normal)
+                    return (*(fn->proc))(args);
+
+                args_t values;
+                values.reserve(args.size());
+                for (const auto& arg : args)
+                {
+                    values.push_back(EGA_eval_arg(arg, false));
+                }
+                return (*(fn->proc))(values);
+            }
             else
+            {
                 throw EGA_arity_exception(name, lineno);
+            }
         }
     }
     else
@@ -892,7 +1466,41 @@ arg_t EGA_eval_arg(const arg_t& ast)
     return EGA_eval_arg(ast, false);
 }
 
-void EGA_eval_text(const char *text)
+// Checks an argument of a normal function, which is already evaluated.
+inline const arg_t& EGA_value(const arg_t& arg)
+{
+    if (!arg)
+        throw EGA_illegal_operation(0);
+    return arg;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// The program cache
+//
+// The parsed programs are immutable, so the same source text can reuse the
+// same program. The cache is an LRU list with a hash map into it.
+
+void EGA_set_program_cache_size(size_t size)
+{
+    auto& state = EGA_state();
+
+    state.program_cache_size = size;
+    while (state.program_list.size() > state.program_cache_size)
+    {
+        state.program_map.erase(state.program_list.back().first);
+        state.program_list.pop_back();
+    }
+}
+
+void EGA_clear_program_cache(void)
+{
+    auto& state = EGA_state();
+
+    state.program_map.clear();
+    state.program_list.clear();
+}
+
+static arg_t EGA_parse_text(const char *text)
 {
     TokenStream stream;
     int lineno = 1;
@@ -903,6 +1511,38 @@ void EGA_eval_text(const char *text)
     if (!ast)
         throw EGA_syntax_error(stream.get_lineno());
 
+    return ast;
+}
+
+arg_t EGA_get_program(const std::string& text)
+{
+    auto& state = EGA_state();
+
+    auto it = state.program_map.find(text);
+    if (it != state.program_map.end())
+    {
+        state.program_list.splice(state.program_list.begin(), state.program_list, it->second);
+        return it->second->second;
+    }
+
+    auto ast = EGA_parse_text(text.c_str());
+    if (state.program_cache_size > 0)
+    {
+        if (state.program_list.size() >= state.program_cache_size)
+        {
+            state.program_map.erase(state.program_list.back().first);
+            state.program_list.pop_back();
+        }
+        state.program_list.emplace_front(text, ast);
+        state.program_map[text] = state.program_list.begin();
+    }
+    return ast;
+}
+
+void EGA_eval_text(const char *text)
+{
+    auto ast = EGA_get_program(text);
+
     auto evaled = EGA_eval_arg(ast, false);
     if (evaled)
     {
@@ -933,7 +1573,7 @@ bool EGA_eval_text_ex(const char *text)
     }
     catch (EGA_exception& e)
     {
-        if (s_interactive || e.get_lineno() == 0)
+        if (EGA_state().interactive || e.get_lineno() == 0)
             EGA_do_print("ERROR: %s\n", e.what());
         else
             EGA_do_print("ERROR: %s at Line %d\n", e.what(), e.get_lineno());
@@ -941,121 +1581,461 @@ bool EGA_eval_text_ex(const char *text)
     return true;
 }
 
-int EGA_get_int(const arg_t& ast)
+program_t EGA_compile(const char *text)
 {
-    EVAL_DEBUG();
-    if (ast->get_type() != AST_INT)
-        throw EGA_type_mismatch(ast->get_lineno());
-    return std::static_pointer_cast<AstInt>(ast)->get_int();
+    return std::make_shared<EGA_PROGRAM>(text, EGA_get_program(text));
 }
 
-std::shared_ptr<AstContainer> EGA_get_array(const arg_t& ast)
+// Sets the input variables and restores the old values at the end of a run.
+class EGA_BINDINGS
 {
-    EVAL_DEBUG();
-    if (ast->get_type() != AST_ARRAY)
-        throw EGA_type_mismatch(ast->get_lineno());
-    return std::static_pointer_cast<AstContainer>(ast);
-}
+public:
+    EGA_BINDINGS(const bindings_t& bindings)
+    {
+        m_old.reserve(bindings.size());
+        for (auto& pair : bindings)
+        {
+            auto& vars = EGA_state().var_map;
+            auto it = vars.find(pair.first);
+            m_old.emplace_back(pair.first, it != vars.end() ? it->second : nullptr);
+            EGA_set_var(pair.first, pair.second);
+        }
+    }
 
-std::string EGA_get_str(const arg_t& ast)
-{
-    EVAL_DEBUG();
-    if (ast->get_type() != AST_STR)
-        throw EGA_type_mismatch(ast->get_lineno());
-    return std::static_pointer_cast<AstStr>(ast)->get_str();
-}
+    ~EGA_BINDINGS()
+    {
+        for (auto it = m_old.rbegin(); it != m_old.rend(); ++it)
+            EGA_set_var(it->first, it->second);
+    }
 
-std::shared_ptr<AstInt>
-EGA_compare_0(const arg_t& a1, const arg_t& a2)
-{
-    EVAL_DEBUG();
+protected:
+    bindings_t m_old;
+};
 
-    auto ast1 = EGA_eval_arg(a1, true);
-    auto ast2 = EGA_eval_arg(a2, true);
+arg_t EGA_run(const program_t& program, const bindings_t& bindings)
+{
+    EGA_BINDINGS binder(bindings);
 
-    if (ast1->get_type() < ast2->get_type())
+    try
     {
-        return make_arg<AstInt>(-1);
+        return EGA_eval_arg(program->ast, false);
     }
-
-    if (ast1->get_type() > ast2->get_type())
+    catch (EGA_control_break&)
     {
-        return make_arg<AstInt>(1);
+        return nullptr;
     }
-
-    switch (ast1->get_type())
+    catch (EGA_exit_exception& e)
     {
-    case AST_ARRAY:
+        if (e.m_arg)
+            return EGA_eval_arg(e.m_arg, false);
+        return nullptr;
+    }
+}
+
+static const AstInt *EGA_get_ai(const arg_t& ast)
+{
+    if (ast->get_type() != AST_INT)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return static_cast<const AstInt *>(ast.get());
+}
+
+int EGA_get_int(const arg_t& ast)
+{
+    EVAL_DEBUG();
+    auto ai = EGA_get_ai(ast);
+    if (ai->is_big() || ai->get_int() < INT_MIN || ai->get_int() > INT_MAX)
+        throw EGA_illegal_operation(ast->get_lineno());
+    return int(ai->get_int());
+}
+
+// For the bitwise operations. A bignum is not allowed.
+static long long EGA_get_ll(const arg_t& ast)
+{
+    auto ai = EGA_get_ai(ast);
+    if (ai->is_big())
+        throw EGA_illegal_operation(ast->get_lineno());
+    return ai->get_int();
+}
+
+static bool EGA_get_bool(const arg_t& ast)
+{
+    auto ai = EGA_get_ai(ast);
+    return ai->is_big() || ai->get_int() != 0;
+}
+
+// Parses an integer like atoi, without the limit of the size.
+// Parses a decimal integer with optional spaces around it. Unlike atoi, a
+// string without digits or with other characters after them is an error.
+static arg_t EGA_parse_int(const std::string& str, int lineno)
+{
+    const char *pch = str.c_str();
+    while (is_space(*pch))
+        ++pch;
+
+    bool negative = false;
+    if (*pch == '+' || *pch == '-')
+    {
+        negative = (*pch == '-');
+        ++pch;
+    }
+
+    const char *start = pch;
+    while (is_digit(*pch))
+        ++pch;
+    size_t len = pch - start;
+
+    while (is_space(*pch))
+        ++pch;
+    if (len == 0 || pch != str.c_str() + str.size())
+        throw EGA_illegal_operation(lineno);
+
+    long long value;
+    if (mstr_parse_int(start, len, negative, value))
+        return make_arg<AstInt>(value);
+
+    return make_arg<AstInt>(BigInt::from_digits(start, len, negative));
+}
+
+std::shared_ptr<AstContainer> EGA_get_array(const arg_t& ast)
+{
+    EVAL_DEBUG();
+    if (ast->get_type() == AST_INTARRAY)
+    {
+        // Unpack it for the functions of the arrays.
+        auto& values = static_cast<AstIntArray *>(ast.get())->values();
+        auto array = make_arg<AstContainer>(AST_ARRAY, ast->get_lineno());
+        array->children().reserve(values.size());
+        for (auto value : values)
+            array->add(make_arg<AstInt>(value));
+        return array;
+    }
+    if (ast->get_type() != AST_ARRAY)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return std::static_pointer_cast<AstContainer>(ast);
+}
+
+std::shared_ptr<AstDict> EGA_get_dict(const arg_t& ast)
+{
+    EVAL_DEBUG();
+    if (ast->get_type() != AST_DICT)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return std::static_pointer_cast<AstDict>(ast);
+}
+
+std::shared_ptr<AstBuffer> EGA_get_buffer(const arg_t& ast)
+{
+    EVAL_DEBUG();
+    if (ast->get_type() != AST_BUFFER)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return std::static_pointer_cast<AstBuffer>(ast);
+}
+
+std::string EGA_get_str(const arg_t& ast)
+{
+    EVAL_DEBUG();
+    if (ast->get_type() == AST_BUFFER)
+        return static_cast<AstBuffer *>(ast.get())->str();
+    if (ast->get_type() == AST_STRBUF)
+        return static_cast<AstStrBuf *>(ast.get())->get_str();
+    if (ast->get_type() != AST_STR)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return std::static_pointer_cast<AstStr>(ast)->get_str();
+}
+
+// Same as EGA_get_str, without copying. Valid while ast lives.
+static const std::string& EGA_get_str_ref(const arg_t& ast)
+{
+    if (ast->get_type() != AST_STR)
+        throw EGA_type_mismatch(ast->get_lineno());
+    return static_cast<AstStr *>(ast.get())->get_str();
+}
+
+// Gets the bytes of a string, a buffer or a strbuf without copying.
+// Valid while ast lives.
+static void EGA_get_bytes(const arg_t& ast, const char *& data, size_t& size)
+{
+    switch (ast->get_type())
+    {
+    case AST_STR:
+        data = static_cast<AstStr *>(ast.get())->get_str().data();
+        size = static_cast<AstStr *>(ast.get())->get_str().size();
+        break;
+    case AST_STRBUF:
+        data = static_cast<AstStrBuf *>(ast.get())->get_str().data();
+        size = static_cast<AstStrBuf *>(ast.get())->get_str().size();
+        break;
+    case AST_BUFFER:
+        data = static_cast<AstBuffer *>(ast.get())->data();
+        size = static_cast<AstBuffer *>(ast.get())->size();
+        break;
+    default:
+        throw EGA_type_mismatch(ast->get_lineno());
+    }
+}
+
+// An item of an array for EGA_compare_values. If ast is null, then the item
+// is the integer value of an intarray.
+struct EGA_CompareItem
+{
+    const AstBase *ast;
+    long long value;
+};
+
+// An intarray is compared as an array, and a strbuf or a buffer as a string.
+inline AstType EGA_compare_type(const EGA_CompareItem& item)
+{
+    if (!item.ast)
+        return AST_INT;
+    switch (item.ast->get_type())
+    {
+    case AST_INTARRAY:
+        return AST_ARRAY;
+    case AST_STRBUF:
+    case AST_BUFFER:
+        return AST_STR;
+    default:
+        return item.ast->get_type();
+    }
+}
+
+inline void EGA_compare_bytes_of(const AstBase *ast, const char *& data, size_t& size)
+{
+    switch (ast->get_type())
+    {
+    case AST_STR:
+        data = static_cast<const AstStr *>(ast)->get_str().data();
+        size = static_cast<const AstStr *>(ast)->get_str().size();
+        break;
+    case AST_STRBUF:
+        data = static_cast<const AstStrBuf *>(ast)->get_str().data();
+        size = static_cast<const AstStrBuf *>(ast)->get_str().size();
+        break;
+    default:
+        data = static_cast<const AstBuffer *>(ast)->data();
+        size = static_cast<const AstBuffer *>(ast)->size();
+        break;
+    }
+}
+
+inline size_t EGA_compare_size(const AstBase *seq)
+{
+    if (seq->get_type() == AST_INTARRAY)
+        return static_cast<const AstIntArray *>(seq)->size();
+    return static_cast<const AstContainer *>(seq)->size();
+}
+
+inline EGA_CompareItem EGA_compare_at(const AstBase *seq, size_t index)
+{
+    EGA_CompareItem item = { nullptr, 0 };
+    if (seq->get_type() == AST_INTARRAY)
+        item.value = static_cast<const AstIntArray *>(seq)->values()[index];
+    else
+        item.ast = (*static_cast<const AstContainer *>(seq))[index].get();
+    if (item.ast == nullptr && seq->get_type() != AST_INTARRAY)
+        throw EGA_illegal_operation(seq->get_lineno());
+    return item;
+}
+
+inline int EGA_compare_bytes(const char *p1, size_t n1, const char *p2, size_t n2)
+{
+    int cmp = std::memcmp(p1, p2, std::min(n1, n2));
+    if (cmp == 0 && n1 != n2)
+        return (n1 < n2) ? -1 : 1;
+    return (cmp > 0) - (cmp < 0);
+}
+
+int EGA_compare_values(const AstBase *a1, const AstBase *a2);
+
+// Compares two items that are not both arrays. Returns false if both are arrays.
+static bool
+EGA_compare_items(const EGA_CompareItem& x, const EGA_CompareItem& y, int& cmp)
+{
+    AstType type1 = EGA_compare_type(x), type2 = EGA_compare_type(y);
+    if (type1 != type2)
+    {
+        cmp = (type1 < type2) ? -1 : 1;
+        return true;
+    }
+
+    switch (type1)
+    {
+    case AST_ARRAY:
+        return false;
+    case AST_INT:
         {
-#undef min
-            auto array1 = std::static_pointer_cast<AstContainer>(ast1);
-            auto array2 = std::static_pointer_cast<AstContainer>(ast2);
-            size_t size = std::min(array1->size(), array2->size());
-            for (size_t i = 0; i < size; ++i)
+            auto ai1 = static_cast<const AstInt *>(x.ast);
+            auto ai2 = static_cast<const AstInt *>(y.ast);
+            if ((ai1 && ai1->is_big()) || (ai2 && ai2->is_big()))
             {
-                auto ai = EGA_compare_0((*array1)[i], (*array2)[i]);
-                if (ai == nullptr)
-                {
-                    return nullptr;
-                }
-                if (EGA_get_int(ai) != 0)
+                BigInt big1 = ai1 ? ai1->get_big() : BigInt(x.value);
+                BigInt big2 = ai2 ? ai2->get_big() : BigInt(y.value);
+                cmp = big1.compare(big2);
+                return true;
+            }
+            long long i1 = ai1 ? ai1->get_int() : x.value;
+            long long i2 = ai2 ? ai2->get_int() : y.value;
+            cmp = (i1 > i2) - (i1 < i2);
+            return true;
+        }
+    case AST_STR:
+        {
+            const char *data1, *data2;
+            size_t size1, size2;
+            EGA_compare_bytes_of(x.ast, data1, size1);
+            EGA_compare_bytes_of(y.ast, data2, size2);
+            cmp = EGA_compare_bytes(data1, size1, data2, size2);
+            return true;
+        }
+    case AST_DICT:
+        {
+            // Compares the entries in the order of the keys.
+            auto sorted_entries = [](const AstDict& dict) {
+                std::vector<const AstDict::Entry *> entries;
+                entries.reserve(dict.size());
+                for (auto& entry : dict.entries())
                 {
-                    return ai;
+                    if (entry.key)
+                        entries.push_back(&entry);
                 }
-            }
-            if (array1->size() < array2->size())
+                std::sort(entries.begin(), entries.end(),
+                    [](const AstDict::Entry *e1, const AstDict::Entry *e2) {
+                        return EGA_compare_values(e1->key.get(), e2->key.get()) < 0;
+                    });
+                return entries;
+            };
+            auto entries1 = sorted_entries(*static_cast<const AstDict *>(x.ast));
+            auto entries2 = sorted_entries(*static_cast<const AstDict *>(y.ast));
+            size_t size = std::min(entries1.size(), entries2.size());
+            for (size_t i = 0; i < size; ++i)
             {
-                return make_arg<AstInt>(-1);
+                cmp = EGA_compare_values(entries1[i]->key.get(), entries2[i]->key.get());
+                if (cmp != 0)
+                    return true;
+                cmp = EGA_compare_values(entries1[i]->value.get(), entries2[i]->value.get());
+                if (cmp != 0)
+                    return true;
             }
-            if (array1->size() > array2->size())
+            cmp = (entries1.size() > entries2.size()) - (entries1.size() < entries2.size());
+            return true;
+        }
+    default:
+        throw EGA_type_mismatch(x.ast->get_lineno());
+    }
+}
+
+// Compares two evaluated values. Returns -1, 0 or 1.
+// Nothing is copied or allocated, except the stack of the nested arrays.
+int EGA_compare_values(const AstBase *a1, const AstBase *a2)
+{
+    EVAL_DEBUG();
+
+    if (!a1 || !a2)
+        throw EGA_illegal_operation(0);
+
+    // Walk the nested arrays by an explicit stack, not by recursion.
+    struct Frame
+    {
+        const AstBase *seq1;
+        const AstBase *seq2;
+        size_t index;
+    };
+    std::vector<Frame> outer;
+    Frame frame = { nullptr, nullptr, 0 };
+
+    EGA_CompareItem x = { a1, 0 }, y = { a2, 0 };
+    for (;;)
+    {
+        int cmp;
+        if (EGA_compare_items(x, y, cmp))
+        {
+            if (cmp != 0)
+                return cmp;
+        }
+        else if (x.ast->get_type() == AST_INTARRAY && y.ast->get_type() == AST_INTARRAY)
+        {
+            auto& values1 = static_cast<const AstIntArray *>(x.ast)->values();
+            auto& values2 = static_cast<const AstIntArray *>(y.ast)->values();
+            size_t size = std::min(values1.size(), values2.size());
+            for (size_t i = 0; i < size; ++i)
             {
-                return make_arg<AstInt>(1);
+                if (values1[i] != values2[i])
+                    return (values1[i] < values2[i]) ? -1 : 1;
             }
-            return make_arg<AstInt>(0);
+            if (values1.size() != values2.size())
+                return (values1.size() < values2.size()) ? -1 : 1;
         }
-    case AST_INT:
+        else
         {
-            int i1 = EGA_get_int(ast1);
-            int i2 = EGA_get_int(ast2);
-            if (i1 < i2)
-                return make_arg<AstInt>(-1);
-            if (i1 > i2)
-                return make_arg<AstInt>(1);
-            return make_arg<AstInt>(0);
+            if (frame.seq1)
+                outer.push_back(frame);
+            frame.seq1 = x.ast;
+            frame.seq2 = y.ast;
+            frame.index = 0;
         }
-    case AST_STR:
+
+        // Go to the next items.
+        for (;;)
         {
-            std::string str1 = EGA_get_str(ast1);
-            std::string str2 = EGA_get_str(ast2);
-            if (str1 < str2)
-                return make_arg<AstInt>(-1);
-            if (str1 > str2)
-                return make_arg<AstInt>(1);
-            return make_arg<AstInt>(0);
+            if (!frame.seq1)
+                return 0;
+
+            size_t size1 = EGA_compare_size(frame.seq1);
+            size_t size2 = EGA_compare_size(frame.seq2);
+            if (frame.index < size1 && frame.index < size2)
+            {
+                x = EGA_compare_at(frame.seq1, frame.index);
+                y = EGA_compare_at(frame.seq2, frame.index);
+                ++frame.index;
+                break;
+            }
+            if (size1 != size2)
+                return (size1 < size2) ? -1 : 1;
+
+            if (outer.empty())
+            {
+                frame.seq1 = nullptr;
+            }
+            else
+            {
+                frame = outer.back();
+                outer.pop_back();
+            }
         }
-    default:
-        throw EGA_type_mismatch(a1->get_lineno());
     }
+}
 
-    return nullptr;
+inline int EGA_compare_values(const arg_t& a1, const arg_t& a2)
+{
+    return EGA_compare_values(EGA_value(a1).get(), EGA_value(a2).get());
+}
+
+std::shared_ptr<AstInt>
+EGA_compare_0(const arg_t& a1, const arg_t& a2)
+{
+    EVAL_DEBUG();
+    return make_arg<AstInt>(EGA_compare_values(a1, a2));
 }
 
 arg_t EGA_FN EGA_binary(const args_t& args)
 {
     EVAL_DEBUG();
 
-    std::string str;
+    // Reserve the size first, then append.
+    size_t size = 0;
     for (const auto& arg : args)
     {
-        if (auto ast = EGA_eval_arg(arg, true))
+        if (const auto& ast = EGA_value(arg))
         {
             switch (ast->get_type())
             {
             case AST_INT:
-                str += (char)EGA_get_int(ast);
+                ++size;
                 break;
             case AST_STR:
-                str += EGA_get_str(ast);
+                size += EGA_get_str_ref(ast).size();
+                break;
+            case AST_BUFFER:
+                size += EGA_get_buffer(ast)->size();
                 break;
             default:
                 throw EGA_type_mismatch(ast->get_lineno());
@@ -1063,55 +2043,58 @@ arg_t EGA_FN EGA_binary(const args_t& args)
         }
     }
 
-    return make_arg<AstStr>(str);
+    std::string str;
+    str.reserve(size);
+    for (const auto& arg : args)
+    {
+        switch (arg->get_type())
+        {
+        case AST_INT:
+            str += (char)EGA_get_int(arg);
+            break;
+        case AST_STR:
+            str += EGA_get_str_ref(arg);
+            break;
+        default:
+            {
+                auto buf = EGA_get_buffer(arg);
+                str.append(buf->data(), buf->size());
+            }
+            break;
+        }
+    }
+
+    return make_arg<AstStr>(std::move(str));
 }
 
 arg_t EGA_FN EGA_u16fromu8(const args_t& args)
 {
     EVAL_DEBUG();
 
-    std::string ret;
-    if (auto ast = EGA_eval_arg(args[0], true))
+    auto ret = make_arg<AstStr>();
+    if (const auto& ast = EGA_value(args[0]))
     {
-        std::string utf8 = EGA_get_str(ast);
-#ifdef _WIN32
-        std::wstring utf16;
-        if (UTF_u8_to_L<'?'>(utf8, utf16))
-        {
-            ret.assign((const char *)utf16.c_str(),
-                       (const char *)utf16.c_str() + utf16.size() * sizeof(wchar_t));
-        }
-#else
-        std::u16string utf16;
-        if (UTF_u8_to_u<'?'>(utf8, utf16))
-        {
-            ret.assign((const char *)utf16.c_str(),
-                       (const char *)utf16.c_str() + utf16.size() * sizeof(char16_t));
-        }
-#endif
+        const char *data;
+        size_t size;
+        EGA_get_bytes(ast, data, size);
+        utfvec_u16_from_u8(data, size, ret->get_str());
     }
-    return make_arg<AstStr>(ret);
+    return ret;
 }
 
 arg_t EGA_FN EGA_u8fromu16(const args_t& args)
 {
     EVAL_DEBUG();
 
-    std::string utf8;
-    if (auto ast = EGA_eval_arg(args[0], true))
+    auto ret = make_arg<AstStr>();
+    if (const auto& ast = EGA_value(args[0]))
     {
-        std::string u16 = EGA_get_str(ast);
-#ifdef _WIN32
-        const wchar_t *psz = reinterpret_cast<const wchar_t *>(u16.c_str());
-        std::wstring utf16(psz, psz + (u16.size() / sizeof(wchar_t)));
-        UTF_L_to_u8<'?'>(utf16, utf8);
-#else
-        const char16_t *psz = reinterpret_cast<const char16_t *>(u16.c_str());
-        std::u16string utf16(psz, psz + (u16.size() / sizeof(char16_t)));
-        UTF_u_to_u8<'?'>(utf16, utf8);
-#endif
+        const char *data;
+        size_t size;
+        EGA_get_bytes(ast, data, size);
+        utfvec_u8_from_u16(data, size / 2, ret->get_str());
     }
-    return make_arg<AstStr>(utf8);
+    return ret;
 }
 
 arg_t EGA_FN EGA_hex(const args_t& args)
@@ -1119,12 +2102,26 @@ arg_t EGA_FN EGA_hex(const args_t& args)
     EVAL_DEBUG();
 
     std::string ret;
-    if (auto ast = EGA_eval_arg(args[0], true))
+    if (const auto& ast = EGA_value(args[0]))
     {
-        int value = EGA_get_int(ast);
-        char buf[32];
-        std::sprintf(buf, "%X", value);
-        ret = buf;
+        auto ai = EGA_get_ai(ast);
+        if (ai->is_big())
+        {
+            ret = ai->get_big().to_hex();
+        }
+        else
+        {
+            // A negative int is shown in 32-bit two's complement as before.
+            long long value = ai->get_int();
+            char buf[32];
+            if (INT_MIN <= value && value < 0)
+                std::sprintf(buf, "%X", unsigned(value));
+            else if (value < 0)
+                std::sprintf(buf, "-%llX", 0 - (unsigned long long)value);
+            else
+                std::sprintf(buf, "%llX", (unsigned long long)value);
+            ret = buf;
+        }
     }
     return make_arg<AstStr>(ret);
 }
@@ -1133,115 +2130,119 @@ arg_t EGA_FN EGA_compare(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        return ai;
-    }
-    return nullptr;
+    return EGA_compare_0(args[0], args[1]);
 }
 
 arg_t EGA_FN EGA_less(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        ai->get_int() = (ai->get_int() < 0);
-        return ai;
-    }
-    return nullptr;
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) < 0);
 }
 
 arg_t EGA_FN EGA_greater(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        ai->get_int() = (ai->get_int() > 0);
-        return ai;
-    }
-    return nullptr;
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) > 0);
 }
 
 arg_t EGA_FN EGA_less_equal(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        ai->get_int() = (ai->get_int() <= 0);
-        return ai;
-    }
-    return nullptr;
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) <= 0);
 }
 
 arg_t EGA_FN EGA_greater_equal(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        ai->get_int() = (ai->get_int() >= 0);
-        return ai;
-    }
-    return nullptr;
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) >= 0);
 }
 
 arg_t EGA_FN EGA_equal(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
-    {
-        ai->get_int() = (ai->get_int() == 0);
-        return ai;
-    }
-    return nullptr;
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) == 0);
 }
 
 arg_t EGA_FN EGA_not_equal(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ai = EGA_compare_0(args[0], args[1]))
+    return make_arg<AstInt>(EGA_compare_values(args[0], args[1]) != 0);
+}
+
+// Formats the values for print into one buffer.
+static void EGA_format_print(std::string& out, const args_t& args)
+{
+    for (size_t i = 0; i < args.size(); ++i)
     {
-        ai->get_int() = (ai->get_int() != 0);
-        return ai;
+        const arg_t& ast = args[i];
+        if (!ast)
+            continue;
+
+        switch (ast->get_type())
+        {
+        case AST_INT:
+            if (!static_cast<AstInt *>(ast.get())->is_big())
+            {
+                mstr_append_int(out, static_cast<AstInt *>(ast.get())->get_int());
+                break;
+            }
+            out += ast->dump(false);
+            break;
+        case AST_STR:
+            out += EGA_get_str_ref(ast);
+            break;
+        case AST_STRBUF:
+            out += static_cast<AstStrBuf *>(ast.get())->get_str();
+            break;
+        default:
+            out += ast->dump(false);
+            break;
+        }
     }
-    return nullptr;
 }
 
-arg_t EGA_FN EGA_print(const args_t& args)
+// Formats the values for dump into one buffer.
+static void EGA_format_dump(std::string& out, const args_t& args)
 {
-    EVAL_DEBUG();
-
     for (size_t i = 0; i < args.size(); ++i)
     {
-        if (auto ast = EGA_eval_arg(args[i], false))
+        if (auto ast = args[i])
         {
-            EGA_do_print("%s", ast->dump(false).c_str());
+            if (i != 0)
+                out += ", ";
+            out += ast->dump(true);
         }
     }
-    return nullptr;
 }
 
-arg_t EGA_FN EGA_println(const args_t& args)
+arg_t EGA_FN EGA_print(const args_t& args)
 {
     EVAL_DEBUG();
 
-    EGA_print(args);
-    EGA_do_print("\n");
+    std::string out;
+    EGA_format_print(out, args);
+    EGA_do_print("%s", out.c_str());
     return nullptr;
 }
 
-arg_t EGA_FN EGA_dump(const args_t& args)
+arg_t EGA_FN EGA_println(const args_t& args)
 {
     EVAL_DEBUG();
 
-    for (size_t i = 0; i < args.size(); ++i)
-    {
-        if (auto ast = EGA_eval_arg(args[i]))
-        {
-            if (i != 0)
-                EGA_do_print(", ");
-            EGA_do_print("%s", ast->dump(true).c_str());
-        }
-    }
+    std::string out;
+    EGA_format_print(out, args);
+    out += '\n';
+    EGA_do_print("%s", out.c_str());
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_dump(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    std::string out;
+    EGA_format_dump(out, args);
+    EGA_do_print("%s", out.c_str());
     return nullptr;
 }
 
@@ -1249,8 +2250,10 @@ arg_t EGA_FN EGA_dumpln(const args_t& args)
 {
     EVAL_DEBUG();
 
-    EGA_dump(args);
-    EGA_do_print("\n");
+    std::string out;
+    EGA_format_dump(out, args);
+    out += '\n';
+    EGA_do_print("%s", out.c_str());
     return nullptr;
 }
 
@@ -1321,7 +2324,7 @@ bool EGA_file_security(std::string& filename)
 arg_t EGA_FN EGA_len(const args_t& args)
 {
     EVAL_DEBUG();
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (const auto& ast1 = EGA_value(args[0]))
     {
         switch (ast1->get_type())
         {
@@ -1337,6 +2340,30 @@ arg_t EGA_FN EGA_len(const args_t& args)
                 return make_arg<AstInt>(len);
             }
 
+        case AST_DICT:
+            {
+                int len = int(EGA_get_dict(ast1)->size());
+                return make_arg<AstInt>(len);
+            }
+
+        case AST_INTARRAY:
+            {
+                int len = int(static_cast<AstIntArray *>(ast1.get())->size());
+                return make_arg<AstInt>(len);
+            }
+
+        case AST_BUFFER:
+            {
+                int len = int(EGA_get_buffer(ast1)->size());
+                return make_arg<AstInt>(len);
+            }
+
+        case AST_STRBUF:
+            {
+                int len = int(static_cast<AstStrBuf *>(ast1.get())->get_str().size());
+                return make_arg<AstInt>(len);
+            }
+
         default:
             throw EGA_type_mismatch(args[0]->get_lineno());
         }
@@ -1348,7 +2375,7 @@ arg_t EGA_FN EGA_cat(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (const auto& ast1 = EGA_value(args[0]))
     {
         switch (ast1->get_type())
         {
@@ -1357,19 +2384,64 @@ arg_t EGA_FN EGA_cat(const args_t& args)
                 std::string str = EGA_get_str(ast1);
                 for (size_t i = 1; i < args.size(); ++i)
                 {
-                    ast1 = args[i]->eval();
-                    str += EGA_get_str(ast1);
+                    str += EGA_get_str(EGA_value(args[i]));
                 }
                 return make_arg<AstStr>(str);
             }
 
+        case AST_BUFFER:
+            {
+                // Concatenate the buffers and the strings into a buffer.
+                size_t size = 0;
+                for (auto& arg : args)
+                {
+                    auto ast = EGA_value(arg);
+                    if (ast->get_type() == AST_BUFFER)
+                        size += EGA_get_buffer(ast)->size();
+                    else
+                        size += EGA_get_str_ref(ast).size();
+                }
+                std::string bytes;
+                bytes.reserve(size);
+                for (auto& arg : args)
+                {
+                    if (arg->get_type() == AST_BUFFER)
+                    {
+                        auto buf = EGA_get_buffer(arg);
+                        bytes.append(buf->data(), buf->size());
+                    }
+                    else
+                    {
+                        bytes += EGA_get_str_ref(arg);
+                    }
+                }
+                return make_arg<AstBuffer>(std::move(bytes));
+            }
+
+        case AST_INTARRAY:
+            {
+                // Concatenate the intarrays as packed.
+                std::vector<long long> values;
+                size_t i;
+                for (i = 0; i < args.size(); ++i)
+                {
+                    auto ast = EGA_value(args[i]);
+                    if (ast->get_type() != AST_INTARRAY)
+                        break;
+                    auto& values2 = static_cast<AstIntArray *>(ast.get())->values();
+                    values.insert(values.end(), values2.begin(), values2.end());
+                }
+                if (i == args.size())
+                    return make_arg<AstIntArray>(std::move(values));
+            }
+            // FALL THROUGH
         case AST_ARRAY:
             if (auto array = make_arg<AstContainer>(AST_ARRAY))
             {
                 for (size_t i = 0; i < args.size(); ++i)
                 {
-                    auto ast = EGA_eval_arg(args[i], true);
-                    if (ast->get_type() != AST_ARRAY)
+                    auto ast = EGA_value(args[i]);
+                    if (ast->get_type() != AST_ARRAY && ast->get_type() != AST_INTARRAY)
                         throw EGA_type_mismatch(args[i]->get_lineno());
 
                     if (auto array2 = EGA_get_array(ast))
@@ -1392,33 +2464,167 @@ arg_t EGA_FN EGA_cat(const args_t& args)
     return nullptr;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Packed integer arrays
+//
+// An intarray keeps the 64-bit integers contiguously, so the operations on it
+// are vectorized (see intvec.hpp). The functions of the arrays unpack it.
+
+static bool EGA_has_intarray(const args_t& args)
+{
+    for (auto& arg : args)
+    {
+        if (arg && arg->get_type() == AST_INTARRAY)
+            return true;
+    }
+    return false;
+}
+
+// Gets an operand of the elementwise operations as packed.
+// An integer is broadcast by step 0.
+static bool EGA_get_packed(const arg_t& ast, const long long *& data, size_t& step,
+                           long long& scalar)
+{
+    if (ast->get_type() == AST_INTARRAY)
+    {
+        data = static_cast<AstIntArray *>(ast.get())->values().data();
+        step = 1;
+        return true;
+    }
+    if (ast->get_type() == AST_INT && !EGA_get_ai(ast)->is_big())
+    {
+        scalar = EGA_get_ai(ast)->get_int();
+        data = &scalar;
+        step = 0;
+        return true;
+    }
+    return false;
+}
+
+static arg_t EGA_get_item(const arg_t& ast, size_t index)
+{
+    switch (ast->get_type())
+    {
+    case AST_INTARRAY:
+        return make_arg<AstInt>(static_cast<AstIntArray *>(ast.get())->values()[index]);
+    case AST_ARRAY:
+        return (*static_cast<AstContainer *>(ast.get()))[index];
+    default:
+        return ast;
+    }
+}
+
+// Applies op to the items of two operands. If the packed result overflows,
+// redoes it by proc on the boxed integers.
+static arg_t EGA_intarray_apply(const arg_t& ast1, const arg_t& ast2, IntVecOp op,
+                                EGA_PROC proc)
+{
+    size_t size = 0;
+    bool has_size = false;
+    for (auto& ast : { ast1, ast2 })
+    {
+        size_t n;
+        if (ast->get_type() == AST_INTARRAY)
+            n = static_cast<AstIntArray *>(ast.get())->size();
+        else if (ast->get_type() == AST_ARRAY)
+            n = static_cast<AstContainer *>(ast.get())->size();
+        else
+            continue;
+
+        if (has_size && n != size)
+            throw EGA_illegal_operation(ast->get_lineno());
+        size = n;
+        has_size = true;
+    }
+
+    args_t pair = { ast1, ast2 };
+    if (!has_size)
+        return (*proc)(pair);
+
+    const long long *data1, *data2;
+    size_t step1, step2;
+    long long scalar1, scalar2;
+    if (EGA_get_packed(ast1, data1, step1, scalar1) &&
+        EGA_get_packed(ast2, data2, step2, scalar2))
+    {
+        std::vector<long long> values(size);
+        if (intvec_apply(op, data1, step1, data2, step2, values.data(), size))
+            return make_arg<AstIntArray>(std::move(values));
+    }
+
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    array->children().reserve(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        pair[0] = EGA_get_item(ast1, i);
+        pair[1] = EGA_get_item(ast2, i);
+        array->add((*proc)(pair));
+    }
+    return array;
+}
+
+// Folds the args by EGA_intarray_apply.
+static arg_t EGA_intarray_fold(const args_t& args, IntVecOp op, EGA_PROC proc)
+{
+    arg_t ret = EGA_value(args[0]);
+    for (size_t i = 1; i < args.size(); ++i)
+        ret = EGA_intarray_apply(ret, EGA_value(args[i]), op, proc);
+    return ret;
+}
+
 arg_t EGA_FN EGA_plus(const args_t& args)
 {
     EVAL_DEBUG();
 
+    if (EGA_has_intarray(args))
+        return EGA_intarray_fold(args, INTVEC_ADD, EGA_plus);
+
+    // The 64-bit fast path
     size_t index = 0;
-    int value = 0;
-    while (index < args.size())
+    long long value = 0;
+    for (; index < args.size(); ++index)
     {
-        if (auto ast1 = EGA_eval_arg(args[index++], true))
+        if (const auto& ast1 = EGA_value(args[index]))
         {
-            int i1 = EGA_get_int(ast1);
-            value += i1;
+            auto ai = EGA_get_ai(ast1);
+            long long sum;
+            if (ai->is_big() || bigint_add_overflow(value, ai->get_int(), sum))
+                break;
+            value = sum;
         }
     }
+    if (index == args.size())
+        return make_arg<AstInt>(value);
 
-    return make_arg<AstInt>(value);
+    // Overflowed. Redo the rest by BigInt.
+    BigInt big(value);
+    for (; index < args.size(); ++index)
+    {
+        if (const auto& ast1 = EGA_value(args[index]))
+            big += EGA_get_ai(ast1)->get_big();
+    }
+    return make_arg<AstInt>(big);
 }
 
 arg_t EGA_FN EGA_minus(const args_t& args)
 {
     EVAL_DEBUG();
 
+    if (EGA_has_intarray(args))
+    {
+        if (args.size() == 1)
+            return EGA_intarray_apply(make_arg<AstInt>(0), args[0], INTVEC_SUB, EGA_minus);
+        return EGA_intarray_fold(args, INTVEC_SUB, EGA_minus);
+    }
+
     if (args.size() == 1)
     {
-        if (auto ast1 = EGA_eval_arg(args[0], true))
+        if (const auto& ast1 = EGA_value(args[0]))
         {
-            int i1 = EGA_get_int(ast1);
+            auto ai1 = EGA_get_ai(ast1);
+            long long i1 = ai1->get_int();
+            if (ai1->is_big() || i1 == LLONG_MIN)
+                return make_arg<AstInt>(-ai1->get_big());
             return make_arg<AstInt>(-i1);
         }
         return nullptr;
@@ -1426,13 +2632,19 @@ arg_t EGA_FN EGA_minus(const args_t& args)
 
     if (args.size() == 2)
     {
-        if (auto ast1 = EGA_eval_arg(args[0], true))
+        if (const auto& ast1 = EGA_value(args[0]))
         {
-            if (auto ast2 = EGA_eval_arg(args[1], true))
+            if (const auto& ast2 = EGA_value(args[1]))
             {
-                int i1 = EGA_get_int(ast1);
-                int i2 = EGA_get_int(ast2);
-                return make_arg<AstInt>(i1 - i2);
+                auto ai1 = EGA_get_ai(ast1);
+                auto ai2 = EGA_get_ai(ast2);
+                long long value;
+                if (ai1->is_big() || ai2->is_big() ||
+                    bigint_sub_overflow(ai1->get_int(), ai2->get_int(), value))
+                {
+                    return make_arg<AstInt>(ai1->get_big() - ai2->get_big());
+                }
+                return make_arg<AstInt>(value);
             }
         }
     }
@@ -1444,34 +2656,59 @@ arg_t EGA_FN EGA_mul(const args_t& args)
 {
     EVAL_DEBUG();
 
+    if (EGA_has_intarray(args))
+        return EGA_intarray_fold(args, INTVEC_MUL, EGA_mul);
+
+    // The 64-bit fast path
     size_t index = 0;
-    int value = 1;
-    while (index < args.size())
+    long long value = 1;
+    for (; index < args.size(); ++index)
     {
-        if (auto ast1 = EGA_eval_arg(args[index++], true))
+        if (const auto& ast1 = EGA_value(args[index]))
         {
-            int i1 = EGA_get_int(ast1);
-            value *= i1;
+            auto ai = EGA_get_ai(ast1);
+            long long product;
+            if (ai->is_big() || bigint_mul_overflow(value, ai->get_int(), product))
+                break;
+            value = product;
         }
     }
+    if (index == args.size())
+        return make_arg<AstInt>(value);
 
-    return make_arg<AstInt>(value);
+    // Overflowed. Redo the rest by BigInt.
+    BigInt big(value);
+    for (; index < args.size(); ++index)
+    {
+        if (const auto& ast1 = EGA_value(args[index]))
+            big *= EGA_get_ai(ast1)->get_big();
+    }
+    return make_arg<AstInt>(big);
 }
 
 arg_t EGA_FN EGA_div(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (const auto& ast1 = EGA_value(args[0]))
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        if (const auto& ast2 = EGA_value(args[1]))
         {
-            int i1 = EGA_get_int(ast1);
-            int i2 = EGA_get_int(ast2);
+            auto ai1 = EGA_get_ai(ast1);
+            auto ai2 = EGA_get_ai(ast2);
+            long long i1 = ai1->get_int();
+            long long i2 = ai2->get_int();
 
-            if (i2 == 0)
+            if (!ai2->is_big() && i2 == 0)
                 throw EGA_division_by_zero(args[1]->get_lineno());
 
+            if (ai1->is_big() || ai2->is_big() || (i1 == LLONG_MIN && i2 == -1))
+            {
+                BigInt quot, rem;
+                BigInt::divmod(ai1->get_big(), ai2->get_big(), quot, rem);
+                return make_arg<AstInt>(quot);
+            }
+
             return make_arg<AstInt>(i1 / i2);
         }
     }
@@ -1483,16 +2720,25 @@ arg_t EGA_FN EGA_mod(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (const auto& ast1 = EGA_value(args[0]))
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        if (const auto& ast2 = EGA_value(args[1]))
         {
-            int i1 = EGA_get_int(ast1);
-            int i2 = EGA_get_int(ast2);
+            auto ai1 = EGA_get_ai(ast1);
+            auto ai2 = EGA_get_ai(ast2);
+            long long i1 = ai1->get_int();
+            long long i2 = ai2->get_int();
 
-            if (i2 == 0)
+            if (!ai2->is_big() && i2 == 0)
                 throw EGA_division_by_zero(args[1]->get_lineno());
 
+            if (ai1->is_big() || ai2->is_big() || (i1 == LLONG_MIN && i2 == -1))
+            {
+                BigInt quot, rem;
+                BigInt::divmod(ai1->get_big(), ai2->get_big(), quot, rem);
+                return make_arg<AstInt>(rem);
+            }
+
             return make_arg<AstInt>(i1 % i2);
         }
     }
@@ -1506,8 +2752,7 @@ arg_t EGA_FN EGA_if(const args_t& args)
 
     if (auto ast1 = EGA_eval_arg(args[0], true))
     {
-        int i1 = EGA_get_int(ast1);
-        if (i1)
+        if (EGA_get_bool(ast1))
         {
             if (auto ast2 = EGA_eval_arg(args[1]))
             {
@@ -1526,24 +2771,49 @@ arg_t EGA_FN EGA_if(const args_t& args)
     return nullptr;
 }
 
+// A null value unsets the variable. The slot is kept, so that a slot from
+// EGA_var_slot stays valid while the loop body runs.
 void EGA_set_var(const std::string& name, arg_t arg)
 {
-    if (arg)
-        s_var_map[name] = arg;
-    else
-        s_var_map.erase(name);
+    auto& state = EGA_state();
+
+    state.var_map[name] = std::move(arg);
+}
+
+static arg_t& EGA_var_slot(const std::string& name)
+{
+    return EGA_state().var_map[name];
 }
 
 arg_t EGA_FN EGA_set(const args_t& args)
 {
     EVAL_DEBUG();
 
+    auto& state = EGA_state();
+
     if (args[0]->get_type() != AST_VAR)
         throw EGA_type_mismatch(args[0]->get_lineno());
 
     std::string name = std::static_pointer_cast<AstVar>(args[0])->get_name();
 
-    if (args.size() == 2)
+    if (args.size() == 3)
+    {
+        // set(var, key, value) sets an entry of the dict in var.
+        auto key = EGA_eval_arg(args[1], true);
+        auto value = EGA_eval_arg(args[2], true);
+
+        auto it = state.var_map.find(name);
+        if (it == state.var_map.end() || !it->second)
+            throw EGA_undefined_variable(name, args[0]->get_lineno());
+        EGA_get_dict(it->second);
+
+        // Copy on write. Another value may share the dict.
+        if (it->second.use_count() > 1)
+            it->second = it->second->clone();
+        static_cast<AstDict *>(it->second.get())->set(key, value);
+        return value;
+    }
+    else if (args.size() == 2)
     {
         auto value = args[1]->eval();
         EGA_set_var(name, value);
@@ -1578,1013 +2848,3540 @@ arg_t EGA_FN EGA_define(const args_t& args)
     }
 }
 
-arg_t EGA_FN EGA_for(const args_t& args)
+//////////////////////////////////////////////////////////////////////////////
+// The memo caches
+//
+// A memo cache maps the dump of an evaluated key to the value of an
+// expression. Each cache is an LRU list with a hash map into it, like the
+// program cache, and is unbounded unless a size is given.
+
+static void EGA_memo_shrink(EGA_Memo& memo)
 {
-    EVAL_DEBUG();
+    while (memo.max_size > 0 && memo.list.size() > memo.max_size)
+    {
+        memo.map.erase(memo.list.back().first);
+        memo.list.pop_back();
+    }
+}
 
-    if (args[0]->get_type() != AST_VAR)
-        throw EGA_type_mismatch(args[0]->get_lineno());
+// Appends the key of a value for a memo cache. Each value starts with its
+// type, and the sizes come before the contents, so the keys of different
+// values are different. A dump can't be used; it cuts long strings.
+static void EGA_memo_key(const arg_t& ast, std::string& out)
+{
+    if (!ast)
+    {
+        out += '-';
+        return;
+    }
 
-    arg_t arg;
-    if (auto ast1 = EGA_eval_arg(args[1], true))
+    mstr_append_int(out, int(ast->get_type()));
+    out += ':';
+    switch (ast->get_type())
     {
-        if (auto ast2 = EGA_eval_arg(args[2], true))
+    case AST_INT:
+        out += ast->dump(false);
+        break;
+    case AST_STR:
+    case AST_STRBUF:
+    case AST_BUFFER:
         {
-            int i1 = EGA_get_int(ast1);
-            int i2 = EGA_get_int(ast2);
-
-            for (int i = i1; i <= i2; ++i)
+            const char *data;
+            size_t size;
+            EGA_get_bytes(ast, data, size);
+            mstr_append_int(out, (long long)size);
+            out += ':';
+            out.append(data, size);
+        }
+        break;
+    case AST_ARRAY:
+        {
+            auto& children = static_cast<AstContainer *>(ast.get())->children();
+            mstr_append_int(out, (long long)children.size());
+            for (auto& child : children)
             {
-                if (EGA_is_stopping())
-                    throw EGA_control_break(0);
-
-                auto ai = make_arg<AstInt>(i);
-                auto var = std::static_pointer_cast<AstVar>(args[0]);
-                EGA_set_var(var->get_name(), ai);
-
-                try
-                {
-                    arg = EGA_eval_arg(args[3]);
-                }
-                catch (EGA_break_exception&)
-                {
-                    break;
-                }
+                out += ',';
+                EGA_memo_key(child, out);
+            }
+        }
+        break;
+    case AST_INTARRAY:
+        {
+            auto& values = static_cast<AstIntArray *>(ast.get())->values();
+            mstr_append_int(out, (long long)values.size());
+            for (auto value : values)
+            {
+                out += ',';
+                mstr_append_int(out, value);
             }
         }
+        break;
+    case AST_DICT:
+        for (auto& entry : static_cast<AstDict *>(ast.get())->entries())
+        {
+            if (!entry.key)
+                continue;
+            out += ',';
+            EGA_memo_key(entry.key, out);
+            out += '=';
+            EGA_memo_key(entry.value, out);
+        }
+        out += '}';
+        break;
+    case AST_GENERATOR:
+        // The same generator only.
+        mstr_append_int(out, (long long)(uintptr_t)static_cast<AstGen *>(ast.get())->get_state().get());
+        break;
+    default:
+        out += ast->dump(true);
+        break;
     }
+}
 
-    return arg;
+// A cached value is shared like a variable (see EGA_eval_var).
+static arg_t EGA_memo_value(const arg_t& value)
+{
+    switch (value->get_type())
+    {
+    case AST_DICT:
+    case AST_INTARRAY:
+    case AST_BUFFER:
+    case AST_STRBUF:
+    case AST_GENERATOR:
+        return value;
+    default:
+        return value->clone();
+    }
 }
 
-arg_t EGA_FN EGA_foreach(const args_t& args)
+arg_t EGA_FN EGA_memo(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (args[0]->get_type() != AST_VAR)
-        throw EGA_type_mismatch(args[0]->get_lineno());
+    auto& state = EGA_state();
 
-    arg_t arg;
-    if (auto var = std::static_pointer_cast<AstVar>(args[0]))
-    {
-        if (auto ast = EGA_eval_arg(args[1], true))
-        {
-            if (auto array = EGA_get_array(ast))
-            {
-                for (size_t i = 0; i < array->size(); ++i)
-                {
-                    if (EGA_is_stopping())
-                        throw EGA_control_break(0);
+    auto name_ast = EGA_eval_arg(args[0], true);
+    std::string name = EGA_get_str(name_ast);
 
-                    EGA_set_var(var->get_name(), (*array)[i]);
+    auto key_ast = EGA_eval_arg(args[1], true);
+    std::string key;
+    EGA_memo_key(key_ast, key);
 
-                    try
-                    {
-                        arg = EGA_eval_arg(args[2]);
-                    }
-                    catch (EGA_break_exception&)
-                    {
-                        break;
-                    }
-                }
-            }
-        }
+    EGA_Memo& memo = state.memo_map[name];
+    if (args.size() == 4)
+    {
+        auto size_ast = EGA_eval_arg(args[3], true);
+        auto size = EGA_get_int(size_ast);
+        if (size < 0)
+            throw EGA_index_out_of_range(size_ast->get_lineno());
+        memo.max_size = size_t(size);
+        EGA_memo_shrink(memo);
     }
 
-    return arg;
+    auto it = memo.map.find(key);
+    if (it != memo.map.end())
+    {
+        ++memo.hits;
+        memo.list.splice(memo.list.begin(), memo.list, it->second);
+        return EGA_memo_value(it->second->second);
+    }
+    ++memo.misses;
+
+    // The body may call memo recursively, which may rehash or evict, so
+    // nothing of the cache is held while evaluating it.
+    auto value = EGA_eval_arg(args[2], false);
+    if (!value)
+        return value;
+
+    EGA_Memo& after = state.memo_map[name];
+    auto found = after.map.find(key);
+    if (found != after.map.end())
+    {
+        found->second->second = value;
+        after.list.splice(after.list.begin(), after.list, found->second);
+    }
+    else
+    {
+        after.list.emplace_front(key, value);
+        after.map[key] = after.list.begin();
+        EGA_memo_shrink(after);
+    }
+    return EGA_memo_value(value);
 }
 
-arg_t EGA_FN EGA_while(const args_t& args)
+arg_t EGA_FN EGA_define_memo(const args_t& args)
 {
     EVAL_DEBUG();
 
-    arg_t arg;
-    for (;;)
-    {
-        if (EGA_is_stopping())
-            throw EGA_control_break(0);
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
 
-        auto ast1 = EGA_eval_arg(args[0], true);
-        if (ast1)
-        {
-            int i1 = EGA_get_int(ast1);
-            if (!i1)
-                break;
-        }
+    std::string name = std::static_pointer_cast<AstVar>(args[0])->get_name();
 
-        try
-        {
-            arg = EGA_eval_arg(args[1]);
-        }
-        catch (EGA_break_exception&)
-        {
-            break;
-        }
+    // var := memo("var", key_expr, expr[, max_size])
+    int lineno = args[0]->get_lineno();
+    auto call = make_arg<AstContainer>(AST_CALL, lineno, "memo", EGA_get_fn("memo"));
+    call->add(make_arg<AstStr>(name, lineno));
+    for (size_t i = 1; i < args.size(); ++i)
+        call->add(args[i]->clone());
+
+    EGA_state().memo_map.erase(name);
+    EGA_set_var(name, call);
+    return call;
+}
+
+arg_t EGA_FN EGA_memo_stats(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    auto& state = EGA_state();
+
+    std::string name = EGA_get_str(args[0]);
+
+    auto ret = make_arg<AstContainer>(AST_ARRAY, args[0]->get_lineno());
+    auto it = state.memo_map.find(name);
+    if (it == state.memo_map.end())
+    {
+        ret->add(make_arg<AstInt>(0));
+        ret->add(make_arg<AstInt>(0));
+        ret->add(make_arg<AstInt>(0));
+        return ret;
     }
 
-    return arg;
+    ret->add(make_arg<AstInt>(it->second.hits));
+    ret->add(make_arg<AstInt>(it->second.misses));
+    ret->add(make_arg<AstInt>((long long)it->second.list.size()));
+    return ret;
 }
 
-arg_t EGA_FN EGA_do(const args_t& args)
+arg_t EGA_FN EGA_memo_clear(const args_t& args)
 {
     EVAL_DEBUG();
 
-    arg_t arg;
-    for (size_t i = 0; i < args.size(); ++i)
+    auto& state = EGA_state();
+
+    if (args.empty())
+    {
+        auto count = state.memo_map.size();
+        state.memo_map.clear();
+        return make_arg<AstInt>((long long)count);
+    }
+
+    std::string name = EGA_get_str(args[0]);
+    return make_arg<AstInt>((long long)state.memo_map.erase(name));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Generators
+//
+// The body of a generator runs on its own thread, in a context that starts
+// with a copy of the variables at the creation. The body and the consumer
+// take turns: the body runs to the next yield while the consumer waits for
+// the value, and then waits for the next request. So only one of them runs
+// at a time, and the values are taken one by one without a collection.
+
+// Thrown by yield to unwind the body of a dropped generator.
+struct EGA_gen_cancel
+{
+};
+
+struct EGA_GEN_STATE
+{
+    arg_t expr;
+    EGA_Context context;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::condition_variable turn;
+    bool started = false;
+    bool requested = false;
+    bool has_value = false;
+    bool done = false;
+    bool cancelled = false;
+    arg_t value;
+    std::exception_ptr error;
+
+    ~EGA_GEN_STATE();
+    void run();
+};
+
+// The generator whose body runs on this thread.
+static thread_local EGA_GEN_STATE *s_current_gen = nullptr;
+
+// The body is suspended in yield or not started, so it can be cancelled.
+EGA_GEN_STATE::~EGA_GEN_STATE()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+    }
+    turn.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+void EGA_GEN_STATE::run()
+{
+    std::exception_ptr caught;
     {
+        EGA_Context::Scope scope(context);
+        s_current_gen = this;
         try
         {
-            arg = EGA_eval_arg(args[i]);
+            EGA_eval_arg(expr);
+        }
+        catch (EGA_gen_cancel&)
+        {
         }
         catch (EGA_break_exception&)
         {
-            break;
+            // break() ends the sequence.
         }
+        catch (...)
+        {
+            caught = std::current_exception();
+        }
+        s_current_gen = nullptr;
     }
 
-    return arg;
-}
-
-arg_t EGA_FN EGA_exit(const args_t& args)
-{
-    EVAL_DEBUG();
-    if (args.size() == 1)
-        throw EGA_exit_exception(args[0]);
-    else
-        throw EGA_exit_exception(nullptr);
+    std::lock_guard<std::mutex> lock(mutex);
+    // Moved, so that only the consumer releases the exception.
+    error = std::move(caught);
+    done = true;
+    turn.notify_all();
 }
 
-arg_t EGA_FN EGA_break(const args_t& args)
+std::string AstGen::dump(bool) const
 {
-    EVAL_DEBUG();
-    throw EGA_break_exception();
+    return "gen()";
 }
 
-arg_t EGA_FN EGA_at(const args_t& args)
+// Takes the next value of a generator. Returns false at the end.
+// The error of the body is thrown once.
+static bool EGA_gen_next(const AstGen& gen, arg_t& value)
 {
-    EVAL_DEBUG();
+    auto state = gen.get_state();
+    if (s_current_gen == state.get())
+        throw EGA_illegal_operation(gen.get_lineno());
 
-    if (args.size() != 2 && args.size() != 3)
-        throw EGA_arity_exception("at", args[0]->get_lineno());
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (!state->started)
+    {
+        EGA_GEN_STATE *ptr = state.get();
+        try
+        {
+            state->thread = std::thread([ptr]() { ptr->run(); });
+        }
+        catch (std::system_error&)
+        {
+            throw EGA_illegal_operation(gen.get_lineno());
+        }
+        state->started = true;
+    }
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    for (;;)
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        if (state->has_value)
         {
-            if (args.size() == 2)
+            state->has_value = false;
+            value = std::move(state->value);
+            state->value = nullptr;
+            return true;
+        }
+        if (state->done)
+        {
+            if (state->error)
             {
-                switch (ast1->get_type())
-                {
-                case AST_ARRAY:
-                    if (auto array = EGA_get_array(ast1))
-                    {
-                        size_t index = EGA_get_int(ast2);
-                        if (index < array->size())
-                        {
-                            auto base = (*array)[index]->eval();
-                            return base;
-                        }
-                        else
-                        {
-                            throw EGA_index_out_of_range(args[0]->get_lineno());
-                        }
-                    }
-                    break;
-                case AST_STR:
-                    {
-                        std::string str = EGA_get_str(ast1);
-                        size_t index = EGA_get_int(ast2);
-                        if (index < str.size())
-                        {
-                            return make_arg<AstInt>((unsigned char)str[index]);
-                        }
-                    }
-                    break;
-                default:
-                    break;
-                }
+                auto error = state->error;
+                state->error = nullptr;
+                std::rethrow_exception(error);
             }
-            else if (args.size() == 3)
-            {
-                if (args[0]->get_type() != AST_VAR)
-                    throw EGA_type_mismatch(args[0]->get_lineno());
-
-                auto var = std::static_pointer_cast<AstVar>(args[0]);
+            return false;
+        }
+        if (!state->requested)
+        {
+            state->requested = true;
+            lock.unlock();
+            state->turn.notify_all();
+            lock.lock();
+            continue;
+        }
 
-                if (auto ast3 = EGA_eval_arg(args[2], true))
-                {
-                    switch (ast1->get_type())
-                    {
-                    case AST_ARRAY:
-                        if (auto array = EGA_get_array(ast1))
-                        {
-                            size_t index = EGA_get_int(ast2);
-                            if (index < array->size())
-                            {
-                                array->children()[index] = ast3;
-                                EGA_set_var(var->get_name(), array);
-                                return array;
-                            }
-                            else
-                            {
-                                throw EGA_index_out_of_range(args[0]->get_lineno());
-                            }
-                        }
-                        break;
-                    case AST_STR:
-                        {
-                            std::string str = EGA_get_str(ast1);
-                            size_t index = EGA_get_int(ast2);
-                            if (index < str.size())
-                            {
-                                str[index] = EGA_get_int(ast3);
-                                auto ret = make_arg<AstStr>(str);
-                                EGA_set_var(var->get_name(), ret);
-                                return ret;
-                            }
-                            else
-                            {
-                                throw EGA_index_out_of_range(args[0]->get_lineno());
-                            }
-                        }
-                        break;
-                    default:
-                        break;
-                    }
-                }
-            }
+        // The body is stopped with the consumer.
+        if (state->turn.wait_for(lock, std::chrono::milliseconds(100)) == std::cv_status::timeout &&
+            EGA_is_stopping())
+        {
+            state->context.stop();
         }
     }
-
-    return nullptr;
 }
 
-arg_t EGA_FN EGA_not(const args_t& args)
+// Adds the names of the variables in ast.
+static void EGA_var_names(const arg_t& ast, std::unordered_set<std::string>& names)
 {
-    EVAL_DEBUG();
+    if (!ast)
+        return;
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    switch (ast->get_type())
     {
-        int i = EGA_get_int(ast1);
-        return make_arg<AstInt>(!i);
+    case AST_VAR:
+        names.insert(static_cast<const AstVar *>(ast.get())->get_name());
+        break;
+    case AST_CALL:
+    case AST_ARRAY:
+    case AST_PROGRAM:
+        for (auto& child : static_cast<AstContainer *>(ast.get())->children())
+            EGA_var_names(child, names);
+        break;
+    default:
+        break;
     }
-
-    return nullptr;
 }
 
-arg_t EGA_FN EGA_or(const args_t& args)
+arg_t EGA_FN EGA_gen(const args_t& args)
 {
     EVAL_DEBUG();
 
-    size_t index = 0;
-    while (index < args.size())
-    {
-        if (auto ast1 = EGA_eval_arg(args[index++], true))
-        {
-            if (int i1 = EGA_get_int(ast1))
-                return make_arg<AstInt>(1);
-        }
-    }
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
 
-    return make_arg<AstInt>(0);
-}
+    auto var = std::static_pointer_cast<AstVar>(args[0]);
 
-arg_t EGA_FN EGA_and(const args_t& args)
-{
-    EVAL_DEBUG();
+    auto state = std::make_shared<EGA_GEN_STATE>();
+    state->expr = args[1];
+    EGA_copy_context(state->context.data(), EGA_state());
 
-    size_t index = 0;
-    while (index < args.size())
+    // The copy doesn't keep the generators that the body doesn't name, such
+    // as the old one in var, so that a dropped generator is cancelled.
+    std::unordered_set<std::string> names;
+    EGA_var_names(state->expr, names);
+    auto& vars = state->context.data().var_map;
+    for (auto it = vars.begin(); it != vars.end(); )
     {
-        if (auto ast1 = EGA_eval_arg(args[index++], true))
-        {
-            int i1 = EGA_get_int(ast1);
-            if (!i1)
-                return make_arg<AstInt>(0);
-        }
+        if (it->second && it->second->get_type() == AST_GENERATOR && !names.count(it->first))
+            it = vars.erase(it);
+        else
+            ++it;
     }
 
-    return make_arg<AstInt>(1);
+    auto gen = make_arg<AstGen>(state, args[0]->get_lineno());
+    EGA_set_var(var->get_name(), gen);
+    return gen;
 }
 
-arg_t EGA_FN EGA_compl(const args_t& args)
+arg_t EGA_FN EGA_yield(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
-    {
-        int i = EGA_get_int(ast1);
-        return make_arg<AstInt>(~i);
-    }
-
-    return nullptr;
+    // Only the body itself can yield, not a task of a parallel loop in it.
+    auto state = s_current_gen;
+    if (!state || &EGA_state() != &state->context.data())
+        throw EGA_illegal_operation(args[0] ? args[0]->get_lineno() : 0);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->value = args[0];
+    state->has_value = true;
+    state->requested = false;
+    lock.unlock();
+    state->turn.notify_all();
+    lock.lock();
+
+    state->turn.wait(lock, [state]() {
+        return state->cancelled || (state->requested && !state->has_value);
+    });
+    if (state->cancelled)
+        throw EGA_gen_cancel();
+
+    return args[0];
 }
 
-arg_t EGA_FN EGA_bitor(const args_t& args)
+arg_t EGA_FN EGA_next(const args_t& args)
 {
     EVAL_DEBUG();
 
-    int i1 = 0;
-    if (auto ast1 = EGA_eval_arg(args[0], true))
-    {
-        i1 = EGA_get_int(ast1);
-        for (size_t i = 1; i < args.size(); ++i)
-        {
-            if (auto ast2 = EGA_eval_arg(args[i], true))
-            {
-                int i2 = EGA_get_int(ast2);
-                i1 |= i2;
-            }
-        }
-    }
+    if (!args[0] || args[0]->get_type() != AST_GENERATOR)
+        throw EGA_type_mismatch(args[0] ? args[0]->get_lineno() : 0);
 
-    return make_arg<AstInt>(i1);
+    auto& gen = static_cast<const AstGen&>(*args[0]);
+    arg_t value;
+    if (EGA_gen_next(gen, value))
+        return value;
+    if (args.size() < 2)
+        throw EGA_illegal_operation(gen.get_lineno());
+    return args[1];
 }
 
-arg_t EGA_FN EGA_bitand(const args_t& args)
+arg_t EGA_FN EGA_for(const args_t& args)
 {
     EVAL_DEBUG();
 
-    int i1 = 0;
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    arg_t arg;
+    if (auto ast1 = EGA_eval_arg(args[1], true))
     {
-        i1 = EGA_get_int(ast1);
-        for (size_t i = 1; i < args.size(); ++i)
+        if (auto ast2 = EGA_eval_arg(args[2], true))
         {
-            if (auto ast2 = EGA_eval_arg(args[i], true))
+            int i1 = EGA_get_int(ast1);
+            int i2 = EGA_get_int(ast2);
+
+            for (int i = i1; i <= i2; ++i)
             {
-                int i2 = EGA_get_int(ast2);
-                i1 &= i2;
+                if (EGA_is_stopping())
+                    throw EGA_control_break(0);
+
+                auto ai = make_arg<AstInt>(i);
+                auto var = std::static_pointer_cast<AstVar>(args[0]);
+                EGA_set_var(var->get_name(), ai);
+
+                try
+                {
+                    arg = EGA_eval_arg(args[3]);
+                }
+                catch (EGA_break_exception&)
+                {
+                    break;
+                }
             }
         }
     }
 
-    return make_arg<AstInt>(i1);
+    return arg;
 }
 
-arg_t EGA_FN EGA_xor(const args_t& args)
+arg_t EGA_FN EGA_foreach(const args_t& args)
 {
     EVAL_DEBUG();
 
-    int i1 = 0;
-    if (auto ast1 = EGA_eval_arg(args[0], true))
-    {
-        i1 = EGA_get_int(ast1);
-        for (size_t i = 1; i < args.size(); ++i)
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    arg_t arg;
+    if (auto var = std::static_pointer_cast<AstVar>(args[0]))
+    {
+        if (auto ast = EGA_eval_arg(args[1], true))
         {
-            if (auto ast2 = EGA_eval_arg(args[i], true))
+            if (ast->get_type() == AST_GENERATOR)
             {
-                int i2 = EGA_get_int(ast2);
-                i1 ^= i2;
-            }
-        }
-    }
-
-    return make_arg<AstInt>(i1);
-}
+                // Takes the values one by one. break() stops taking them.
+                auto& gen = static_cast<const AstGen&>(*ast);
+                arg_t item;
+                while (EGA_gen_next(gen, item))
+                {
+                    if (EGA_is_stopping())
+                        throw EGA_control_break(0);
 
-arg_t EGA_FN EGA_left(const args_t& args)
-{
-    EVAL_DEBUG();
+                    EGA_set_var(var->get_name(), item);
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
-    {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
-        {
-            size_t i2 = EGA_get_int(ast2);
-            switch (ast1->get_type())
+                    try
+                    {
+                        arg = EGA_eval_arg(args[2]);
+                    }
+                    catch (EGA_break_exception&)
+                    {
+                        break;
+                    }
+                }
+            }
+            else if (ast->get_type() == AST_DICT)
             {
-            case AST_STR:
+                // Walks the keys. The dict is held by ast, so setting
+                // the entries in expr doesn't affect the walk.
+                auto dict = EGA_get_dict(ast);
+                for (auto& entry : dict->entries())
                 {
-                    std::string str = EGA_get_str(ast1);
-                    if (i2 <= str.size())
+                    if (!entry.key)
+                        continue;
+
+                    if (EGA_is_stopping())
+                        throw EGA_control_break(0);
+
+                    EGA_set_var(var->get_name(), entry.key);
+
+                    try
                     {
-                        std::string str2 = str.substr(0, i2);
-                        return make_arg<AstStr>(str2);
+                        arg = EGA_eval_arg(args[2]);
+                    }
+                    catch (EGA_break_exception&)
+                    {
+                        break;
                     }
-                    else
-                        throw EGA_index_out_of_range(args[1]->get_lineno());
                 }
-                break;
-            case AST_ARRAY:
+            }
+            else if (auto array = EGA_get_array(ast))
+            {
+                for (size_t i = 0; i < array->size(); ++i)
                 {
-                    auto array1 = make_arg<AstContainer>(AST_ARRAY);
-                    auto array2 = EGA_get_array(ast1);
-                    if (i2 <= array2->size())
+                    if (EGA_is_stopping())
+                        throw EGA_control_break(0);
+
+                    EGA_set_var(var->get_name(), (*array)[i]);
+
+                    try
                     {
-                        for (size_t i = 0; i < i2; ++i)
-                        {
-                            array1->add((*array2)[i]->clone());
-                        }
-                        return array1;
+                        arg = EGA_eval_arg(args[2]);
+                    }
+                    catch (EGA_break_exception&)
+                    {
+                        break;
                     }
-                    else
-                        throw EGA_index_out_of_range(args[1]->get_lineno());
                 }
-                break;
-            default:
-                throw EGA_type_mismatch(args[0]->get_lineno());
             }
         }
     }
 
-    return nullptr;
+    return arg;
 }
 
-arg_t EGA_FN EGA_right(const args_t& args)
+arg_t EGA_FN EGA_map(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    auto var = std::static_pointer_cast<AstVar>(args[0]);
+    const std::string& name = var->get_name();
+    auto array = EGA_get_array(EGA_eval_arg(args[1], true));
+
+    auto ret = make_arg<AstContainer>(AST_ARRAY);
+    ret->children().reserve(array->size());
+    arg_t& slot = EGA_var_slot(name);
+    for (auto& item : array->children())
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        if (EGA_is_stopping())
+            throw EGA_control_break(0);
+
+        slot = item;
+
+        try
         {
-            size_t i2 = EGA_get_int(ast2);
-            switch (ast1->get_type())
-            {
-            case AST_STR:
-                {
-                    std::string str = EGA_get_str(ast1);
-                    if (i2 <= str.size())
-                    {
-                        std::string str2 = str.substr(str.size() - i2, i2);
-                        return make_arg<AstStr>(str2);
-                    }
-                    else
-                        throw EGA_index_out_of_range(args[1]->get_lineno());
-                }
-                break;
-            case AST_ARRAY:
-                {
-                    auto array1 = make_arg<AstContainer>(AST_ARRAY);
-                    auto array2 = EGA_get_array(ast1);
-                    if (i2 <= array2->size())
-                    {
-                        size_t k1 = array2->size() - i2;
-                        size_t k2 = array2->size();
-                        for (size_t i = k1; i < k2; ++i)
-                        {
-                            array1->add((*array2)[i]->clone());
-                        }
-                        return array1;
-                    }
-                    else
-                        throw EGA_index_out_of_range(args[1]->get_lineno());
-                }
+            ret->add(EGA_eval_arg(args[2], true));
+        }
+        catch (EGA_break_exception&)
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+arg_t EGA_FN EGA_filter(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    auto var = std::static_pointer_cast<AstVar>(args[0]);
+    const std::string& name = var->get_name();
+    auto array = EGA_get_array(EGA_eval_arg(args[1], true));
+
+    auto ret = make_arg<AstContainer>(AST_ARRAY);
+    ret->children().reserve(array->size());
+    arg_t& slot = EGA_var_slot(name);
+    for (auto& item : array->children())
+    {
+        if (EGA_is_stopping())
+            throw EGA_control_break(0);
+
+        slot = item;
+
+        try
+        {
+            if (EGA_get_bool(EGA_eval_arg(args[2], true)))
+                ret->add(item);
+        }
+        catch (EGA_break_exception&)
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+arg_t EGA_FN EGA_reduce(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+    if (args[1]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[1]->get_lineno());
+
+    auto acc = std::static_pointer_cast<AstVar>(args[0]);
+    auto var = std::static_pointer_cast<AstVar>(args[1]);
+    const std::string& acc_name = acc->get_name();
+    const std::string& name = var->get_name();
+    auto array = EGA_get_array(EGA_eval_arg(args[2], true));
+
+    auto value = EGA_eval_arg(args[3], true);
+    arg_t& acc_slot = EGA_var_slot(acc_name);
+    arg_t& slot = EGA_var_slot(name);
+    for (auto& item : array->children())
+    {
+        if (EGA_is_stopping())
+            throw EGA_control_break(0);
+
+        acc_slot = value;
+        slot = item;
+
+        try
+        {
+            value = EGA_eval_arg(args[4], true);
+        }
+        catch (EGA_break_exception&)
+        {
+            break;
+        }
+    }
+
+    acc_slot = value;
+    return value;
+}
+
+arg_t EGA_FN EGA_while(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    arg_t arg;
+    for (;;)
+    {
+        if (EGA_is_stopping())
+            throw EGA_control_break(0);
+
+        auto ast1 = EGA_eval_arg(args[0], true);
+        if (ast1)
+        {
+            if (!EGA_get_bool(ast1))
                 break;
-            default:
-                throw EGA_type_mismatch(args[0]->get_lineno());
-            }
+        }
+
+        try
+        {
+            arg = EGA_eval_arg(args[1]);
+        }
+        catch (EGA_break_exception&)
+        {
+            break;
         }
     }
 
-    return nullptr;
+    return arg;
 }
 
-static arg_t EGA_mid3(const args_t& args)
+arg_t EGA_FN EGA_do(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    arg_t arg;
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        try
+        {
+            arg = EGA_eval_arg(args[i]);
+        }
+        catch (EGA_break_exception&)
+        {
+            break;
+        }
+    }
+
+    return arg;
+}
+
+arg_t EGA_FN EGA_exit(const args_t& args)
+{
+    EVAL_DEBUG();
+    if (args.size() == 1)
+        throw EGA_exit_exception(args[0]);
+    else
+        throw EGA_exit_exception(nullptr);
+}
+
+arg_t EGA_FN EGA_break(const args_t& args)
 {
-   if (auto ast1 = EGA_eval_arg(args[0], true))
+    EVAL_DEBUG();
+    throw EGA_break_exception();
+}
+
+arg_t EGA_FN EGA_at(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args.size() != 2 && args.size() != 3)
+        throw EGA_arity_exception("at", args[0]->get_lineno());
+
+    if (auto ast1 = EGA_eval_arg(args[0], true))
     {
         if (auto ast2 = EGA_eval_arg(args[1], true))
         {
-            if (auto ast3 = EGA_eval_arg(args[2], true))
+            if (args.size() == 2)
             {
-                size_t i2 = EGA_get_int(ast2);
-                size_t i3 = EGA_get_int(ast3);
                 switch (ast1->get_type())
                 {
-                case AST_STR:
+                case AST_INTARRAY:
                     {
-                        std::string str = EGA_get_str(ast1);
-                        if (i2 <= str.size() && i2 + i3 <= str.size())
+                        auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+                        size_t index = EGA_get_int(ast2);
+                        if (index < values.size())
+                            return make_arg<AstInt>(values[index]);
+                        throw EGA_index_out_of_range(args[0]->get_lineno());
+                    }
+                case AST_ARRAY:
+                    if (auto array = EGA_get_array(ast1))
+                    {
+                        size_t index = EGA_get_int(ast2);
+                        if (index < array->size())
                         {
-                            std::string str2 = str.substr(i2, i3);
-                            return make_arg<AstStr>(str2);
+                            auto base = (*array)[index]->eval();
+                            return base;
                         }
                         else
-                            throw EGA_index_out_of_range(args[1]->get_lineno());
+                        {
+                            throw EGA_index_out_of_range(args[0]->get_lineno());
+                        }
                     }
                     break;
-                case AST_ARRAY:
+                case AST_STR:
                     {
-                        auto array1 = make_arg<AstContainer>(AST_ARRAY);
-                        auto array2 = EGA_get_array(ast1);
-                        if (i2 <= array2->size() && i2 + i3 <= array2->size())
+                        std::string str = EGA_get_str(ast1);
+                        size_t index = EGA_get_int(ast2);
+                        if (index < str.size())
                         {
-                            size_t k1 = i2;
-                            size_t k2 = i2 + i3;
-                            for (size_t i = k1; i < k2; ++i)
-                            {
-                                array1->add((*array2)[i]->clone());
-                            }
-                            return array1;
+                            return make_arg<AstInt>((unsigned char)str[index]);
                         }
-                        else
-                            throw EGA_index_out_of_range(args[1]->get_lineno());
                     }
                     break;
                 default:
-                    throw EGA_type_mismatch(args[0]->get_lineno());
+                    break;
                 }
             }
-        }
-    }
+            else if (args.size() == 3)
+            {
+                if (args[0]->get_type() != AST_VAR)
+                    throw EGA_type_mismatch(args[0]->get_lineno());
 
-    return nullptr;
-}
+                auto var = std::static_pointer_cast<AstVar>(args[0]);
 
-static arg_t EGA_mid4(const args_t& args)
-{
-   if (auto ast1 = EGA_eval_arg(args[0], true))
-    {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
-        {
-            if (auto ast3 = EGA_eval_arg(args[2], true))
-            {
-                if (auto ast4 = EGA_eval_arg(args[3], true))
+                if (auto ast3 = EGA_eval_arg(args[2], true))
                 {
-                    size_t i2 = EGA_get_int(ast2);
-                    size_t i3 = EGA_get_int(ast3);
                     switch (ast1->get_type())
                     {
-                    case AST_STR:
+                    case AST_INTARRAY:
+                        if (ast3->get_type() == AST_INT && !EGA_get_ai(ast3)->is_big())
                         {
-                            std::string str1 = EGA_get_str(ast1);
-                            std::string str2 = EGA_get_str(ast4);
-                            if (i2 <= str1.size() && i2 + i3 <= str1.size())
+                            // Stay packed. ast1 may be shared, so copy it.
+                            auto array = std::static_pointer_cast<AstIntArray>(ast1->clone());
+                            size_t index = EGA_get_int(ast2);
+                            if (index >= array->size())
+                                throw EGA_index_out_of_range(args[0]->get_lineno());
+                            array->values()[index] = EGA_get_ai(ast3)->get_int();
+                            EGA_set_var(var->get_name(), array);
+                            return array;
+                        }
+                        // FALL THROUGH
+                    case AST_ARRAY:
+                        if (auto array = EGA_get_array(ast1))
+                        {
+                            size_t index = EGA_get_int(ast2);
+                            if (index < array->size())
                             {
-                                str1.replace(i2, i3, str2);
-                                return make_arg<AstStr>(str1);
+                                array->children()[index] = ast3;
+                                EGA_set_var(var->get_name(), array);
+                                return array;
                             }
                             else
-                                throw EGA_index_out_of_range(args[1]->get_lineno());
+                            {
+                                throw EGA_index_out_of_range(args[0]->get_lineno());
+                            }
                         }
                         break;
-                    case AST_ARRAY:
+                    case AST_STR:
                         {
-                            auto array1 = make_arg<AstContainer>(AST_ARRAY);
-                            auto array2 = EGA_get_array(ast1);
-                            if (i2 <= array2->size() && i2 + i3 <= array2->size())
+                            std::string str = EGA_get_str(ast1);
+                            size_t index = EGA_get_int(ast2);
+                            if (index < str.size())
                             {
-                                size_t k1 = i2;
-                                size_t k2 = i2 + i3;
-                                for (size_t i = 0; i < k1; ++i)
-                                {
-                                    array1->add((*array2)[i]->clone());
-                                }
-                                array1->add(ast4);
-                                for (size_t i = k2; i < array2->size(); ++i)
-                                {
-                                    array1->add((*array2)[i]->clone());
-                                }
-                                return array1;
+                                str[index] = EGA_get_int(ast3);
+                                auto ret = make_arg<AstStr>(str);
+                                EGA_set_var(var->get_name(), ret);
+                                return ret;
                             }
                             else
-                                throw EGA_index_out_of_range(args[1]->get_lineno());
+                            {
+                                throw EGA_index_out_of_range(args[0]->get_lineno());
+                            }
                         }
                         break;
                     default:
-                        throw EGA_type_mismatch(args[1]->get_lineno());
+                        break;
                     }
                 }
             }
         }
     }
 
-    return nullptr;
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_not(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        return make_arg<AstInt>(!EGA_get_bool(ast1));
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_or(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    size_t index = 0;
+    while (index < args.size())
+    {
+        if (auto ast1 = EGA_eval_arg(args[index++], true))
+        {
+            if (EGA_get_bool(ast1))
+                return make_arg<AstInt>(1);
+        }
+    }
+
+    return make_arg<AstInt>(0);
+}
+
+arg_t EGA_FN EGA_and(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    size_t index = 0;
+    while (index < args.size())
+    {
+        if (auto ast1 = EGA_eval_arg(args[index++], true))
+        {
+            if (!EGA_get_bool(ast1))
+                return make_arg<AstInt>(0);
+        }
+    }
+
+    return make_arg<AstInt>(1);
+}
+
+arg_t EGA_FN EGA_compl(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        long long i = EGA_get_ll(ast1);
+        return make_arg<AstInt>(~i);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_bitor(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (EGA_has_intarray(args))
+        return EGA_intarray_fold(args, INTVEC_OR, EGA_bitor);
+
+    long long i1 = 0;
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        i1 = EGA_get_ll(ast1);
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            if (const auto& ast2 = EGA_value(args[i]))
+            {
+                long long i2 = EGA_get_ll(ast2);
+                i1 |= i2;
+            }
+        }
+    }
+
+    return make_arg<AstInt>(i1);
+}
+
+arg_t EGA_FN EGA_bitand(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (EGA_has_intarray(args))
+        return EGA_intarray_fold(args, INTVEC_AND, EGA_bitand);
+
+    long long i1 = 0;
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        i1 = EGA_get_ll(ast1);
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            if (const auto& ast2 = EGA_value(args[i]))
+            {
+                long long i2 = EGA_get_ll(ast2);
+                i1 &= i2;
+            }
+        }
+    }
+
+    return make_arg<AstInt>(i1);
+}
+
+arg_t EGA_FN EGA_xor(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (EGA_has_intarray(args))
+        return EGA_intarray_fold(args, INTVEC_XOR, EGA_xor);
+
+    long long i1 = 0;
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        i1 = EGA_get_ll(ast1);
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            if (const auto& ast2 = EGA_value(args[i]))
+            {
+                long long i2 = EGA_get_ll(ast2);
+                i1 ^= i2;
+            }
+        }
+    }
+
+    return make_arg<AstInt>(i1);
+}
+
+arg_t EGA_FN EGA_intarray(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        std::vector<long long> values;
+        switch (ast1->get_type())
+        {
+        case AST_INT:
+            {
+                // intarray(size[, value])
+                int size = EGA_get_int(ast1);
+                if (size < 0)
+                    throw EGA_index_out_of_range(args[0]->get_lineno());
+                long long value = (args.size() == 2) ? EGA_get_ll(EGA_value(args[1])) : 0;
+                values.assign(size, value);
+            }
+            break;
+        case AST_INTARRAY:
+            return ast1;
+        case AST_ARRAY:
+            {
+                if (args.size() != 1)
+                    throw EGA_arity_exception("intarray", args[0]->get_lineno());
+                auto array = EGA_get_array(ast1);
+                values.reserve(array->size());
+                for (auto& item : array->children())
+                    values.push_back(EGA_get_ll(EGA_value(item)));
+            }
+            break;
+        default:
+            throw EGA_type_mismatch(args[0]->get_lineno());
+        }
+        return make_arg<AstIntArray>(std::move(values));
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_sum(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (ast1->get_type() != AST_INTARRAY)
+        {
+            auto array = EGA_get_array(ast1);
+            if (array->size() == 0)
+                return make_arg<AstInt>(0);
+            return EGA_plus(array->children());
+        }
+
+        // Sum hi * 2^32 + lo by chunks, without overflow.
+        auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+        long long total = 0;
+        BigInt big;
+        bool is_big = false;
+        for (size_t i = 0; i < values.size(); i += INTVEC_SUM_MAX)
+        {
+            long long hi, lo, part, sum;
+            intvec_sum(values.data() + i, std::min(INTVEC_SUM_MAX, values.size() - i), hi, lo);
+            if (!is_big && !bigint_mul_overflow(hi, 0x100000000LL, part) &&
+                !bigint_add_overflow(part, lo, part) &&
+                !bigint_add_overflow(total, part, sum))
+            {
+                total = sum;
+                continue;
+            }
+
+            if (!is_big)
+            {
+                big = BigInt(total);
+                is_big = true;
+            }
+            big += BigInt(hi) * BigInt(0x100000000LL) + BigInt(lo);
+        }
+        if (is_big)
+            return make_arg<AstInt>(big);
+        return make_arg<AstInt>(total);
+    }
+
+    return nullptr;
+}
+
+static arg_t EGA_min_or_max(const args_t& args, bool is_max)
+{
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (ast1->get_type() == AST_INTARRAY)
+        {
+            auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+            if (values.empty())
+                throw EGA_index_out_of_range(args[0]->get_lineno());
+            if (is_max)
+                return make_arg<AstInt>(intvec_max(values.data(), values.size()));
+            return make_arg<AstInt>(intvec_min(values.data(), values.size()));
+        }
+
+        auto array = EGA_get_array(ast1);
+        if (array->size() == 0)
+            throw EGA_index_out_of_range(args[0]->get_lineno());
+        arg_t ret = (*array)[0];
+        for (size_t i = 1; i < array->size(); ++i)
+        {
+            int cmp = EGA_compare_values((*array)[i], ret);
+            if (is_max ? cmp > 0 : cmp < 0)
+                ret = (*array)[i];
+        }
+        return ret;
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_min(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_min_or_max(args, false);
+}
+
+arg_t EGA_FN EGA_max(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_min_or_max(args, true);
+}
+
+arg_t EGA_FN EGA_count(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            if (ast1->get_type() == AST_INTARRAY)
+            {
+                auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+                if (ast2->get_type() != AST_INT || EGA_get_ai(ast2)->is_big())
+                    return make_arg<AstInt>(0);
+                long long value = EGA_get_ai(ast2)->get_int();
+                size_t count = intvec_count(values.data(), values.size(), value);
+                return make_arg<AstInt>((long long)count);
+            }
+
+            auto array = EGA_get_array(ast1);
+            long long count = 0;
+            for (auto& item : array->children())
+            {
+                if (EGA_compare_values(item, ast2) == 0)
+                    ++count;
+            }
+            return make_arg<AstInt>(count);
+        }
+    }
+
+    return nullptr;
+}
+
+// A part of a buffer shares the bytes unless it is much smaller than them,
+// so that a small token doesn't keep a large buffer alive.
+#define EGA_SHARE_RATIO 16
+
+// Returns count items from offset of an array or a string. Only the items in
+// the range are copied.
+static arg_t EGA_range(const arg_t& ast, size_t offset, size_t count, int lineno)
+{
+    switch (ast->get_type())
+    {
+    case AST_STR:
+    case AST_STRBUF:
+        {
+            const char *data;
+            size_t size;
+            EGA_get_bytes(ast, data, size);
+            if (offset > size || count > size - offset)
+                throw EGA_index_out_of_range(lineno);
+            return make_arg<AstStr>(std::string(data + offset, count));
+        }
+    case AST_BUFFER:
+        {
+            auto buf = static_cast<const AstBuffer *>(ast.get());
+            if (offset > buf->size() || count > buf->size() - offset)
+                throw EGA_index_out_of_range(lineno);
+            if (count * EGA_SHARE_RATIO < buf->shared_size())
+                return make_arg<AstBuffer>(std::string(buf->data() + offset, count));
+            return buf->slice(offset, count);
+        }
+    case AST_INTARRAY:
+        {
+            auto& values = static_cast<const AstIntArray *>(ast.get())->values();
+            if (offset > values.size() || count > values.size() - offset)
+                throw EGA_index_out_of_range(lineno);
+            std::vector<long long> part(values.begin() + offset,
+                                        values.begin() + offset + count);
+            return make_arg<AstIntArray>(std::move(part));
+        }
+    case AST_ARRAY:
+        {
+            auto array1 = make_arg<AstContainer>(AST_ARRAY);
+            auto array2 = static_cast<const AstContainer *>(ast.get());
+            if (offset > array2->size() || count > array2->size() - offset)
+                throw EGA_index_out_of_range(lineno);
+            array1->children().reserve(count);
+            for (size_t i = offset; i < offset + count; ++i)
+            {
+                array1->add((*array2)[i]->clone());
+            }
+            return array1;
+        }
+    default:
+        throw EGA_type_mismatch(ast->get_lineno());
+    }
+}
+
+// The length of an array or a string for EGA_range.
+static size_t EGA_range_size(const arg_t& ast)
+{
+    switch (ast->get_type())
+    {
+    case AST_STR:
+    case AST_STRBUF:
+    case AST_BUFFER:
+        {
+            const char *data;
+            size_t size;
+            EGA_get_bytes(ast, data, size);
+            return size;
+        }
+    case AST_INTARRAY:
+        return static_cast<const AstIntArray *>(ast.get())->size();
+    case AST_ARRAY:
+        return static_cast<const AstContainer *>(ast.get())->size();
+    default:
+        throw EGA_type_mismatch(ast->get_lineno());
+    }
+}
+
+arg_t EGA_FN EGA_left(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    size_t i2 = EGA_get_int(EGA_value(args[1]));
+    return EGA_range(ast1, 0, i2, args[1]->get_lineno());
+}
+
+arg_t EGA_FN EGA_right(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    size_t i2 = EGA_get_int(EGA_value(args[1]));
+    size_t size = EGA_range_size(ast1);
+    if (i2 > size)
+        throw EGA_index_out_of_range(args[1]->get_lineno());
+    return EGA_range(ast1, size - i2, i2, args[1]->get_lineno());
+}
+
+static arg_t EGA_mid3(const args_t& args)
+{
+    const auto& ast1 = EGA_value(args[0]);
+    size_t i2 = EGA_get_int(EGA_value(args[1]));
+    int i3 = EGA_get_int(EGA_value(args[2]));
+    if (i3 < 0)
+    {
+        // A negative count takes the rest, as it did before the ranges.
+        size_t size = EGA_range_size(ast1);
+        return EGA_range(ast1, i2, (i2 <= size ? size - i2 : 0), args[1]->get_lineno());
+    }
+    return EGA_range(ast1, i2, i3, args[1]->get_lineno());
+}
+
+static arg_t EGA_mid4(const args_t& args)
+{
+   if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            if (const auto& ast3 = EGA_value(args[2]))
+            {
+                if (const auto& ast4 = EGA_value(args[3]))
+                {
+                    size_t i2 = EGA_get_int(ast2);
+                    size_t i3 = EGA_get_int(ast3);
+                    switch (ast1->get_type())
+                    {
+                    case AST_STR:
+                        {
+                            const std::string& str1 = EGA_get_str_ref(ast1);
+                            std::string str2 = EGA_get_str(ast4);
+                            if (i2 <= str1.size() && i2 + i3 <= str1.size())
+                            {
+                                std::string str;
+                                str.reserve(str1.size() - i3 + str2.size());
+                                str.append(str1, 0, i2);
+                                str += str2;
+                                str.append(str1, i2 + i3, std::string::npos);
+                                return make_arg<AstStr>(std::move(str));
+                            }
+                            else
+                                throw EGA_index_out_of_range(args[1]->get_lineno());
+                        }
+                        break;
+                    case AST_INTARRAY:
+                    case AST_ARRAY:
+                        {
+                            auto array1 = make_arg<AstContainer>(AST_ARRAY);
+                            auto array2 = EGA_get_array(ast1);
+                            if (i2 <= array2->size() && i2 + i3 <= array2->size())
+                            {
+                                size_t k1 = i2;
+                                size_t k2 = i2 + i3;
+                                array1->children().reserve(array2->size() - i3 + 1);
+                                for (size_t i = 0; i < k1; ++i)
+                                {
+                                    array1->add((*array2)[i]->clone());
+                                }
+                                array1->add(ast4);
+                                for (size_t i = k2; i < array2->size(); ++i)
+                                {
+                                    array1->add((*array2)[i]->clone());
+                                }
+                                return array1;
+                            }
+                            else
+                                throw EGA_index_out_of_range(args[1]->get_lineno());
+                        }
+                        break;
+                    default:
+                        throw EGA_type_mismatch(args[1]->get_lineno());
+                    }
+                }
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_mid(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args.size() == 3)
+        return EGA_mid3(args);
+    if (args.size() == 4)
+        return EGA_mid4(args);
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_find(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            switch (ast1->get_type())
+            {
+            case AST_STR:
+                {
+                    const std::string& str1 = EGA_get_str_ref(ast1);
+                    const std::string& str2 = EGA_get_str_ref(ast2);
+                    size_t pos = mstr_find(str1, str2);
+                    if (pos != std::string::npos)
+                        return make_arg<AstInt>(int(pos));
+                    return make_arg<AstInt>(-1);
+                }
+            case AST_INTARRAY:
+            case AST_ARRAY:
+                {
+                    // Compare the items in place. An intarray is not unpacked.
+                    size_t size = EGA_compare_size(ast1.get());
+                    for (size_t i = 0; i < size; ++i)
+                    {
+                        EGA_CompareItem item = EGA_compare_at(ast1.get(), i);
+                        EGA_CompareItem target = { ast2.get(), 0 };
+                        int cmp;
+                        if (!EGA_compare_items(item, target, cmp))
+                            cmp = EGA_compare_values(item.ast, ast2.get());
+                        if (cmp == 0)
+                            return make_arg<AstInt>(int(i));
+                    }
+                    return make_arg<AstInt>(-1);
+                }
+            default:
+                throw EGA_type_mismatch(args[0]->get_lineno());
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_replace(const args_t& args)
+{
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            if (const auto& ast3 = EGA_value(args[2]))
+            {
+                switch (ast1->get_type())
+                {
+                case AST_STR:
+                    {
+                        auto ret = make_arg<AstStr>();
+                        mstr_replace_all(EGA_get_str_ref(ast1), EGA_get_str_ref(ast2),
+                                         EGA_get_str_ref(ast3), ret->get_str());
+                        return ret;
+                    }
+                case AST_INTARRAY:
+                case AST_ARRAY:
+                    {
+                        auto ary1 = make_arg<AstContainer>(AST_ARRAY);
+                        auto ary2 = EGA_get_array(ast1);
+                        for (size_t i = 0; i < ary2->size(); ++i)
+                        {
+                            const auto& arg = (*ary2)[i];
+                            if (EGA_compare_values(arg, ast2) == 0)
+                                ary1->add(ast3->clone());
+                            else
+                                ary1->add(arg->clone());
+                        }
+                        return ary1;
+                    }
+                default:
+                    throw EGA_type_mismatch(args[0]->get_lineno());
+                }
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_remove(const args_t& args)
+{
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            switch (ast1->get_type())
+            {
+            case AST_STR:
+                {
+                    auto ret = make_arg<AstStr>();
+                    mstr_replace_all(EGA_get_str_ref(ast1), EGA_get_str_ref(ast2),
+                                     std::string(), ret->get_str());
+                    return ret;
+                }
+            case AST_INTARRAY:
+            case AST_ARRAY:
+                {
+                    auto ary1 = make_arg<AstContainer>(AST_ARRAY);
+                    auto ary2 = EGA_get_array(ast1);
+                    for (size_t i = 0; i < ary2->size(); ++i)
+                    {
+                        const auto& arg = (*ary2)[i];
+                        if (EGA_compare_values(arg, ast2) != 0)
+                            ary1->add(arg->clone());
+                    }
+                    return ary1;
+                }
+            default:
+                throw EGA_type_mismatch(args[0]->get_lineno());
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Parallel execution
+
+// The threads are kept in a pool. A parallel loop posts helpers to the pool,
+// and the helpers and the calling thread take the indexes one by one until
+// none is left. The calling thread doesn't wait for a helper to start, so a
+// loop inside a loop doesn't deadlock even if all the threads are busy.
+
+static std::atomic<size_t> s_thread_count(0);
+
+void EGA_set_thread_count(size_t count)
+{
+    s_thread_count = count;
+}
+
+// The number of the threads of a parallel loop, including the calling one.
+// EGA_set_thread_count, or the EGA_THREADS environment variable, or the
+// hardware threads.
+size_t EGA_get_thread_count(void)
+{
+    if (size_t count = s_thread_count)
+        return count;
+
+    static const size_t s_default_count = []() -> size_t {
+        if (const char *env = std::getenv("EGA_THREADS"))
+        {
+            long count = std::strtol(env, nullptr, 10);
+            if (count > 0)
+                return size_t(count);
+        }
+        size_t count = std::thread::hardware_concurrency();
+        return count ? count : 1;
+    }();
+    return s_default_count;
+}
+
+// A parallel loop shared by the calling thread and the helpers.
+struct EGA_ParallelJob
+{
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::atomic<bool> failed;
+    size_t count;
+    const std::function<void(size_t)> *task;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::exception_ptr error;
+
+    EGA_ParallelJob(size_t n, const std::function<void(size_t)> *t)
+        : next(0), done(0), failed(false), count(n), task(t)
+    {
+    }
+
+    // Runs the indexes left. task is touched only before all the indexes are
+    // done, and the calling thread waits for that. After a failure, the
+    // indexes left are skipped.
+    void work()
+    {
+        for (;;)
+        {
+            size_t i = next++;
+            if (i >= count)
+                break;
+
+            if (!failed)
+            {
+                try
+                {
+                    (*task)(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    failed = true;
+                }
+            }
+
+            if (++done == count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+class EGA_ThreadPool
+{
+public:
+    ~EGA_ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quitting = true;
+        }
+        m_ready.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    // Posts count helpers of job, making the threads as needed.
+    void post(const std::shared_ptr<EGA_ParallelJob>& job, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < count; ++i)
+            m_queue.push_back(job);
+
+        while (m_threads.size() < count)
+        {
+            try
+            {
+                m_threads.emplace_back([this]() { run(); });
+            }
+            catch (std::system_error&)
+            {
+                break; // Run on the threads we have
+            }
+        }
+        m_ready.notify_all();
+    }
+
+protected:
+    std::vector<std::thread> m_threads;
+    std::deque<std::shared_ptr<EGA_ParallelJob>> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    bool m_quitting = false;
+
+    void run()
+    {
+        for (;;)
+        {
+            std::shared_ptr<EGA_ParallelJob> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_ready.wait(lock, [this]() { return m_quitting || !m_queue.empty(); });
+                if (m_quitting)
+                    return;
+                job = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            job->work();
+        }
+    }
+};
+
+static EGA_ThreadPool s_thread_pool;
+
+// Runs task(0), ..., task(count - 1) on the threads of the pool.
+// The first exception thrown by the tasks is rethrown.
+static void EGA_parallel_for(size_t count, const std::function<void(size_t)>& task)
+{
+    size_t num_threads = EGA_get_thread_count();
+    if (num_threads > count)
+        num_threads = count;
+
+    if (num_threads <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    auto job = std::make_shared<EGA_ParallelJob>(count, &task);
+    s_thread_pool.post(job, num_threads - 1);
+    job->work();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&]() { return job->done == count; });
+    if (job->error)
+        std::rethrow_exception(job->error);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Parallel loops
+//
+// A task of a parallel loop runs in its own context, which shares the
+// functions of the calling context and starts with a copy of its variables.
+// The variables set by a task are dropped at the end of the task.
+
+static void EGA_inherit_context(EGA_CONTEXT_DATA& child, const EGA_CONTEXT_DATA& parent)
+{
+    EGA_copy_context(child, parent);
+    child.parent = &parent;
+}
+
+// About 8 tasks per thread, for the balance of the load.
+static size_t EGA_default_grain(size_t count)
+{
+    size_t grain = count / (EGA_get_thread_count() * 8);
+    return grain ? grain : 1;
+}
+
+// At most 256 tasks. The tasks don't depend on the number of the threads,
+// so that the results of preduce don't either.
+static size_t EGA_fixed_grain(size_t count)
+{
+    size_t grain = (count + 255) / 256;
+    return grain < 16 ? 16 : grain;
+}
+
+static size_t EGA_get_grain(const args_t& args, size_t index, size_t count)
+{
+    if (args.size() <= index)
+        return EGA_default_grain(count);
+
+    auto ast = EGA_eval_arg(args[index], true);
+    int grain = EGA_get_int(ast);
+    if (grain <= 0)
+        throw EGA_illegal_operation(ast->get_lineno());
+    return size_t(grain);
+}
+
+// Runs task(k, begin, end) for the k-th range of grain items of count items,
+// each in a context of a task.
+static void EGA_parallel_ranges(size_t count, size_t grain,
+                                const std::function<void(size_t, size_t, size_t)>& task)
+{
+    auto& parent = EGA_state();
+    size_t num_tasks = (count + grain - 1) / grain;
+    EGA_parallel_for(num_tasks, [&](size_t k) {
+        EGA_Context context;
+        EGA_inherit_context(context.data(), parent);
+        EGA_Context::Scope scope(context);
+
+        task(k, k * grain, std::min(count, (k + 1) * grain));
+    });
+}
+
+// Lowers stop to index atomically.
+static void EGA_lower_stop(std::atomic<size_t>& stop, size_t index)
+{
+    size_t old = stop;
+    while (index < old && !stop.compare_exchange_weak(old, index))
+    {
+    }
+}
+
+// The values of expr for the items of ary before the first break.
+static arg_t EGA_parallel_collect(const std::string& name, const std::shared_ptr<AstContainer>& array,
+                                  const arg_t& expr, size_t grain)
+{
+    size_t count = array->size();
+    args_t values(count);
+    std::atomic<size_t> stop(count);
+
+    EGA_parallel_ranges(count, grain, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end && i < stop; ++i)
+        {
+            if (EGA_is_stopping())
+                throw EGA_control_break(0);
+
+            EGA_set_var(name, (*array)[i]);
+
+            try
+            {
+                values[i] = EGA_eval_arg(expr, true);
+            }
+            catch (EGA_break_exception&)
+            {
+                EGA_lower_stop(stop, i);
+                break;
+            }
+        }
+    });
+
+    values.resize(stop);
+    auto ret = make_arg<AstContainer>(AST_ARRAY);
+    ret->children().swap(values);
+    return ret;
+}
+
+arg_t EGA_FN EGA_pforeach(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    auto var = std::static_pointer_cast<AstVar>(args[0]);
+    auto array = EGA_get_array(EGA_eval_arg(args[1], true));
+    size_t grain = EGA_get_grain(args, 3, array->size());
+    return EGA_parallel_collect(var->get_name(), array, args[2], grain);
+}
+
+arg_t EGA_FN EGA_pmap(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    auto var = std::static_pointer_cast<AstVar>(args[0]);
+    auto array = EGA_get_array(EGA_eval_arg(args[1], true));
+    size_t grain = EGA_fixed_grain(array->size());
+    return EGA_parallel_collect(var->get_name(), array, args[2], grain);
+}
+
+// Reduces each range from init by expr on the threads, and then combines the
+// values of the ranges by combine in a fixed tree order:
+// ((r0 + r1) + (r2 + r3)) + ((r4 + r5) + r6) where + is combine.
+arg_t EGA_FN EGA_preduce(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+    if (args[1]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[1]->get_lineno());
+
+    auto acc = std::static_pointer_cast<AstVar>(args[0]);
+    auto var = std::static_pointer_cast<AstVar>(args[1]);
+    const std::string& acc_name = acc->get_name();
+    const std::string& name = var->get_name();
+    auto array = EGA_get_array(EGA_eval_arg(args[2], true));
+    auto init = EGA_eval_arg(args[3], true);
+
+    size_t count = array->size();
+    size_t grain = EGA_fixed_grain(count);
+    size_t num_ranges = (count + grain - 1) / grain;
+    args_t values(num_ranges);
+    std::atomic<size_t> stop(count);
+
+    EGA_parallel_ranges(count, grain, [&](size_t k, size_t begin, size_t end) {
+        auto value = init;
+        for (size_t i = begin; i < end && i < stop; ++i)
+        {
+            if (EGA_is_stopping())
+                throw EGA_control_break(0);
+
+            EGA_set_var(acc_name, value);
+            EGA_set_var(name, (*array)[i]);
+
+            try
+            {
+                value = EGA_eval_arg(args[4], true);
+            }
+            catch (EGA_break_exception&)
+            {
+                EGA_lower_stop(stop, i);
+                break;
+            }
+        }
+        values[k] = value;
+    });
+
+    // The ranges after the first break are dropped.
+    if (stop < count)
+        values.resize(stop / grain + 1);
+
+    if (values.empty())
+    {
+        EGA_set_var(acc_name, init);
+        return init;
+    }
+
+    {
+        EGA_Context context;
+        EGA_inherit_context(context.data(), EGA_state());
+        EGA_Context::Scope scope(context);
+
+        while (values.size() > 1)
+        {
+            size_t half = (values.size() + 1) / 2;
+            for (size_t i = 0; i < values.size() / 2; ++i)
+            {
+                if (EGA_is_stopping())
+                    throw EGA_control_break(0);
+
+                EGA_set_var(acc_name, values[2 * i]);
+                EGA_set_var(name, values[2 * i + 1]);
+                values[i] = EGA_eval_arg(args[5], true);
+            }
+            if (values.size() % 2)
+                values[half - 1] = values.back();
+            values.resize(half);
+        }
+    }
+
+    EGA_set_var(acc_name, values[0]);
+    return values[0];
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sorting
+
+static const size_t s_parallel_sort_threshold = 32768;
+
+// Sorts the indexes stably. A large input is sorted by parallel merge sort:
+// the runs are sorted on the threads, then the pairs of the runs are merged.
+template <typename T_LESS>
+static void EGA_sort_indexes(std::vector<size_t>& indexes, T_LESS less)
+{
+    size_t size = indexes.size();
+    size_t num_threads = std::thread::hardware_concurrency();
+    if (size < s_parallel_sort_threshold || num_threads <= 1)
+    {
+        std::stable_sort(indexes.begin(), indexes.end(), less);
+        return;
+    }
+
+    size_t num_runs = 1;
+    while (num_runs < num_threads && size / (num_runs * 2) >= s_parallel_sort_threshold / 2)
+        num_runs *= 2;
+
+    std::vector<size_t> bounds(num_runs + 1);
+    for (size_t i = 0; i <= num_runs; ++i)
+        bounds[i] = size * i / num_runs;
+
+    EGA_parallel_for(num_runs, [&](size_t i) {
+        std::stable_sort(indexes.begin() + bounds[i], indexes.begin() + bounds[i + 1], less);
+    });
+
+    std::vector<size_t> buffer(size);
+    std::vector<size_t> *src = &indexes, *dest = &buffer;
+    for (size_t width = 1; width < num_runs; width *= 2)
+    {
+        EGA_parallel_for(num_runs / (width * 2), [&](size_t k) {
+            size_t lo = bounds[k * width * 2];
+            size_t mid = bounds[k * width * 2 + width];
+            size_t hi = bounds[k * width * 2 + width * 2];
+            std::merge(src->begin() + lo, src->begin() + mid,
+                       src->begin() + mid, src->begin() + hi,
+                       dest->begin() + lo, less);
+        });
+        std::swap(src, dest);
+    }
+
+    if (src != &indexes)
+        indexes.swap(buffer);
+}
+
+// Returns an array of the items sorted by the keys.
+// The integers and the strings are sorted in the faster ways.
+static arg_t EGA_sort_items(const std::vector<arg_t>& items,
+                            const std::vector<arg_t>& keys, bool desc)
+{
+    size_t size = keys.size();
+    bool all_int = true, all_str = true;
+    for (auto& key : keys)
+    {
+        EGA_value(key); // A null is an error
+        if (key->get_type() != AST_INT || EGA_get_ai(key)->is_big())
+            all_int = false;
+        if (key->get_type() != AST_STR)
+            all_str = false;
+    }
+
+    std::vector<size_t> indexes;
+    if (all_int && size >= 256)
+    {
+        std::vector<long long> ints(size);
+        for (size_t i = 0; i < size; ++i)
+            ints[i] = EGA_get_ai(keys[i])->get_int();
+        intvec_radix_sort(ints, desc, indexes);
+    }
+    else
+    {
+        indexes.resize(size);
+        for (size_t i = 0; i < size; ++i)
+            indexes[i] = i;
+
+        if (all_int)
+        {
+            std::vector<long long> ints(size);
+            for (size_t i = 0; i < size; ++i)
+                ints[i] = EGA_get_ai(keys[i])->get_int();
+            EGA_sort_indexes(indexes, [&](size_t i, size_t j) {
+                return desc ? ints[j] < ints[i] : ints[i] < ints[j];
+            });
+        }
+        else if (all_str)
+        {
+            std::vector<const std::string *> strs(size);
+            for (size_t i = 0; i < size; ++i)
+                strs[i] = &EGA_get_str_ref(keys[i]);
+            EGA_sort_indexes(indexes, [&](size_t i, size_t j) {
+                return desc ? strs[j]->compare(*strs[i]) < 0
+                            : strs[i]->compare(*strs[j]) < 0;
+            });
+        }
+        else
+        {
+            EGA_sort_indexes(indexes, [&](size_t i, size_t j) {
+                return desc ? EGA_compare_values(keys[j], keys[i]) < 0
+                            : EGA_compare_values(keys[i], keys[j]) < 0;
+            });
+        }
+    }
+
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    array->children().reserve(size);
+    for (auto index : indexes)
+        array->add(items[index]);
+    return array;
+}
+
+arg_t EGA_FN EGA_sort(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        bool desc = (args.size() == 2) && EGA_get_bool(EGA_value(args[1]));
+        if (ast1->get_type() == AST_INTARRAY)
+        {
+            // Sort as packed.
+            auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+            std::vector<size_t> indexes;
+            intvec_radix_sort(values, desc, indexes);
+            std::vector<long long> sorted(values.size());
+            for (size_t i = 0; i < indexes.size(); ++i)
+                sorted[i] = values[indexes[i]];
+            return make_arg<AstIntArray>(std::move(sorted));
+        }
+
+        auto array = EGA_get_array(ast1);
+        return EGA_sort_items(array->children(), array->children(), desc);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_sort_by(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        auto array = EGA_get_array(ast1);
+        int index = EGA_get_int(EGA_value(args[1]));
+        bool desc = (args.size() == 3) && EGA_get_bool(EGA_value(args[2]));
+
+        std::vector<arg_t> keys;
+        keys.reserve(array->size());
+        for (auto& item : array->children())
+        {
+            auto row = EGA_get_array(EGA_value(item));
+            if (index < 0 || size_t(index) >= row->size())
+                throw EGA_index_out_of_range(args[1]->get_lineno());
+            keys.push_back((*row)[index]);
+        }
+        return EGA_sort_items(array->children(), keys, desc);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_dict(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args.size() % 2 != 0)
+        throw EGA_arity_exception("dict", 0);
+
+    auto dict = make_arg<AstDict>();
+    for (size_t i = 0; i < args.size(); i += 2)
+    {
+        dict->set(EGA_value(args[i]), EGA_value(args[i + 1]));
+    }
+    return dict;
+}
+
+arg_t EGA_FN EGA_get(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            if (auto value = EGA_get_dict(ast1)->get(ast2))
+                return value;
+            if (args.size() == 3)
+                return args[2];
+            throw EGA_index_out_of_range(0);
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_has(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        if (const auto& ast2 = EGA_value(args[1]))
+        {
+            return make_arg<AstInt>(!!EGA_get_dict(ast1)->get(ast2));
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_del(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    auto& state = EGA_state();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    std::string name = std::static_pointer_cast<AstVar>(args[0])->get_name();
+    auto key = EGA_eval_arg(args[1], true);
+
+    auto it = state.var_map.find(name);
+    if (it == state.var_map.end() || !it->second)
+        throw EGA_undefined_variable(name, args[0]->get_lineno());
+    if (!EGA_get_dict(it->second)->get(key))
+        return make_arg<AstInt>(0);
+
+    // Copy on write. Another value may share the dict.
+    if (it->second.use_count() > 1)
+        it->second = it->second->clone();
+    static_cast<AstDict *>(it->second.get())->del(key);
+    return make_arg<AstInt>(1);
+}
+
+arg_t EGA_FN EGA_keys(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        auto dict = EGA_get_dict(ast1);
+        auto array = make_arg<AstContainer>(AST_ARRAY);
+        array->children().reserve(dict->size());
+        for (auto& entry : dict->entries())
+        {
+            if (entry.key)
+                array->add(entry.key);
+        }
+        return array;
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_values(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        auto dict = EGA_get_dict(ast1);
+        auto array = make_arg<AstContainer>(AST_ARRAY);
+        array->children().reserve(dict->size());
+        for (auto& entry : dict->entries())
+        {
+            if (entry.key)
+                array->add(entry.value);
+        }
+        return array;
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_eval(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        // Keep the program alive even if the cache drops it while running.
+        auto program = EGA_get_program(EGA_get_str(ast1));
+        return EGA_eval_arg(program, false);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_typeid(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (auto ast1 = args[0])
+    {
+        int type = int(ast1->get_type());
+        return make_arg<AstInt>(type);
+    }
+
+    return make_arg<AstInt>(-1);
+}
+
+arg_t EGA_FN EGA_int(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        switch (ast1->get_type())
+        {
+        case AST_INT:
+            return ast1->clone();
+        case AST_STR:
+            return EGA_parse_int(EGA_get_str(ast1), args[0]->get_lineno());
+        case AST_INTARRAY:
+        case AST_ARRAY:
+            {
+                auto array = EGA_get_array(ast1);
+                int i = int(array->size());
+                return make_arg<AstInt>(i);
+            }
+        default:
+            throw EGA_type_mismatch(args[0]->get_lineno());
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_str(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        std::string str = ast1->dump(false);
+        return make_arg<AstStr>(str);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_array(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    for (const auto& arg : args)
+    {
+        array->add(EGA_value(arg));
+    }
+
+    return array;
+}
+
+static std::string tm_str(const std::tm* ptm)
+{
+    std::string str;
+    str.reserve(sizeof("YYYY-MM-DD hh:mm:ss"));
+    str += str_right("000" + std::to_string(ptm->tm_year + 1900), 4);
+    str += "-";
+    str += str_right("0" + std::to_string(ptm->tm_mon + 1), 2);
+    str += "-";
+    str += str_right("0" + std::to_string(ptm->tm_mday), 2);
+    str += " ";
+    str += str_right("0" + std::to_string(ptm->tm_hour), 2);
+    str += ":";
+    str += str_right("0" + std::to_string(ptm->tm_min), 2);
+    str += ":";
+    str += str_right("0" + std::to_string(ptm->tm_sec), 2);
+    return str;
+}
+
+arg_t EGA_FN EGA_localtime(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    std::time_t t = std::time(nullptr);
+    std::tm* ptm = std::localtime(&t);
+    if (!ptm)
+        return nullptr;
+
+    return make_arg<AstStr>(tm_str(ptm));
+}
+
+arg_t EGA_FN EGA_gmtime(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    std::time_t t = std::time(nullptr);
+    std::tm* ptm = std::gmtime(&t);
+    if (!ptm)
+        return nullptr;
+
+    return make_arg<AstStr>(tm_str(ptm));
+}
+
+arg_t EGA_FN EGA_load(const args_t& args)
+{
+    EVAL_DEBUG();
+    std::string filename = EGA_get_str(EGA_value(args[0]));
+    bool as_buffer = (args.size() == 2) && EGA_get_bool(EGA_value(args[1]));
+    if (!EGA_file_security(filename))
+    {
+        EGA_hit_security();
+        return make_arg<AstInt>(0);
+    }
+
+#ifdef _WIN32
+    wchar_t path[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, path, _countof(path));
+    FILE *fp = _wfopen(path, L"rb");
+#else
+    FILE *fp = fopen(filename.c_str(), "rb");
+#endif
+    if (!fp)
+        return make_arg<AstInt>(0);
+
+    if (fseek(fp, 0, SEEK_END))
+    {
+        fclose(fp);
+        return make_arg<AstInt>(0);
+    }
+
+    long filesize = ftell(fp);
+
+    if (filesize < 0 || fseek(fp, 0, SEEK_SET))
+    {
+        fclose(fp);
+        return make_arg<AstInt>(0);
+    }
+
+    std::string contents;
+    contents.resize(filesize);
+
+    bool has_read = !!fread(&contents[0], 1, contents.size(), fp);
+    fclose(fp);
+
+    if (!has_read)
+        return make_arg<AstInt>(0);
+
+    // Hand the contents over without copying.
+    if (as_buffer)
+        return make_arg<AstBuffer>(std::move(contents));
+    return make_arg<AstStr>(std::move(contents));
+}
+
+arg_t EGA_FN EGA_save(const args_t& args)
+{
+    EVAL_DEBUG();
+    std::string filename = EGA_get_str(EGA_value(args[0]));
+
+    // Write the contents without copying.
+    const auto& ast2 = EGA_value(args[1]);
+    const char *data;
+    size_t size;
+    if (ast2->get_type() == AST_BUFFER)
+    {
+        auto buf = static_cast<AstBuffer *>(ast2.get());
+        data = buf->data();
+        size = buf->size();
+    }
+    else
+    {
+        const std::string& str = EGA_get_str_ref(ast2);
+        data = str.data();
+        size = str.size();
+    }
+
+    if (!EGA_file_security(filename))
+    {
+        EGA_hit_security();
+        return make_arg<AstInt>(0);
+    }
+
+#ifdef _WIN32
+    wchar_t path[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, path, _countof(path));
+    FILE *fp = _wfopen(path, L"wb");
+#else
+    FILE *fp = fopen(filename.c_str(), "wb");
+#endif
+    if (!fp)
+        return make_arg<AstInt>(0);
+
+    bool written = !!fwrite(data, 1, size, fp);
+    fclose(fp);
+    return make_arg<AstInt>(written);
+}
+
+arg_t EGA_FN EGA_buffer(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        switch (ast1->get_type())
+        {
+        case AST_INT:
+            {
+                int size = EGA_get_int(ast1);
+                if (size < 0)
+                    throw EGA_index_out_of_range(args[0]->get_lineno());
+                return make_arg<AstBuffer>(std::string(size, '\0'));
+            }
+        case AST_STR:
+            return make_arg<AstBuffer>(EGA_get_str_ref(ast1));
+        case AST_BUFFER:
+            return ast1;
+        default:
+            throw EGA_type_mismatch(args[0]->get_lineno());
+        }
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_slice(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        auto buf = EGA_get_buffer(ast1);
+        int offset = EGA_get_int(EGA_value(args[1]));
+        if (offset < 0 || size_t(offset) > buf->size())
+            throw EGA_index_out_of_range(args[1]->get_lineno());
+
+        size_t size = buf->size() - offset;
+        if (args.size() == 3)
+        {
+            int size3 = EGA_get_int(EGA_value(args[2]));
+            if (size3 < 0 || size_t(size3) > size)
+                throw EGA_index_out_of_range(args[2]->get_lineno());
+            size = size3;
+        }
+        return buf->slice(offset, size);
+    }
+
+    return nullptr;
+}
+
+static arg_t EGA_read_int(const args_t& args, bool big_endian)
+{
+    if (const auto& ast1 = EGA_value(args[0]))
+    {
+        auto buf = EGA_get_buffer(ast1);
+        int offset = EGA_get_int(EGA_value(args[1]));
+        int width = EGA_get_int(EGA_value(args[2]));
+        bool is_signed = (args.size() == 4) && EGA_get_bool(EGA_value(args[3]));
+        if (width < 1 || width > 8)
+            throw EGA_illegal_operation(args[2]->get_lineno());
+        if (offset < 0 || size_t(offset) + width > buf->size())
+            throw EGA_index_out_of_range(args[1]->get_lineno());
+
+        auto p = reinterpret_cast<const unsigned char *>(buf->data()) + offset;
+        unsigned long long value = 0;
+        for (int i = 0; i < width; ++i)
+            value = (value << 8) | p[big_endian ? i : width - 1 - i];
+
+        if (is_signed)
+        {
+            if (width < 8 && (value >> (width * 8 - 1)) != 0)
+                value |= ~0ULL << (width * 8);
+            return make_arg<AstInt>((long long)value);
+        }
+        if (value > (unsigned long long)LLONG_MAX)
+        {
+            BigInt big((long long)(value >> 1));
+            big *= BigInt(2);
+            big += BigInt((long long)(value & 1));
+            return make_arg<AstInt>(big);
+        }
+        return make_arg<AstInt>((long long)value);
+    }
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_read_le(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_read_int(args, false);
+}
+
+arg_t EGA_FN EGA_read_be(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_read_int(args, true);
+}
+
+static arg_t EGA_write_int(const args_t& args, bool big_endian)
+{
+    auto& state = EGA_state();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    std::string name = std::static_pointer_cast<AstVar>(args[0])->get_name();
+    int offset = EGA_get_int(EGA_eval_arg(args[1], true));
+    int width = EGA_get_int(EGA_eval_arg(args[2], true));
+    auto value = EGA_eval_arg(args[3], true);
+    if (width < 1 || width > 8)
+        throw EGA_illegal_operation(args[2]->get_lineno());
+
+    // The bits of a 64-bit integer, signed or unsigned.
+    unsigned long long bits;
+    auto ai = EGA_get_ai(value);
+    if (ai->is_big())
+    {
+        long long ll;
+        BigInt big = ai->get_big() - BigInt::from_digits("18446744073709551616", 20);
+        if (!big.to_ll(ll) || ll >= 0)
+            throw EGA_illegal_operation(args[3]->get_lineno());
+        bits = (unsigned long long)ll;
+    }
+    else
+    {
+        bits = (unsigned long long)ai->get_int();
+    }
+
+    auto it = state.var_map.find(name);
+    if (it == state.var_map.end() || !it->second)
+        throw EGA_undefined_variable(name, args[0]->get_lineno());
+    EGA_get_buffer(it->second);
+
+    // Copy on write. Another value may share the buffer.
+    if (it->second.use_count() > 1)
+        it->second = it->second->clone();
+    auto buf = static_cast<AstBuffer *>(it->second.get());
+    if (offset < 0 || size_t(offset) + width > buf->size())
+        throw EGA_index_out_of_range(args[1]->get_lineno());
+
+    auto p = reinterpret_cast<unsigned char *>(buf->writable()) + offset;
+    for (int i = 0; i < width; ++i)
+        p[big_endian ? width - 1 - i : i] = (unsigned char)(bits >> (i * 8));
+    return value;
+}
+
+arg_t EGA_FN EGA_write_le(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_write_int(args, false);
+}
+
+arg_t EGA_FN EGA_write_be(const args_t& args)
+{
+    EVAL_DEBUG();
+    return EGA_write_int(args, true);
+}
+
+arg_t EGA_FN EGA_strbuf(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    if (args.empty())
+        return make_arg<AstStrBuf>();
+
+    if (const auto& ast1 = EGA_value(args[0]))
+        return make_arg<AstStrBuf>(EGA_get_str(ast1));
+
+    return nullptr;
+}
+
+arg_t EGA_FN EGA_append(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    auto& state = EGA_state();
+
+    if (args[0]->get_type() != AST_VAR)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    std::string name = std::static_pointer_cast<AstVar>(args[0])->get_name();
+
+    args_t pieces;
+    pieces.reserve(args.size() - 1);
+    for (size_t i = 1; i < args.size(); ++i)
+        pieces.push_back(EGA_eval_arg(args[i], true));
+
+    auto it = state.var_map.find(name);
+    if (it == state.var_map.end() || !it->second)
+        throw EGA_undefined_variable(name, args[0]->get_lineno());
+    if (it->second->get_type() != AST_STRBUF)
+        throw EGA_type_mismatch(args[0]->get_lineno());
+
+    // Copy on write. Another value may share the strbuf.
+    if (it->second.use_count() > 1)
+        it->second = it->second->clone();
+
+    // std::string grows geometrically.
+    std::string& str = static_cast<AstStrBuf *>(it->second.get())->get_str();
+    for (auto& piece : pieces)
+    {
+        switch (piece->get_type())
+        {
+        case AST_STR:
+            str += EGA_get_str_ref(piece);
+            break;
+        case AST_STRBUF:
+            str += static_cast<AstStrBuf *>(piece.get())->get_str();
+            break;
+        case AST_BUFFER:
+            {
+                auto buf = static_cast<AstBuffer *>(piece.get());
+                str.append(buf->data(), buf->size());
+            }
+            break;
+        default:
+            str += piece->dump(false);
+            break;
+        }
+    }
+
+    return make_arg<AstInt>((long long)str.size());
+}
+
+arg_t EGA_FN EGA_tostr(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    auto& state = EGA_state();
+
+    if (args[0]->get_type() == AST_VAR)
+    {
+        // The variable always becomes an empty strbuf. The contents are
+        // moved out only if the strbuf is not shared; otherwise they are
+        // copied and the other holders keep them.
+        auto var = std::static_pointer_cast<AstVar>(args[0]);
+        auto it = state.var_map.find(var->get_name());
+        if (it != state.var_map.end() && it->second &&
+            it->second->get_type() == AST_STRBUF)
+        {
+            std::string& str = static_cast<AstStrBuf *>(it->second.get())->get_str();
+            if (it->second.use_count() > 1)
+            {
+                auto ret = make_arg<AstStr>(str);
+                it->second = make_arg<AstStrBuf>("", it->second->get_lineno());
+                return ret;
+            }
+            auto ret = make_arg<AstStr>(std::move(str));
+            str.clear();
+            return ret;
+        }
+    }
+
+    auto ast1 = EGA_eval_arg(args[0], true);
+    return make_arg<AstStr>(EGA_get_str(ast1));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// The regex cache
+//
+// The compiled patterns are reused like the programs. Loops don't recompile.
+
+void EGA_set_regex_cache_size(size_t size)
+{
+    auto& state = EGA_state();
+
+    state.regex_cache_size = size;
+    while (state.regex_list.size() > state.regex_cache_size)
+    {
+        state.regex_map.erase(state.regex_list.back().first);
+        state.regex_list.pop_back();
+    }
+}
+
+static std::shared_ptr<const Regex> EGA_get_regex(const arg_t& ast)
+{
+    auto& state = EGA_state();
+
+    const std::string& pattern = EGA_get_str_ref(ast);
+
+    auto it = state.regex_map.find(pattern);
+    if (it != state.regex_map.end())
+    {
+        state.regex_list.splice(state.regex_list.begin(), state.regex_list, it->second);
+        return it->second->second;
+    }
+
+    std::shared_ptr<const Regex> re;
+    try
+    {
+        re = std::make_shared<const Regex>(pattern);
+    }
+    catch (const RegexError& e)
+    {
+        throw EGA_invalid_regex(e.what(), ast->get_lineno());
+    }
+
+    if (state.regex_cache_size > 0)
+    {
+        if (state.regex_list.size() >= state.regex_cache_size)
+        {
+            state.regex_map.erase(state.regex_list.back().first);
+            state.regex_list.pop_back();
+        }
+        state.regex_list.emplace_front(pattern, re);
+        state.regex_map[pattern] = state.regex_list.begin();
+    }
+    return re;
+}
+
+// The position after the UTF-8 character at pos.
+static size_t EGA_next_char(const char *data, size_t size, size_t pos)
+{
+    ++pos;
+    while (pos < size && (data[pos] & 0xC0) == 0x80)
+        ++pos;
+    return pos;
 }
 
-arg_t EGA_FN EGA_mid(const args_t& args)
+// Appends the replacement. $0 to $9 are the match and the groups. $$ is $.
+static void EGA_expand_replacement(std::string& out, const std::string& repl,
+                                   const char *data, const std::vector<size_t>& caps)
+{
+    for (size_t i = 0; i < repl.size(); ++i)
+    {
+        char ch = repl[i];
+        if (ch != '$' || i + 1 >= repl.size())
+        {
+            out += ch;
+            continue;
+        }
+
+        char next = repl[i + 1];
+        if (next == '$')
+        {
+            out += '$';
+            ++i;
+        }
+        else if ('0' <= next && next <= '9' && size_t(next - '0') * 2 < caps.size())
+        {
+            size_t group = next - '0';
+            if (caps[group * 2] != std::string::npos)
+                out.append(data + caps[group * 2], caps[group * 2 + 1] - caps[group * 2]);
+            ++i;
+        }
+        else
+        {
+            out += ch;
+        }
+    }
+}
+
+arg_t EGA_FN EGA_match(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (args.size() == 3)
-        return EGA_mid3(args);
-    if (args.size() == 4)
-        return EGA_mid4(args);
+    const auto& ast1 = EGA_value(args[0]);
+    const auto& ast2 = EGA_value(args[1]);
 
-    return nullptr;
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+    auto re = EGA_get_regex(ast2);
+    return make_arg<AstInt>(re->match(data, size));
 }
 
-arg_t EGA_FN EGA_find(const args_t& args)
+arg_t EGA_FN EGA_search(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    const auto& ast1 = EGA_value(args[0]);
+    const auto& ast2 = EGA_value(args[1]);
+
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+    auto re = EGA_get_regex(ast2);
+
+    size_t start = 0;
+    if (args.size() >= 3)
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
-        {
-            switch (ast1->get_type())
-            {
-            case AST_STR:
-                {
-                    std::string str1 = EGA_get_str(ast1);
-                    std::string str2 = EGA_get_str(ast2);
-                    size_t pos = str1.find(str2);
-                    if (pos != std::string::npos)
-                        return make_arg<AstInt>(int(pos));
-                    return make_arg<AstInt>(-1);
-                }
-            case AST_ARRAY:
-                {
-                    auto ary = EGA_get_array(ast1);
-                    for (size_t i = 0; i < ary->size(); ++i)
-                    {
-                        if (auto ai = EGA_compare_0((*ary)[i], ast2))
-                        {
-                            if (ai->get_int() == 0)
-                                return make_arg<AstInt>(int(i));
-                        }
-                    }
-                    return make_arg<AstInt>(-1);
-                }
-            default:
-                throw EGA_type_mismatch(args[0]->get_lineno());
-            }
-        }
+        long long value = EGA_get_int(EGA_value(args[2]));
+        if (value < 0 || (unsigned long long)value > size)
+            throw EGA_index_out_of_range(args[2]->get_lineno());
+        start = size_t(value);
     }
 
-    return nullptr;
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    std::vector<size_t> caps;
+    if (!re->search(data, size, start, caps))
+        return array;
+
+    array->children().reserve(caps.size() / 2 + 1);
+    array->add(make_arg<AstInt>((long long)caps[0]));
+    for (size_t i = 0; i < caps.size(); i += 2)
+    {
+        if (caps[i] == std::string::npos)
+            array->add(make_arg<AstStr>());
+        else
+            array->add(make_arg<AstStr>(std::string(data + caps[i], caps[i + 1] - caps[i])));
+    }
+    return array;
 }
 
-arg_t EGA_FN EGA_replace(const args_t& args)
+arg_t EGA_FN EGA_regex_replace(const args_t& args)
 {
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    const auto& ast2 = EGA_value(args[1]);
+    const auto& ast3 = EGA_value(args[2]);
+
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+    auto re = EGA_get_regex(ast2);
+    const std::string& repl = EGA_get_str_ref(ast3);
+
+    auto ret = make_arg<AstStr>();
+    std::string& out = ret->get_str();
+    out.reserve(size);
+
+    std::vector<size_t> caps;
+    size_t pos = 0, last = 0;
+    while (re->search(data, size, pos, caps))
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        out.append(data + last, caps[0] - last);
+        EGA_expand_replacement(out, repl, data, caps);
+        last = pos = caps[1];
+        if (caps[0] == caps[1])
         {
-            if (auto ast3 = EGA_eval_arg(args[2], true))
-            {
-                switch (ast1->get_type())
-                {
-                case AST_STR:
-                    {
-                        std::string str1 = EGA_get_str(ast1);
-                        std::string str2 = EGA_get_str(ast2);
-                        std::string str3 = EGA_get_str(ast3);
-                        mstr_replace_all(str1, str2, str3);
-                        return make_arg<AstStr>(str1);
-                    }
-                case AST_ARRAY:
-                    {
-                        auto ary1 = make_arg<AstContainer>(AST_ARRAY);
-                        auto ary2 = EGA_get_array(ast1);
-                        for (size_t i = 0; i < ary2->size(); ++i)
-                        {
-                            const auto& arg = (*ary2)[i];
-                            if (auto ai = EGA_compare_0(arg, ast2))
-                            {
-                                if (ai->get_int() == 0)
-                                    ary1->add(ast3->clone());
-                                else
-                                    ary1->add(arg->clone());
-                            }
-                        }
-                        return ary1;
-                    }
-                default:
-                    throw EGA_type_mismatch(args[0]->get_lineno());
-                }
-            }
+            // An empty match. Go to the next character.
+            if (pos >= size)
+                break;
+            pos = EGA_next_char(data, size, pos);
+            out.append(data + last, pos - last);
+            last = pos;
         }
     }
-
-    return nullptr;
+    out.append(data + last, size - last);
+    return ret;
 }
 
-arg_t EGA_FN EGA_remove(const args_t& args)
+arg_t EGA_FN EGA_regex_split(const args_t& args)
 {
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    const auto& ast2 = EGA_value(args[1]);
+
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+    auto re = EGA_get_regex(ast2);
+
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    std::vector<size_t> caps;
+    size_t pos = 0, last = 0;
+    while (pos < size && re->search(data, size, pos, caps))
     {
-        if (auto ast2 = EGA_eval_arg(args[1], true))
+        if (caps[0] == caps[1])
         {
-            switch (ast1->get_type())
-            {
-            case AST_STR:
-                {
-                    std::string str1 = EGA_get_str(ast1);
-                    std::string str2 = EGA_get_str(ast2);
-                    mstr_replace_all(str1, str2, "");
-                    return make_arg<AstStr>(str1);
-                }
-            case AST_ARRAY:
-                {
-                    auto ary1 = make_arg<AstContainer>(AST_ARRAY);
-                    auto ary2 = EGA_get_array(ast1);
-                    for (size_t i = 0; i < ary2->size(); ++i)
-                    {
-                        const auto& arg = (*ary2)[i];
-                        if (auto ai = EGA_compare_0(arg, ast2))
-                        {
-                            if (ai->get_int() != 0)
-                            {
-                                ary1->add(arg->clone());
-                            }
-                        }
-                    }
-                    return ary1;
-                }
-            default:
-                throw EGA_type_mismatch(args[0]->get_lineno());
-            }
+            // An empty match doesn't split.
+            pos = EGA_next_char(data, size, caps[1]);
+            continue;
         }
+        array->add(make_arg<AstStr>(std::string(data + last, caps[0] - last)));
+        last = pos = caps[1];
     }
-
-    return nullptr;
+    array->add(make_arg<AstStr>(std::string(data + last, size - last)));
+    return array;
 }
 
-arg_t EGA_FN EGA_typeid(const args_t& args)
+// Adds the pieces of a string or a buffer to an array. The pieces of a
+// buffer are its slices, sharing the bytes.
+struct EGA_PieceAdder
 {
-    EVAL_DEBUG();
+    const arg_t& source;
+    const char *data;
+    args_t& children;
 
-    if (auto ast1 = EGA_eval_arg(args[0], false))
+    void operator()(size_t offset, size_t length) const
     {
-        int type = int(ast1->get_type());
-        return make_arg<AstInt>(type);
+        if (source->get_type() == AST_BUFFER)
+            children.push_back(static_cast<AstBuffer *>(source.get())->slice(offset, length));
+        else
+            children.push_back(make_arg<AstStr>(std::string(data + offset, length)));
     }
+};
 
-    return make_arg<AstInt>(-1);
+arg_t EGA_FN EGA_split(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    const auto& ast2 = EGA_value(args[1]);
+
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+    const std::string& sep = EGA_get_str_ref(ast2);
+
+    // Count the pieces first.
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    if (sep.empty())
+        array->children().reserve(size);
+    else
+        array->children().reserve(mstr_count(data, size, sep.data(), sep.size()) + 1);
+
+    EGA_PieceAdder adder = { ast1, data, array->children() };
+    mstr_split_each(data, size, sep.data(), sep.size(), adder);
+    return array;
 }
 
-arg_t EGA_FN EGA_int(const args_t& args)
+arg_t EGA_FN EGA_lines(const args_t& args)
 {
     EVAL_DEBUG();
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    const auto& ast1 = EGA_value(args[0]);
+
+    const char *data;
+    size_t size;
+    EGA_get_bytes(ast1, data, size);
+
+    // Count the lines first.
+    size_t count = mstr_count(data, size, "\n", 1);
+    if (size > 0 && data[size - 1] != '\n')
+        ++count;
+    auto array = make_arg<AstContainer>(AST_ARRAY);
+    array->children().reserve(count);
+
+    EGA_PieceAdder adder = { ast1, data, array->children() };
+    mstr_lines_each(data, size, adder);
+    return array;
+}
+
+arg_t EGA_FN EGA_join(const args_t& args)
+{
+    EVAL_DEBUG();
+
+    const auto& ast1 = EGA_value(args[0]);
+    std::string sep;
+    if (args.size() >= 2)
+        sep = EGA_get_str(EGA_value(args[1]));
+
+    auto ret = make_arg<AstStr>();
+    std::string& out = ret->get_str();
+
+    if (ast1->get_type() == AST_INTARRAY)
     {
-        switch (ast1->get_type())
+        auto& values = static_cast<AstIntArray *>(ast1.get())->values();
+        out.reserve(values.size() * (8 + sep.size()));
+        for (size_t i = 0; i < values.size(); ++i)
         {
-        case AST_INT:
-            {
-                int i = EGA_get_int(ast1);
-                return make_arg<AstInt>(i);
-            }
-        case AST_STR:
-            {
-                std::string str = EGA_get_str(ast1);
-                int i = std::atoi(str.c_str());
-                return make_arg<AstInt>(i);
-            }
-        case AST_ARRAY:
-            {
-                auto array = EGA_get_array(ast1);
-                int i = int(array->size());
-                return make_arg<AstInt>(i);
-            }
-        default:
-            throw EGA_type_mismatch(args[0]->get_lineno());
+            if (i > 0)
+                out += sep;
+            mstr_append_int(out, values[i]);
         }
+        return ret;
     }
 
-    return nullptr;
+    auto array = EGA_get_array(ast1);
+    auto& children = array->children();
+
+    // Reserve the size of the strings first, then append.
+    size_t total = 0;
+    for (auto& item : children)
+    {
+        if (item && item->get_type() != AST_INT)
+        {
+            const char *data;
+            size_t size;
+            EGA_get_bytes(item, data, size);
+            total += size;
+        }
+        else
+        {
+            total += 8;
+        }
+    }
+    if (children.size() > 1)
+        total += (children.size() - 1) * sep.size();
+    out.reserve(total);
+
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+        if (i > 0)
+            out += sep;
+
+        const auto& item = EGA_value(children[i]);
+        if (item->get_type() == AST_INT)
+        {
+            out += item->dump(false);
+        }
+        else
+        {
+            const char *data;
+            size_t size;
+            EGA_get_bytes(item, data, size);
+            out.append(data, size);
+        }
+    }
+    return ret;
 }
 
-arg_t EGA_FN EGA_str(const args_t& args)
+//////////////////////////////////////////////////////////////////////////////
+// The batch execution
+//
+// If a program consists of the arithmetic, the comparison and the logical
+// functions only, EGA_run_batch evaluates it column by column. Otherwise, or
+// if any row could fail, it evaluates the program row by row by EGA_run.
+
+// The values of an expression for all the rows of a batch.
+// A constant has one value for all the rows.
+struct BatchValue
 {
-    EVAL_DEBUG();
+    AstType type;
+    bool constant;
+    const std::vector<long long> *ext_ints;
+    const std::vector<std::string> *ext_strs;
+    std::vector<long long> own_ints;
+    std::vector<std::string> own_strs;
+
+    BatchValue() : type(AST_INT), constant(true), ext_ints(nullptr), ext_strs(nullptr)
+    {
+    }
 
-    if (auto ast1 = EGA_eval_arg(args[0], true))
+    const long long *ints() const
     {
-        std::string str = ast1->dump(false);
-        return make_arg<AstStr>(str);
+        return ext_ints ? ext_ints->data() : own_ints.data();
     }
 
-    return nullptr;
-}
+    const std::string *strs() const
+    {
+        return ext_strs ? ext_strs->data() : own_strs.data();
+    }
+};
 
-arg_t EGA_FN EGA_array(const args_t& args)
+typedef std::unordered_map<std::string, const EGA_COLUMN *> column_map_t;
+
+#define EGA_BATCH_MAX_DEPTH 256
+
+template <typename T_OP>
+static void EGA_batch_unary(const BatchValue& a, size_t rows, BatchValue& value, T_OP op)
 {
-    EVAL_DEBUG();
+    const long long *pa = a.ints();
+    value.type = AST_INT;
+    value.constant = a.constant;
+    value.ext_ints = nullptr;
+    if (a.constant)
+    {
+        value.own_ints.assign(1, op(pa[0]));
+        return;
+    }
 
-    auto array = make_arg<AstContainer>(AST_ARRAY);
-    for (const auto& arg : args)
+    value.own_ints.resize(rows);
+    long long *out = value.own_ints.data();
+    for (size_t i = 0; i < rows; ++i)
+        out[i] = op(pa[i]);
+}
+
+template <typename T_OP>
+static void EGA_batch_binary(const BatchValue& a, const BatchValue& b, size_t rows,
+                             BatchValue& value, T_OP op)
+{
+    const long long *pa = a.ints(), *pb = b.ints();
+    value.type = AST_INT;
+    value.constant = a.constant && b.constant;
+    value.ext_ints = nullptr;
+    if (value.constant)
     {
-        array->add(EGA_eval_arg(arg, true));
+        value.own_ints.assign(1, op(pa[0], pb[0]));
+        return;
     }
 
-    return array;
+    value.own_ints.resize(rows);
+    long long *out = value.own_ints.data();
+    if (a.constant)
+    {
+        long long x = pa[0];
+        for (size_t i = 0; i < rows; ++i)
+            out[i] = op(x, pb[i]);
+    }
+    else if (b.constant)
+    {
+        long long y = pb[0];
+        for (size_t i = 0; i < rows; ++i)
+            out[i] = op(pa[i], y);
+    }
+    else
+    {
+        for (size_t i = 0; i < rows; ++i)
+            out[i] = op(pa[i], pb[i]);
+    }
 }
 
-static std::string tm_str(const std::tm* ptm)
+// Folds the integer arguments from left to right.
+template <typename T_OP>
+static void EGA_batch_fold(std::vector<BatchValue>& args, size_t rows, BatchValue& value, T_OP op)
 {
-    std::string str;
-    str.reserve(sizeof("YYYY-MM-DD hh:mm:ss"));
-    str += str_right("000" + std::to_string(ptm->tm_year + 1900), 4);
-    str += "-";
-    str += str_right("0" + std::to_string(ptm->tm_mon + 1), 2);
-    str += "-";
-    str += str_right("0" + std::to_string(ptm->tm_mday), 2);
-    str += " ";
-    str += str_right("0" + std::to_string(ptm->tm_hour), 2);
-    str += ":";
-    str += str_right("0" + std::to_string(ptm->tm_min), 2);
-    str += ":";
-    str += str_right("0" + std::to_string(ptm->tm_sec), 2);
-    return str;
+    value = std::move(args[0]);
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        BatchValue result;
+        EGA_batch_binary(value, args[i], rows, result, op);
+        value = std::move(result);
+    }
 }
 
-arg_t EGA_FN EGA_localtime(const args_t& args)
+// Compares like EGA_compare_0 and converts the result by test.
+template <typename T_TEST>
+static void EGA_batch_compare(const BatchValue& a, const BatchValue& b, size_t rows,
+                              BatchValue& value, T_TEST test)
 {
-    EVAL_DEBUG();
+    if (a.type != b.type)
+    {
+        value.type = AST_INT;
+        value.constant = true;
+        value.ext_ints = nullptr;
+        value.own_ints.assign(1, test(a.type < b.type ? -1 : 1));
+        return;
+    }
 
-    std::time_t t = std::time(nullptr);
-    std::tm* ptm = std::localtime(&t);
-    if (!ptm)
-        return nullptr;
+    if (a.type == AST_INT)
+    {
+        EGA_batch_binary(a, b, rows, value, [&](long long x, long long y) {
+            return test((x > y) - (x < y));
+        });
+        return;
+    }
 
-    return make_arg<AstStr>(tm_str(ptm));
+    const std::string *pa = a.strs(), *pb = b.strs();
+    value.type = AST_INT;
+    value.constant = a.constant && b.constant;
+    value.ext_ints = nullptr;
+    size_t count = value.constant ? 1 : rows;
+    size_t sa = a.constant ? 0 : 1, sb = b.constant ? 0 : 1;
+    value.own_ints.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int cmp = pa[i * sa].compare(pb[i * sb]);
+        value.own_ints[i] = test((cmp > 0) - (cmp < 0));
+    }
 }
 
-arg_t EGA_FN EGA_gmtime(const args_t& args)
+static bool
+EGA_batch_eval(const arg_t& ast, const column_map_t& columns, size_t rows,
+               BatchValue& value, int depth)
 {
-    EVAL_DEBUG();
-
-    std::time_t t = std::time(nullptr);
-    std::tm* ptm = std::gmtime(&t);
-    if (!ptm)
-        return nullptr;
+    auto& state = EGA_state();
 
-    return make_arg<AstStr>(tm_str(ptm));
-}
+    if (depth > EGA_BATCH_MAX_DEPTH)
+        return false;
 
-arg_t EGA_FN EGA_load(const args_t& args)
-{
-    EVAL_DEBUG();
-    std::string filename = EGA_get_str(args[0]);
-    if (!EGA_file_security(filename))
+    switch (ast->get_type())
     {
-        EGA_hit_security();
-        return make_arg<AstInt>(0);
+    case AST_INT:
+        if (EGA_get_ai(ast)->is_big())
+            return false;
+        value.type = AST_INT;
+        value.own_ints.assign(1, EGA_get_ai(ast)->get_int());
+        return true;
+    case AST_STR:
+        value.type = AST_STR;
+        value.own_strs.assign(1, std::static_pointer_cast<AstStr>(ast)->get_str());
+        return true;
+    case AST_VAR:
+        {
+            const auto& name = std::static_pointer_cast<AstVar>(ast)->get_name();
+            auto it = columns.find(name);
+            if (it != columns.end())
+            {
+                value.type = it->second->type;
+                value.constant = false;
+                value.ext_ints = &it->second->ints;
+                value.ext_strs = &it->second->strs;
+                return true;
+            }
+
+            // A variable of a constant value
+            auto found = state.var_map.find(name);
+            if (found == state.var_map.end() || !found->second)
+                return false;
+            auto type = found->second->get_type();
+            if (type != AST_INT && type != AST_STR)
+                return false;
+            return EGA_batch_eval(found->second, columns, rows, value, depth + 1);
+        }
+    case AST_CALL:
+    case AST_PROGRAM:
+        break;
+    default:
+        return false;
     }
 
-#ifdef _WIN32
-    wchar_t path[MAX_PATH];
-    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, path, _countof(path));
-    FILE *fp = _wfopen(path, L"rb");
-#else
-    FILE *fp = fopen(filename, "rb");
-#endif
-    if (!fp)
-        return make_arg<AstInt>(0);
+    auto call = std::static_pointer_cast<AstContainer>(ast);
+    if (call->size() == 0)
+        return false;
 
-    if (fseek(fp, 0, SEEK_END))
+    std::vector<BatchValue> args(call->size());
+    for (size_t i = 0; i < call->size(); ++i)
     {
-        fclose(fp);
-        return make_arg<AstInt>(0);
+        if (!EGA_batch_eval((*call)[i], columns, rows, args[i], depth + 1))
+            return false;
     }
 
-    long filesize = ftell(fp);
-
-    if (fseek(fp, 0, SEEK_SET))
+    const auto& fn = call->get_fn();
+    if (!fn)
     {
-        fclose(fp);
-        return make_arg<AstInt>(0);
+        value = std::move(args.back());
+        return true;
     }
 
-    std::string contents;
-    contents.resize(filesize);
+    EGA_PROC proc = fn->proc;
+
+    if (proc == EGA_equal)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c == 0); });
+    else if (proc == EGA_not_equal)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c != 0); });
+    else if (proc == EGA_compare)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return c; });
+    else if (proc == EGA_less)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c < 0); });
+    else if (proc == EGA_less_equal)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c <= 0); });
+    else if (proc == EGA_greater)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c > 0); });
+    else if (proc == EGA_greater_equal)
+        EGA_batch_compare(args[0], args[1], rows, value, [](int c) { return int(c >= 0); });
+    else
+    {
+        // The rest are the integer functions.
+        for (auto& arg : args)
+        {
+            if (arg.type != AST_INT)
+                return false;
+        }
 
-    bool has_read = !!fread(&contents[0], 1, contents.size(), fp);
-    fclose(fp);
+        // On overflow, let EGA_run redo it by BigInt.
+        bool overflow = false;
+        if (proc == EGA_plus)
+        {
+            EGA_batch_fold(args, rows, value, [&](long long x, long long y) {
+                long long z;
+                overflow |= bigint_add_overflow(x, y, z);
+                return z;
+            });
+        }
+        else if (proc == EGA_mul)
+        {
+            EGA_batch_fold(args, rows, value, [&](long long x, long long y) {
+                long long z;
+                overflow |= bigint_mul_overflow(x, y, z);
+                return z;
+            });
+        }
+        else if (proc == EGA_minus && args.size() == 1)
+        {
+            EGA_batch_unary(args[0], rows, value, [&](long long x) {
+                long long z;
+                overflow |= bigint_sub_overflow(0, x, z);
+                return z;
+            });
+        }
+        else if (proc == EGA_minus)
+        {
+            EGA_batch_binary(args[0], args[1], rows, value, [&](long long x, long long y) {
+                long long z;
+                overflow |= bigint_sub_overflow(x, y, z);
+                return z;
+            });
+        }
+        else if (proc == EGA_div || proc == EGA_mod)
+        {
+            // Let EGA_run report the division by zero at the right row.
+            const long long *pb = args[1].ints();
+            size_t count = args[1].constant ? 1 : rows;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (pb[i] == 0)
+                    return false;
+            }
+            if (proc == EGA_div)
+            {
+                EGA_batch_binary(args[0], args[1], rows, value, [&](long long x, long long y) {
+                    if (y == -1)
+                    {
+                        // Negated as unsigned. -LLONG_MIN overflows.
+                        overflow |= (x == LLONG_MIN);
+                        return (long long)(0ULL - (unsigned long long)x);
+                    }
+                    return x / y;
+                });
+            }
+            else
+            {
+                EGA_batch_binary(args[0], args[1], rows, value, [](long long x, long long y) {
+                    return (y == -1) ? 0 : x % y;
+                });
+            }
+        }
+        else if (proc == EGA_not)
+            EGA_batch_unary(args[0], rows, value, [](long long x) { return (long long)!x; });
+        else if (proc == EGA_compl)
+            EGA_batch_unary(args[0], rows, value, [](long long x) { return ~x; });
+        else if (proc == EGA_and)
+        {
+            BatchValue first;
+            EGA_batch_unary(args[0], rows, first, [](long long x) { return (long long)!!x; });
+            args[0] = std::move(first);
+            EGA_batch_fold(args, rows, value, [](long long x, long long y) { return (long long)(x && y); });
+        }
+        else if (proc == EGA_or)
+        {
+            BatchValue first;
+            EGA_batch_unary(args[0], rows, first, [](long long x) { return (long long)!!x; });
+            args[0] = std::move(first);
+            EGA_batch_fold(args, rows, value, [](long long x, long long y) { return (long long)(x || y); });
+        }
+        else if (proc == EGA_bitand)
+            EGA_batch_fold(args, rows, value, [](long long x, long long y) { return x & y; });
+        else if (proc == EGA_bitor)
+            EGA_batch_fold(args, rows, value, [](long long x, long long y) { return x | y; });
+        else if (proc == EGA_xor)
+            EGA_batch_fold(args, rows, value, [](long long x, long long y) { return x ^ y; });
+        else
+            return false;
 
-    if (!has_read)
-        return make_arg<AstInt>(0);
+        if (overflow)
+            return false;
+    }
 
-    return make_arg<AstStr>(contents);
+    return true;
 }
 
-arg_t EGA_FN EGA_save(const args_t& args)
+args_t EGA_run_batch(const program_t& program, const columns_t& columns)
 {
-    EVAL_DEBUG();
-    std::string filename = EGA_get_str(args[0]);
-    std::string contents = EGA_get_str(args[1]);
-    if (!EGA_file_security(filename))
+    size_t rows = columns.empty() ? 0 : columns[0].size();
+
+    column_map_t column_map;
+    for (auto& column : columns)
     {
-        EGA_hit_security();
-        return make_arg<AstInt>(0);
+        if (column.size() != rows)
+            throw EGA_illegal_operation(0);
+        column_map[column.name] = &column;
     }
 
-#ifdef _WIN32
-    wchar_t path[MAX_PATH];
-    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, path, _countof(path));
-    FILE *fp = _wfopen(path, L"wb");
-#else
-    FILE *fp = fopen(filename, "wb");
-#endif
-    if (!fp)
-        return make_arg<AstInt>(0);
+    args_t results;
+    results.reserve(rows);
 
-    bool written = !!fwrite(contents.data(), 1, contents.size(), fp);
-    fclose(fp);
-    return make_arg<AstInt>(written);
+    BatchValue value;
+    if (rows > 0 && EGA_batch_eval(program->ast, column_map, rows, value, 0))
+    {
+        if (value.constant)
+        {
+            arg_t result;
+            if (value.type == AST_INT)
+                result = make_arg<AstInt>(value.ints()[0]);
+            else
+                result = make_arg<AstStr>(value.strs()[0]);
+            results.assign(rows, result);
+        }
+        else if (value.type == AST_INT)
+        {
+            const long long *pi = value.ints();
+            for (size_t i = 0; i < rows; ++i)
+                results.push_back(make_arg<AstInt>(pi[i]));
+        }
+        else
+        {
+            const std::string *ps = value.strs();
+            for (size_t i = 0; i < rows; ++i)
+                results.push_back(make_arg<AstStr>(ps[i]));
+        }
+        return results;
+    }
+
+    bindings_t bindings(columns.size());
+    for (size_t i = 0; i < columns.size(); ++i)
+        bindings[i].first = columns[i].name;
+
+    for (size_t row = 0; row < rows; ++row)
+    {
+        for (size_t i = 0; i < columns.size(); ++i)
+        {
+            if (columns[i].type == AST_INT)
+                bindings[i].second = make_arg<AstInt>(columns[i].ints[row]);
+            else
+                bindings[i].second = make_arg<AstStr>(columns[i].strs[row]);
+        }
+        results.push_back(EGA_run(program, bindings));
+    }
+
+    return results;
 }
 
 bool EGA_init(void)
 {
-    s_stopping = false;
+    auto& state = EGA_state();
 
-    s_fn_map.reserve(96);
+    state.stopping = false;
+
+    state.fn_map->reserve(96);
 
     EGA_set_input_fn(EGA_default_input);
     EGA_set_print_fn(EGA_default_print);
 
     // assignment
-    EGA_add_fn("set", 1, 2, EGA_set, "set(var[, value])");
-    EGA_add_fn("=", 1, 2, EGA_set, "set(var[, value])");
+    EGA_add_fn("set", 1, 3, EGA_set, "set(var[, [key, ]value])");
+    EGA_add_fn("=", 1, 3, EGA_set, "set(var[, [key, ]value])");
     EGA_add_fn("define", 1, 2, EGA_define, "define(var[, expr])");
     EGA_add_fn(":=", 1, 2, EGA_define, "define(var[, expr])");
 
+    // memoization
+    EGA_add_fn("memo", 3, 4, EGA_memo, "memo(name, key, expr[, max_size])");
+    EGA_add_fn("define_memo", 3, 4, EGA_define_memo, "define_memo(var, key, expr[, max_size])");
+    EGA_add_fn("memo_stats", 1, 1, EGA_memo_stats, "memo_stats(name)", true);
+    EGA_add_fn("memo_clear", 0, 1, EGA_memo_clear, "memo_clear([name])", true);
+
     // type and conversion
-    EGA_add_fn("typeid", 1, 1, EGA_typeid, "typeid(value)");
-    EGA_add_fn("int", 1, 1, EGA_int, "int(value)");
-    EGA_add_fn("str", 1, 1, EGA_str, "str(value)");
-    EGA_add_fn("array", 0, 32767, EGA_array, "array(value1[, ...])");
-    EGA_add_fn("binary", 0, 32767, EGA_binary, "binary(string_or_byte[, ...])");
-    EGA_add_fn("hex", 1, 1, EGA_hex, "hex(value)");
+    EGA_add_fn("typeid", 1, 1, EGA_typeid, "typeid(value)", true);
+    EGA_add_fn("int", 1, 1, EGA_int, "int(value)", true);
+    EGA_add_fn("str", 1, 1, EGA_str, "str(value)", true);
+    EGA_add_fn("array", 0, 32767, EGA_array, "array(value1[, ...])", true);
+    EGA_add_fn("binary", 0, 32767, EGA_binary, "binary(string_or_byte[, ...])", true);
+    EGA_add_fn("hex", 1, 1, EGA_hex, "hex(value)", true);
 
     // control structure
     EGA_add_fn("if", 2, 3, EGA_if, "if(cond, true_case[, false_case])");
     EGA_add_fn("?:", 2, 3, EGA_if, "if(cond, true_case[, false_case])");
     EGA_add_fn("for", 4, 4, EGA_for, "for(var, min, max, expr)");
     EGA_add_fn("foreach", 3, 3, EGA_foreach, "foreach(var, ary, expr)");
+    EGA_add_fn("map", 3, 3, EGA_map, "map(var, ary, expr)");
+    EGA_add_fn("filter", 3, 3, EGA_filter, "filter(var, ary, cond)");
+    EGA_add_fn("reduce", 5, 5, EGA_reduce, "reduce(acc, var, ary, init, expr)");
+    EGA_add_fn("pforeach", 3, 4, EGA_pforeach, "pforeach(var, ary, expr[, grain])");
+    EGA_add_fn("pmap", 3, 3, EGA_pmap, "pmap(var, ary, expr)");
+    EGA_add_fn("preduce", 6, 6, EGA_preduce, "preduce(acc, var, ary, init, expr, combine)");
+    EGA_add_fn("gen", 2, 2, EGA_gen, "gen(var, expr)");
+    EGA_add_fn("yield", 1, 1, EGA_yield, "yield(value)", true);
+    EGA_add_fn("next", 1, 2, EGA_next, "next(gen[, default])", true);
     EGA_add_fn("while", 2, 2, EGA_while, "while(cond, expr)");
     EGA_add_fn("do", 0, 32767, EGA_do, "do(expr, ...)");
+    EGA_add_fn("eval", 1, 1, EGA_eval, "eval(str)", true);
     EGA_add_fn("exit", 0, 1, EGA_exit, "exit([value])");
     EGA_add_fn("break", 0, 0, EGA_break, "break()");
 
     // comparison
-    EGA_add_fn("equal", 2, 2, EGA_equal, "equal(value1, value2)");
-    EGA_add_fn("==", 2, 2, EGA_equal, "equal(value1, value2)");
-    EGA_add_fn("not_equal", 2, 2, EGA_not_equal, "not_equal(value1, value2)");
-    EGA_add_fn("!=", 2, 2, EGA_not_equal, "not_equal(value1, value2)");
-    EGA_add_fn("compare", 2, 2, EGA_compare, "compare(value1, value2)");
-    EGA_add_fn("less", 2, 2, EGA_less, "less(value1, value2)");
-    EGA_add_fn("<", 2, 2, EGA_less, "less(value1, value2)");
-    EGA_add_fn("less_equal", 2, 2, EGA_less_equal, "less_equal(value1, value2)");
-    EGA_add_fn("<=", 2, 2, EGA_less_equal, "less_equal(value1, value2)");
-    EGA_add_fn("greater", 2, 2, EGA_greater, "greater(value1, value2)");
-    EGA_add_fn(">", 2, 2, EGA_greater, "greater(value1, value2)");
-    EGA_add_fn("greater_equal", 2, 2, EGA_greater_equal, "greater_equal(value1, value2)");
-    EGA_add_fn(">=", 2, 2, EGA_greater_equal, "greater_equal(value1, value2)");
+    EGA_add_fn("equal", 2, 2, EGA_equal, "equal(value1, value2)", true);
+    EGA_add_fn("==", 2, 2, EGA_equal, "equal(value1, value2)", true);
+    EGA_add_fn("not_equal", 2, 2, EGA_not_equal, "not_equal(value1, value2)", true);
+    EGA_add_fn("!=", 2, 2, EGA_not_equal, "not_equal(value1, value2)", true);
+    EGA_add_fn("compare", 2, 2, EGA_compare, "compare(value1, value2)", true);
+    EGA_add_fn("less", 2, 2, EGA_less, "less(value1, value2)", true);
+    EGA_add_fn("<", 2, 2, EGA_less, "less(value1, value2)", true);
+    EGA_add_fn("less_equal", 2, 2, EGA_less_equal, "less_equal(value1, value2)", true);
+    EGA_add_fn("<=", 2, 2, EGA_less_equal, "less_equal(value1, value2)", true);
+    EGA_add_fn("greater", 2, 2, EGA_greater, "greater(value1, value2)", true);
+    EGA_add_fn(">", 2, 2, EGA_greater, "greater(value1, value2)", true);
+    EGA_add_fn("greater_equal", 2, 2, EGA_greater_equal, "greater_equal(value1, value2)", true);
+    EGA_add_fn(">=", 2, 2, EGA_greater_equal, "greater_equal(value1, value2)", true);
 
     // print/input
-    EGA_add_fn("print", 0, 32767, EGA_print, "print(value, ...)");
-    EGA_add_fn("println", 0, 32767, EGA_println, "println(value, ...)");
-    EGA_add_fn("dump", 0, 32767, EGA_dump, "dump(value, ...)");
-    EGA_add_fn("dumpln", 0, 32767, EGA_dumpln, "dumpln(value, ...)");
-    EGA_add_fn("?", 0, 32767, EGA_dumpln, "dumpln(value, ...)");
+    EGA_add_fn("print", 0, 32767, EGA_print, "print(value, ...)", true);
+    EGA_add_fn("println", 0, 32767, EGA_println, "println(value, ...)", true);
+    EGA_add_fn("dump", 0, 32767, EGA_dump, "dump(value, ...)", true);
+    EGA_add_fn("dumpln", 0, 32767, EGA_dumpln, "dumpln(value, ...)", true);
+    EGA_add_fn("?", 0, 32767, EGA_dumpln, "dumpln(value, ...)", true);
 
     // arithmetic
-    EGA_add_fn("plus", 1, 32767, EGA_plus, "plus(int1, int2)");
-    EGA_add_fn("+", 1, 32767, EGA_plus, "plus(int1, int2)");
-    EGA_add_fn("minus", 1, 2, EGA_minus, "minus(int1[, int2])");
-    EGA_add_fn("-", 1, 2, EGA_minus, "minus(int1[, int2])");
-    EGA_add_fn("mul", 2, 32767, EGA_mul, "mul(int1, int2)");
-    EGA_add_fn("*", 2, 32767, EGA_mul, "mul(int1, int2)");
-    EGA_add_fn("div", 2, 2, EGA_div, "div(int1, int2)");
-    EGA_add_fn("/", 2, 2, EGA_div, "div(int1, int2)");
-    EGA_add_fn("mod", 2, 2, EGA_mod, "mod(int1, int2)");
-    EGA_add_fn("%", 2, 2, EGA_mod, "mod(int1, int2)");
+    EGA_add_fn("plus", 1, 32767, EGA_plus, "plus(int1, int2)", true);
+    EGA_add_fn("+", 1, 32767, EGA_plus, "plus(int1, int2)", true);
+    EGA_add_fn("minus", 1, 2, EGA_minus, "minus(int1[, int2])", true);
+    EGA_add_fn("-", 1, 2, EGA_minus, "minus(int1[, int2])", true);
+    EGA_add_fn("mul", 2, 32767, EGA_mul, "mul(int1, int2)", true);
+    EGA_add_fn("*", 2, 32767, EGA_mul, "mul(int1, int2)", true);
+    EGA_add_fn("div", 2, 2, EGA_div, "div(int1, int2)", true);
+    EGA_add_fn("/", 2, 2, EGA_div, "div(int1, int2)", true);
+    EGA_add_fn("mod", 2, 2, EGA_mod, "mod(int1, int2)", true);
+    EGA_add_fn("%", 2, 2, EGA_mod, "mod(int1, int2)", true);
 
     // logical
-    EGA_add_fn("not", 1, 1, EGA_not, "not(value)");
-    EGA_add_fn("!", 1, 1, EGA_not, "not(value)");
+    EGA_add_fn("not", 1, 1, EGA_not, "not(value)", true);
+    EGA_add_fn("!", 1, 1, EGA_not, "not(value)", true);
     EGA_add_fn("or", 2, 32767, EGA_or, "or(value1, value2, ...)");
     EGA_add_fn("||", 2, 32767, EGA_or, "or(value1, value2, ...)");
     EGA_add_fn("and", 2, 32767, EGA_and, "and(value1, value2, ...)");
     EGA_add_fn("&&", 2, 32767, EGA_and, "and(value1, value2, ...)");
 
     // bit operation
-    EGA_add_fn("compl", 1, 1, EGA_compl, "compl(value)");
-    EGA_add_fn("~", 1, 1, EGA_compl, "compl(value)");
-    EGA_add_fn("bitor", 2, 32767, EGA_bitor, "bitor(value1, value2, ...)");
-    EGA_add_fn("|", 2, 32767, EGA_bitor, "bitor(value1, value2, ...)");
-    EGA_add_fn("bitand", 2, 32767, EGA_bitand, "bitand(value1, value2, ...)");
-    EGA_add_fn("&", 2, 32767, EGA_bitand, "bitand(value1, value2, ...)");
-    EGA_add_fn("xor", 2, 32767, EGA_xor, "xor(value1, value2, ...)");
-    EGA_add_fn("^", 2, 2, EGA_xor, "xor(value1, value2)");
+    EGA_add_fn("compl", 1, 1, EGA_compl, "compl(value)", true);
+    EGA_add_fn("~", 1, 1, EGA_compl, "compl(value)", true);
+    EGA_add_fn("bitor", 2, 32767, EGA_bitor, "bitor(value1, value2, ...)", true);
+    EGA_add_fn("|", 2, 32767, EGA_bitor, "bitor(value1, value2, ...)", true);
+    EGA_add_fn("bitand", 2, 32767, EGA_bitand, "bitand(value1, value2, ...)", true);
+    EGA_add_fn("&", 2, 32767, EGA_bitand, "bitand(value1, value2, ...)", true);
+    EGA_add_fn("xor", 2, 32767, EGA_xor, "xor(value1, value2, ...)", true);
+    EGA_add_fn("^", 2, 2, EGA_xor, "xor(value1, value2)", true);
 
     // array/string manipulation
-    EGA_add_fn("len", 1, 1, EGA_len, "len(ary_or_str)");
-    EGA_add_fn("cat", 1, 32767, EGA_cat, "cat(ary_or_str_1, ary_or_str_2, ...)");
+    EGA_add_fn("len", 1, 1, EGA_len, "len(ary_or_str_or_dict)", true);
+    EGA_add_fn("cat", 1, 32767, EGA_cat, "cat(ary_or_str_1, ary_or_str_2, ...)", true);
     EGA_add_fn("[]", 2, 3, EGA_at, "at(ary_or_str, index[, value])");
     EGA_add_fn("at", 2, 3, EGA_at, "at(ary_or_str, index[, value])");
-    EGA_add_fn("left", 2, 2, EGA_left, "left(ary_or_str, count)");
-    EGA_add_fn("right", 2, 2, EGA_right, "right(ary_or_str, count)");
-    EGA_add_fn("mid", 3, 4, EGA_mid, "mid(ary_or_str, index, count[, value])");
-    EGA_add_fn("find", 2, 2, EGA_find, "find(ary_or_str, target)");
-    EGA_add_fn("replace", 3, 3, EGA_replace, "replace(ary_or_str, from, to)");
-    EGA_add_fn("remove", 2, 2, EGA_remove, "remove(ary_or_str, target)");
-    EGA_add_fn("u8fromu16", 1, 1, EGA_u8fromu16, "u8fromu16(utf16str)");
-    EGA_add_fn("u16fromu8", 1, 1, EGA_u16fromu8, "u16fromu8(utf8str)");
+    EGA_add_fn("left", 2, 2, EGA_left, "left(ary_or_str, count)", true);
+    EGA_add_fn("right", 2, 2, EGA_right, "right(ary_or_str, count)", true);
+    EGA_add_fn("mid", 3, 4, EGA_mid, "mid(ary_or_str, index, count[, value])", true);
+    EGA_add_fn("find", 2, 2, EGA_find, "find(ary_or_str, target)", true);
+    EGA_add_fn("replace", 3, 3, EGA_replace, "replace(ary_or_str, from, to)", true);
+    EGA_add_fn("remove", 2, 2, EGA_remove, "remove(ary_or_str, target)", true);
+    EGA_add_fn("u8fromu16", 1, 1, EGA_u8fromu16, "u8fromu16(utf16str)", true);
+    EGA_add_fn("u16fromu8", 1, 1, EGA_u16fromu8, "u16fromu8(utf8str)", true);
 
     // date/time manipulation
-    EGA_add_fn("localtime", 0, 0, EGA_localtime, "localtime()");
-    EGA_add_fn("gmtime", 0, 0, EGA_gmtime, "gmtime()");
+    EGA_add_fn("localtime", 0, 0, EGA_localtime, "localtime()", true);
+    EGA_add_fn("gmtime", 0, 0, EGA_gmtime, "gmtime()", true);
 
     // file manipulation
-    EGA_add_fn("load", 1, 1, EGA_load, "load(filename)");
-    EGA_add_fn("save", 2, 2, EGA_save, "save(filename, bin)");
+    EGA_add_fn("load", 1, 2, EGA_load, "load(filename[, as_buffer])", true);
+    EGA_add_fn("save", 2, 2, EGA_save, "save(filename, bin)", true);
+
+    // string builders
+    EGA_add_fn("strbuf", 0, 1, EGA_strbuf, "strbuf([str])", true);
+    EGA_add_fn("append", 2, 32767, EGA_append, "append(var, value1[, ...])");
+    EGA_add_fn("tostr", 1, 1, EGA_tostr, "tostr(strbuf)");
+
+    // splitting and joining
+    EGA_add_fn("split", 2, 2, EGA_split, "split(str, sep)", true);
+    EGA_add_fn("join", 1, 2, EGA_join, "join(ary[, sep])", true);
+    EGA_add_fn("lines", 1, 1, EGA_lines, "lines(str)", true);
+
+    // regular expressions
+    EGA_add_fn("match", 2, 2, EGA_match, "match(str, pattern)", true);
+    EGA_add_fn("search", 2, 3, EGA_search, "search(str, pattern[, start])", true);
+    EGA_add_fn("regex_replace", 3, 3, EGA_regex_replace, "regex_replace(str, pattern, replacement)", true);
+    EGA_add_fn("regex_split", 2, 2, EGA_regex_split, "regex_split(str, pattern)", true);
+
+    // byte buffers
+    EGA_add_fn("buffer", 1, 1, EGA_buffer, "buffer(size_or_str)", true);
+    EGA_add_fn("slice", 2, 3, EGA_slice, "slice(buf, offset[, size])", true);
+    EGA_add_fn("read_le", 3, 4, EGA_read_le, "read_le(buf, offset, width[, signed])", true);
+    EGA_add_fn("read_be", 3, 4, EGA_read_be, "read_be(buf, offset, width[, signed])", true);
+    EGA_add_fn("write_le", 4, 4, EGA_write_le, "write_le(var, offset, width, value)");
+    EGA_add_fn("write_be", 4, 4, EGA_write_be, "write_be(var, offset, width, value)");
+
+    // packed integer arrays
+    EGA_add_fn("intarray", 1, 2, EGA_intarray, "intarray(ary_or_size[, value])", true);
+    EGA_add_fn("sum", 1, 1, EGA_sum, "sum(ary)", true);
+    EGA_add_fn("min", 1, 1, EGA_min, "min(ary)", true);
+    EGA_add_fn("max", 1, 1, EGA_max, "max(ary)", true);
+    EGA_add_fn("count", 2, 2, EGA_count, "count(ary, value)", true);
+
+    // sorting
+    EGA_add_fn("sort", 1, 2, EGA_sort, "sort(ary[, desc])", true);
+    EGA_add_fn("sort_by", 2, 3, EGA_sort_by, "sort_by(ary, key_index[, desc])", true);
+
+    // dictionary
+    EGA_add_fn("dict", 0, 32767, EGA_dict, "dict(key1, value1[, ...])", true);
+    EGA_add_fn("get", 2, 3, EGA_get, "get(dict, key[, default])", true);
+    EGA_add_fn("has", 2, 2, EGA_has, "has(dict, key)", true);
+    EGA_add_fn("del", 2, 2, EGA_del, "del(var, key)");
+    EGA_add_fn("keys", 1, 1, EGA_keys, "keys(dict)", true);
+    EGA_add_fn("values", 1, 1, EGA_values, "values(dict)", true);
 
     return true;
 }
@@ -2592,20 +6389,31 @@ bool EGA_init(void)
 void
 EGA_uninit(void)
 {
-    s_fn_map.clear();
-    s_var_map.clear();
-    s_stopping = false;
-    assert(Token::s_alive_count == 0);
-    assert(AstBase::s_alive_count == 0);
+    auto& state = EGA_state();
+
+    EGA_clear_program_cache();
+    state.memo_map.clear();
+    state.fn_map = std::make_shared<fn_map_t>();
+    state.var_map.clear();
+    state.stopping = false;
+
+    // The other contexts may still have the nodes.
+    if (s_context_count <= 1)
+    {
+        assert(Token::s_alive_count == 0);
+        assert(AstBase::s_alive_count == 0);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
 void EGA_show_help(void)
 {
+    auto& state = EGA_state();
+
     EGA_do_print("EGA has the following functions:\n");
     std::vector<std::string> names;
-    for (const auto& pair : s_fn_map)
+    for (const auto& pair : *state.fn_map)
     {
         names.push_back(pair.first);
     }
@@ -2614,13 +6422,15 @@ void EGA_show_help(void)
     {
         EGA_do_print("  %s\n", name.c_str());
     }
-    (*s_input_fn)(nullptr, 0);
+    (*state.input_fn)(nullptr, 0);
 }
 
 void EGA_show_help(const std::string& name)
 {
-    auto it = s_fn_map.find(name);
-    if (it == s_fn_map.end() || !it->second)
+    auto& state = EGA_state();
+
+    auto it = state.fn_map->find(name);
+    if (it == state.fn_map->end() || !it->second)
     {
         EGA_do_print("ERROR: No such function: '%s'\n", name.c_str());
         return;
@@ -2638,7 +6448,7 @@ void EGA_show_help(const std::string& name)
     }
 
     EGA_do_print("  usage: %s\n", it->second->help.c_str());
-    (*s_input_fn)(nullptr, 0);
+    (*state.input_fn)(nullptr, 0);
 }
 
 void EGA_print_logo(const char *filename)
@@ -2652,20 +6462,22 @@ void EGA_print_logo(const char *filename)
 
 int EGA_interactive(const char *filename, bool echo)
 {
+    auto& state = EGA_state();
+
     char buf[512];
 
-    s_interactive = true;
-    s_echo_input = echo;
-    s_stopping = false;
+    state.interactive = true;
+    state.echo_input = echo;
+    state.stopping = false;
 
     EGA_print_logo(filename);
 
     if (filename)
     {
         EGA_do_print("Executing '%s'...\n", filename);
-        s_interactive = false;
+        state.interactive = false;
         EGA_file_input(filename);
-        s_interactive = true;
+        state.interactive = true;
         EGA_do_print("Done.\n");
     }
 
@@ -2674,12 +6486,12 @@ int EGA_interactive(const char *filename, bool echo)
         EGA_do_print("\n");
         std::fflush(stdout);
 
-        if (!(*s_input_fn)(buf, sizeof(buf)))
+        if (!(*state.input_fn)(buf, sizeof(buf)))
             break;
 
         mstr_trim(buf, " \t\r\n\f\v;");
 
-        if (s_echo_input)
+        if (state.echo_input)
             EGA_do_print("EGA> %s;\n", buf);
 
         if (strcmp(buf, "exit") == 0)
@@ -2702,7 +6514,7 @@ int EGA_interactive(const char *filename, bool echo)
         if (!EGA_eval_text_ex(buf))
             break;
 
-        (*s_input_fn)(nullptr, 0);
+        (*state.input_fn)(nullptr, 0);
     }
 
     return 0;
@@ -2735,7 +6547,7 @@ bool EGA_file_input(const char *filename)
         fclose(fp);
 
         EGA_eval_text_ex(str.c_str());
-        (*s_input_fn)(nullptr, 0);
+        (*EGA_state().input_fn)(nullptr, 0);
         return true;
     }
 
@@ -2745,7 +6557,7 @@ bool EGA_file_input(const char *filename)
 
 bool EGA_stop(void)
 {
-    s_stopping = true;
+    EGA_state().stopping = true;
     return true;
 }
 
@@ -2754,7 +6566,290 @@ bool EGA_is_stopping(void)
 #ifdef _WIN32
     Sleep(0);
 #endif
-    return s_stopping;
+    for (const EGA_CONTEXT_DATA *state = &EGA_state(); state; state = state->parent)
+    {
+        if (state->stopping)
+            return true;
+    }
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// EGA_Context
+
+EGA_Context::EGA_Context() : m_data(new EGA_CONTEXT_DATA)
+{
+    ++s_context_count;
+}
+
+EGA_Context::~EGA_Context()
+{
+    assert(s_current_context != this);
+    --s_context_count;
+}
+
+EGA_Context::Scope::Scope(EGA_Context& context) : m_old(s_current_context)
+{
+    s_current_context = &context;
+}
+
+EGA_Context::Scope::~Scope()
+{
+    s_current_context = m_old;
+}
+
+/*static*/ EGA_Context& EGA_Context::current()
+{
+    return s_current_context ? *s_current_context : get_default();
+}
+
+/*static*/ EGA_Context& EGA_Context::get_default()
+{
+    return s_default_context;
+}
+
+bool EGA_Context::init()
+{
+    Scope scope(*this);
+    return EGA_init();
+}
+
+void EGA_Context::uninit()
+{
+    Scope scope(*this);
+    EGA_uninit();
+}
+
+void EGA_Context::set_print_fn(EGA_PRINT_FN fn)
+{
+    m_data->print_fn = fn;
+}
+
+void EGA_Context::set_input_fn(EGA_INPUT_FN fn)
+{
+    m_data->input_fn = fn;
+}
+
+void EGA_Context::set_max_depth(size_t depth)
+{
+    m_data->max_depth = depth;
+}
+
+void EGA_Context::set_program_cache_size(size_t size)
+{
+    Scope scope(*this);
+    EGA_set_program_cache_size(size);
+}
+
+void EGA_Context::set_regex_cache_size(size_t size)
+{
+    Scope scope(*this);
+    EGA_set_regex_cache_size(size);
+}
+
+program_t EGA_Context::compile(const char *text)
+{
+    Scope scope(*this);
+    return EGA_compile(text);
+}
+
+arg_t EGA_Context::run(const program_t& program, const bindings_t& bindings)
+{
+    Scope scope(*this);
+    return EGA_run(program, bindings);
+}
+
+args_t EGA_Context::run_batch(const program_t& program, const columns_t& columns)
+{
+    Scope scope(*this);
+    return EGA_run_batch(program, columns);
+}
+
+void EGA_Context::set_var(const std::string& name, arg_t ast)
+{
+    Scope scope(*this);
+    EGA_set_var(name, ast);
+}
+
+bool EGA_Context::eval_text_ex(const char *text)
+{
+    Scope scope(*this);
+    return EGA_eval_text_ex(text);
+}
+
+bool EGA_Context::stop()
+{
+    m_data->stopping = true;
+    return true;
+}
+
+bool EGA_Context::is_stopping() const
+{
+    return m_data->stopping;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// EGA_ContextPool
+
+EGA_ContextPool::Lease::Lease(EGA_ContextPool *pool, std::unique_ptr<EGA_Context> context)
+    : m_pool(pool)
+    , m_context(std::move(context))
+{
+}
+
+EGA_ContextPool::Lease::Lease(Lease&& other)
+    : m_pool(other.m_pool)
+    , m_context(std::move(other.m_context))
+{
+}
+
+EGA_ContextPool::Lease::~Lease()
+{
+    if (m_context)
+        m_pool->release(std::move(m_context));
+}
+
+EGA_ContextPool::EGA_ContextPool(EGA_Context& prototype, size_t max_idle)
+    : m_max_idle(max_idle)
+{
+    EGA_copy_context(m_base.data(), prototype.data());
+}
+
+program_t EGA_ContextPool::compile(const char *text)
+{
+    // The program cache of m_base is not shared.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_base.compile(text);
+}
+
+EGA_ContextPool::Lease EGA_ContextPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_idle.size())
+        {
+            std::unique_ptr<EGA_Context> context = std::move(m_idle.back());
+            m_idle.pop_back();
+            return Lease(this, std::move(context));
+        }
+    }
+
+    std::unique_ptr<EGA_Context> context(new EGA_Context);
+    EGA_copy_context(context->data(), m_base.data());
+    return Lease(this, std::move(context));
+}
+
+arg_t EGA_ContextPool::run(const program_t& program, const bindings_t& bindings)
+{
+    auto lease = acquire();
+    return lease->run(program, bindings);
+}
+
+size_t EGA_ContextPool::idle_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_idle.size();
+}
+
+// Resets the variables and the memo caches. The frames of the evaluation
+// stack and the regex cache are kept warm.
+void EGA_ContextPool::release(std::unique_ptr<EGA_Context> context)
+{
+    auto& data = context->data();
+    EGA_copy_context(data, m_base.data());
+    data.memo_map.clear();
+    data.stopping = false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_idle.size() < m_max_idle)
+        m_idle.push_back(std::move(context));
+    // Otherwise the context is destroyed.
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Runs a script in its own context and returns the dump of the value.
+static std::string EGA_unittest_run(EGA_Context& context, const char *text)
+{
+    auto value = context.run(context.compile(text));
+    return value ? value->dump(true) : "NULL";
+}
+
+void EGA_unittest(void)
+{
+    EGA_Context context;
+    EGA_Context::Scope scope(context);
+    context.init();
+
+    // tostr empties the variable, also if the strbuf is shared.
+    assert(EGA_unittest_run(context, "set(sb, strbuf(\"a\")); append(sb, \"b\"); array(tostr(sb), tostr(sb))") ==
+           "{ \"ab\", \"\" }");
+    assert(EGA_unittest_run(context, "set(sb, strbuf(\"abc\")); array(tostr(sb), tostr(sb))") ==
+           "{ \"abc\", \"\" }");
+    assert(EGA_unittest_run(context, "set(sb, strbuf(\"ab\")); set(keep, sb); array(tostr(sb), tostr(sb), tostr(keep))") ==
+           "{ \"ab\", \"\", \"ab\" }");
+
+    // int parses a whole decimal integer.
+    assert(EGA_unittest_run(context, "array(int(\" -12 \"), int(\"+7\"), int(\"007\"))") == "{ -12, 7, 7 }");
+    assert(EGA_unittest_run(context, "int(\"-9223372036854775809\")") == "-9223372036854775809");
+    const char *bad_ints[] = { "int(\"12x\")", "int(\"abc\")", "int(\"\")", "int(\"-\")", "int(\"1 2\")" };
+    for (auto text : bad_ints)
+    {
+        bool thrown = false;
+        try
+        {
+            EGA_unittest_run(context, text);
+        }
+        catch (EGA_illegal_operation&)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // A strbuf or a buffer is compared as a string.
+    assert(EGA_unittest_run(context, "array(==(strbuf(\"a\"), \"a\"), ==(\"a\", strbuf(\"a\")), <(strbuf(\"a\"), \"b\"), "
+                                     "==({strbuf(\"x\")}, {\"x\"}))") == "{ 1, 1, 1, 1 }");
+
+    // The body of map can unset its variable.
+    assert(EGA_unittest_run(context, "map(x, {1, 2, 3}, do(set(y, x), set(x), *(y, 2)))") == "{ 2, 4, 6 }");
+    assert(EGA_unittest_run(context, "reduce(a, x, {1, 2, 3}, 0, do(set(s, +(a, x)), set(a), set(x), s))") == "6");
+
+    // mid with a negative count takes the rest.
+    assert(EGA_unittest_run(context, "array(mid(\"hello\", 1, -(1)), mid(\"hello\", 5, -(1)), mid({1, 2, 3}, 1, -(2)))") ==
+           "{ \"ello\", \"\", { 2, 3 } }");
+
+    // A generator made again in var cancels the old one. Each generator has
+    // a context, so the old ones would stay in s_context_count.
+    int contexts = s_context_count;
+    EGA_unittest_run(context, "for(i, 1, 200, do(gen(g, for(k, 1, 10, yield(k))), next(g)))");
+    assert(s_context_count <= contexts + 1);
+
+    // The body keeps the generators that it names.
+    assert(EGA_unittest_run(context, "gen(nat, for(k, 1, 100, yield(k))); "
+                                     "gen(odd, foreach(x, nat, if(%(x, 2), yield(x)))); "
+                                     "array(next(odd), next(odd))") == "{ 1, 3 }");
+
+    // A long key is compared as a whole.
+    assert(EGA_unittest_run(context, "set(b, strbuf()); for(i, 1, 20000, append(b, \"a\")); set(p, tostr(b)); "
+                                     "set(s1, cat(p, \"1\")); set(s2, cat(p, \"2\")); "
+                                     "array(memo(\"k\", s1, 1), memo(\"k\", s2, 2), memo(\"k\", s1, 3))") ==
+           "{ 1, 2, 1 }");
+    assert(EGA_unittest_run(context, "array(memo(\"t\", {1, \"2\"}, 1), memo(\"t\", {1, 2}, 2), "
+                                     "memo(\"t\", strbuf(\"x\"), 3), memo(\"t\", \"x\", 4))") ==
+           "{ 1, 2, 3, 4 }");
+
+    // An overflow in a batch is redone by BigInt.
+    {
+        columns_t columns(1, EGA_COLUMN("x"));
+        columns[0].ints = { LLONG_MIN, 6 };
+        auto results = context.run_batch(context.compile("/(x, -(1))"), columns);
+        assert(results.size() == 2);
+        assert(results[0]->dump(true) == "9223372036854775808");
+        assert(results[1]->dump(true) == "-6");
+    }
+
+    context.uninit();
 }
 
 } // namespace EGA
@@ -2792,6 +6887,18 @@ int main(int argc, char **argv)
             printf("Options:\n");
             printf("  --help      Show this message.\n");
             printf("  --version   Show version info.\n");
+            printf("  --test      Run the self tests.\n");
+            return 0;
+        }
+
+        if (arg == "--test")
+        {
+            bigint_unittest();
+            intvec_unittest();
+            utfvec_unittest();
+            regex_unittest();
+            EGA_unittest();
+            printf("OK\n");
             return 0;
         }
 
@@ -3,16 +3,19 @@
 // This file is public domain software.
 
 #ifndef EGA_HPP_
-#define EGA_HPP_    14 // Version 14
+#define EGA_HPP_    15 // Version 15
 
 #pragma once
 
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <mutex>
 #include <cstdlib>
 #include <cassert>
 #include <stdexcept>
+#include "bigint.hpp"
 
 namespace EGA {
 
@@ -47,20 +50,25 @@ struct EGA_FUNCTION
     size_t max_args;
     EGA_PROC proc;
     std::string help;
+    // A normal function gets its arguments already evaluated (in order) by
+    // the interpreter. A special function gets them unevaluated.
+    bool normal;
 
-    EGA_FUNCTION(std::string n, size_t m1, size_t m2, EGA_PROC p, std::string h)
+    EGA_FUNCTION(std::string n, size_t m1, size_t m2, EGA_PROC p, std::string h,
+                 bool nml = false)
         : name(n)
         , min_args(m1)
         , max_args(m2)
         , proc(p)
         , help(h)
+        , normal(nml)
     {
     }
 };
 typedef std::shared_ptr<EGA_FUNCTION> fn_t;
 
 bool EGA_add_fn(const std::string& name, size_t min_args, size_t max_args, EGA_PROC proc,
-                const std::string& help);
+                const std::string& help, bool normal = false);
 
 //////////////////////////////////////////////////////////////////////////////
 // printing
@@ -95,6 +103,11 @@ public:
         return m_lineno;
     }
 
+    void set_lineno(int lineno)
+    {
+        m_lineno = lineno;
+    }
+
 protected:
     int m_lineno;
 };
@@ -184,6 +197,23 @@ public:
     }
 };
 
+class EGA_nesting_too_deep : public EGA_exception
+{
+public:
+    EGA_nesting_too_deep(int lineno) : EGA_exception("nesting too deep", lineno)
+    {
+    }
+};
+
+class EGA_invalid_regex : public EGA_exception
+{
+public:
+    EGA_invalid_regex(const std::string& what, int lineno)
+        : EGA_exception(std::string("invalid regular expression: ") + what, lineno)
+    {
+    }
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // TokenType
 
@@ -208,7 +238,12 @@ enum AstType
     AST_ARRAY,
     AST_VAR,
     AST_CALL,
-    AST_PROGRAM
+    AST_PROGRAM,
+    AST_DICT,
+    AST_INTARRAY,
+    AST_BUFFER,
+    AST_STRBUF,
+    AST_GENERATOR
 };
 
 std::string EGA_dump_ast_type(AstType type);
@@ -219,7 +254,8 @@ std::string EGA_dump_ast_type(AstType type);
 class Token
 {
 public:
-    static int s_alive_count;
+    // Atomic, since the tokens can be made on the other threads.
+    static std::atomic<int> s_alive_count;
     static void alive_count(bool add);
 
     Token(TokenType type, int lineno, const std::string& str)
@@ -395,9 +431,6 @@ protected:
     arg_t visit_expression();
     arg_t visit_integer_literal();
     arg_t visit_string_literal();
-    arg_t visit_array_literal();
-    arg_t visit_call(const std::string& name);
-    arg_t visit_expression_list(AstType type, const std::string& name = "");
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -406,7 +439,8 @@ protected:
 class AstBase
 {
 public:
-    static int s_alive_count;
+    // Atomic, since the values can be made on the other threads.
+    static std::atomic<int> s_alive_count;
     static void alive_count(bool add);
 
     virtual ~AstBase()
@@ -414,7 +448,7 @@ public:
         alive_count(false);
     }
 
-    AstType get_type()
+    AstType get_type() const
     {
         return m_type;
     }
@@ -455,22 +489,47 @@ private:
 class AstInt : public AstBase
 {
 public:
-    AstInt(int value = 0, int lineno = 0)
+    AstInt(long long value = 0, int lineno = 0)
         : AstBase(AST_INT, lineno)
         , m_value(value)
     {
     }
 
-    int& get_int()
+    AstInt(const BigInt& value, int lineno = 0)
+        : AstBase(AST_INT, lineno)
+        , m_value(0)
+    {
+        if (!value.to_ll(m_value))
+            m_big = std::make_shared<const BigInt>(value);
+    }
+
+    // Valid only if !is_big().
+    long long& get_int()
+    {
+        return m_value;
+    }
+    long long get_int() const
     {
         return m_value;
     }
 
+    bool is_big() const
+    {
+        return !!m_big;
+    }
+
+    BigInt get_big() const
+    {
+        return m_big ? *m_big : BigInt(m_value);
+    }
+
     std::string dump(bool q) const override;
 
     arg_t clone() const override
     {
-        return make_arg<AstInt>(m_value);
+        auto ai = make_arg<AstInt>(m_value);
+        ai->m_big = m_big;
+        return ai;
     }
 
     arg_t eval() const override
@@ -479,7 +538,9 @@ public:
     }
 
 protected:
-    int m_value;
+    long long m_value;
+    // Non-null if the value doesn't fit in long long.
+    std::shared_ptr<const BigInt> m_big;
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -488,13 +549,17 @@ protected:
 class AstStr : public AstBase
 {
 public:
-    AstStr(const std::string& str = "", int lineno = 0)
+    AstStr(std::string str = "", int lineno = 0)
         : AstBase(AST_STR, lineno)
-        , m_str(str)
+        , m_str(std::move(str))
     {
     }
 
     std::string& get_str()
+    {
+        return m_str;
+    }
+    const std::string& get_str() const
     {
         return m_str;
     }
@@ -558,16 +623,16 @@ protected:
 class AstContainer : public AstBase
 {
 public:
-    AstContainer(AstType type = AST_ARRAY, int lineno = 0, const std::string& str = "")
+    AstContainer(AstType type = AST_ARRAY, int lineno = 0, const std::string& str = "",
+                 fn_t fn = nullptr)
         : AstBase(type, lineno)
         , m_str(str)
+        , m_fn(fn)
     {
         assert(type == AST_ARRAY || type == AST_CALL || type == AST_PROGRAM);
     }
 
-    ~AstContainer()
-    {
-    }
+    ~AstContainer();
 
     arg_t& operator[](size_t index)
     {
@@ -606,6 +671,16 @@ public:
         return m_str;
     }
 
+    const std::string& get_str() const
+    {
+        return m_str;
+    }
+
+    const fn_t& get_fn() const
+    {
+        return m_fn;
+    }
+
     std::string dump(bool q) const override;
 
     arg_t clone() const override;
@@ -616,12 +691,415 @@ protected:
     std::string m_str;
     std::vector<arg_t> m_children;
 
-    // For AST_CALL nodes: the resolved function is looked up by name once
-    // (lazily, on first eval) and cached here so repeated evaluations
-    // (e.g. inside for/while/foreach loops) skip the hash-map lookup.
-    // The function table is only populated during EGA_init(), so this
-    // cache is safe to keep for the node's whole lifetime.
-    mutable fn_t m_fn_cache;
+    // For AST_CALL nodes: the function bound by the parser, whose arity has
+    // already been checked. nullptr for a sequence "(...)".
+    fn_t m_fn;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// AstDict --- A dictionary keyed by integers or strings
+
+class AstDict : public AstBase
+{
+public:
+    struct Entry
+    {
+        size_t hash;
+        arg_t key; // nullptr if deleted
+        arg_t value;
+    };
+
+    AstDict(int lineno = 0)
+        : AstBase(AST_DICT, lineno)
+        , m_count(0)
+    {
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    // The entries in the order of insertion, including the deleted ones.
+    const std::vector<Entry>& entries() const
+    {
+        return m_entries;
+    }
+
+    // Returns nullptr if not found.
+    arg_t get(const arg_t& key) const;
+    void set(const arg_t& key, const arg_t& value);
+    bool del(const arg_t& key);
+
+    std::string dump(bool q) const override;
+    arg_t clone() const override;
+
+    arg_t eval() const override
+    {
+        return clone();
+    }
+
+protected:
+    std::vector<Entry> m_entries;
+    // The open addressing table (linear probing) of the indexes into
+    // m_entries. -1 is empty. A deleted entry stays as a tombstone.
+    std::vector<int> m_table;
+    size_t m_count;
+
+    size_t find_slot(const arg_t& key, size_t hash) const;
+    void rehash(size_t count);
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// AstIntArray --- A packed array of 64-bit integers
+
+class AstIntArray : public AstBase
+{
+public:
+    AstIntArray(int lineno = 0)
+        : AstBase(AST_INTARRAY, lineno)
+    {
+    }
+
+    AstIntArray(std::vector<long long> values, int lineno = 0)
+        : AstBase(AST_INTARRAY, lineno)
+        , m_values(std::move(values))
+    {
+    }
+
+    size_t size() const
+    {
+        return m_values.size();
+    }
+
+    std::vector<long long>& values()
+    {
+        return m_values;
+    }
+    const std::vector<long long>& values() const
+    {
+        return m_values;
+    }
+
+    std::string dump(bool q) const override;
+    arg_t clone() const override;
+
+    arg_t eval() const override
+    {
+        return clone();
+    }
+
+protected:
+    std::vector<long long> m_values;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// AstBuffer --- A byte buffer, or a slice of it
+//
+// The slices share the bytes of the parent. The bytes are copied when written
+// while shared.
+
+class AstBuffer : public AstBase
+{
+public:
+    typedef std::shared_ptr<std::string> bytes_t;
+
+    AstBuffer(std::string str = "", int lineno = 0)
+        : AstBase(AST_BUFFER, lineno)
+        , m_bytes(std::make_shared<std::string>(std::move(str)))
+        , m_offset(0)
+        , m_size(m_bytes->size())
+    {
+    }
+
+    AstBuffer(bytes_t bytes, size_t offset, size_t size, int lineno = 0)
+        : AstBase(AST_BUFFER, lineno)
+        , m_bytes(std::move(bytes))
+        , m_offset(offset)
+        , m_size(size)
+    {
+    }
+
+    const char *data() const
+    {
+        return m_bytes->data() + m_offset;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    std::string str() const
+    {
+        return std::string(data(), size());
+    }
+
+    // The size of the shared bytes, which are kept alive by every slice.
+    size_t shared_size() const
+    {
+        return m_bytes->size();
+    }
+
+    // Returns a slice without copying. The range must be checked.
+    arg_t slice(size_t offset, size_t size) const;
+
+    // Returns the bytes to write, copying them if shared.
+    char *writable();
+
+    std::string dump(bool q) const override;
+    arg_t clone() const override;
+
+    arg_t eval() const override
+    {
+        return clone();
+    }
+
+protected:
+    bytes_t m_bytes;
+    size_t m_offset;
+    size_t m_size;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// AstStrBuf --- A string builder
+
+class AstStrBuf : public AstBase
+{
+public:
+    AstStrBuf(std::string str = "", int lineno = 0)
+        : AstBase(AST_STRBUF, lineno)
+        , m_str(std::move(str))
+    {
+    }
+
+    std::string& get_str()
+    {
+        return m_str;
+    }
+    const std::string& get_str() const
+    {
+        return m_str;
+    }
+
+    std::string dump(bool q) const override;
+
+    arg_t clone() const override
+    {
+        return make_arg<AstStrBuf>(m_str, m_lineno);
+    }
+
+    arg_t eval() const override
+    {
+        return clone();
+    }
+
+protected:
+    std::string m_str;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// AstGen --- A generator
+//
+// The copies share the state, so they take the values of one sequence.
+
+struct EGA_GEN_STATE;
+
+class AstGen : public AstBase
+{
+public:
+    AstGen(std::shared_ptr<EGA_GEN_STATE> state, int lineno = 0)
+        : AstBase(AST_GENERATOR, lineno)
+        , m_state(std::move(state))
+    {
+    }
+
+    const std::shared_ptr<EGA_GEN_STATE>& get_state() const
+    {
+        return m_state;
+    }
+
+    std::string dump(bool q) const override;
+
+    arg_t clone() const override
+    {
+        return make_arg<AstGen>(m_state, m_lineno);
+    }
+
+    arg_t eval() const override
+    {
+        return clone();
+    }
+
+protected:
+    std::shared_ptr<EGA_GEN_STATE> m_state;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// EGA_PROGRAM --- A compiled program
+
+struct EGA_PROGRAM
+{
+    const std::string text;
+    const arg_t ast;
+
+    EGA_PROGRAM(const std::string& t, const arg_t& a) : text(t), ast(a)
+    {
+    }
+};
+typedef std::shared_ptr<const EGA_PROGRAM> program_t;
+
+// The input variables of a run.
+typedef std::vector<std::pair<std::string, arg_t> > bindings_t;
+
+// A column of the input variables of a batch. A column of AST_INT uses ints.
+// A column of AST_STR uses strs.
+struct EGA_COLUMN
+{
+    std::string name;
+    AstType type;
+    std::vector<long long> ints;
+    std::vector<std::string> strs;
+
+    EGA_COLUMN(const std::string& n, AstType t = AST_INT) : name(n), type(t)
+    {
+    }
+
+    size_t size() const
+    {
+        return (type == AST_INT) ? ints.size() : strs.size();
+    }
+};
+typedef std::vector<EGA_COLUMN> columns_t;
+
+//////////////////////////////////////////////////////////////////////////////
+// EGA_Context --- The state of an interpreter
+//
+// The functions, the variables, the caches and the settings belong to a
+// context. Each thread evaluates in its current context, which is the default
+// context unless another one is made current by EGA_Context::Scope. The
+// global functions work on the current context.
+//
+// A context must be used by one thread at a time, but the contexts on the
+// different threads run independently.
+
+struct EGA_CONTEXT_DATA;
+
+class EGA_Context
+{
+public:
+    EGA_Context();
+    ~EGA_Context();
+
+    // Makes a context current on this thread while the scope is alive.
+    class Scope
+    {
+    public:
+        explicit Scope(EGA_Context& context);
+        ~Scope();
+
+    protected:
+        EGA_Context *m_old;
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    static EGA_Context& current();
+    static EGA_Context& get_default();
+
+    bool init();
+    void uninit();
+
+    void set_print_fn(EGA_PRINT_FN fn);
+    void set_input_fn(EGA_INPUT_FN fn);
+    void set_max_depth(size_t depth);
+    void set_program_cache_size(size_t size);
+    void set_regex_cache_size(size_t size);
+
+    program_t compile(const char *text);
+    arg_t run(const program_t& program, const bindings_t& bindings = bindings_t());
+    args_t run_batch(const program_t& program, const columns_t& columns);
+
+    void set_var(const std::string& name, arg_t ast);
+    bool eval_text_ex(const char *text);
+
+    // These can be called from any thread.
+    bool stop();
+    bool is_stopping() const;
+
+    EGA_CONTEXT_DATA& data()
+    {
+        return *m_data;
+    }
+
+protected:
+    std::unique_ptr<EGA_CONTEXT_DATA> m_data;
+
+    EGA_Context(const EGA_Context&) = delete;
+    EGA_Context& operator=(const EGA_Context&) = delete;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// EGA_ContextPool --- The contexts to run the programs on many threads
+//
+// A compiled program is immutable, so the contexts can run it at the same
+// time. The contexts of a pool share the functions of the prototype and start
+// with a copy of its variables, so a context has only its own variables.
+// The pool can be used by many threads.
+
+class EGA_ContextPool
+{
+public:
+    // A context checked out of the pool. It is reset and returned to the
+    // pool at the end of the lifetime.
+    class Lease
+    {
+    public:
+        Lease(Lease&& other);
+        ~Lease();
+
+        EGA_Context& operator*() const
+        {
+            return *m_context;
+        }
+
+        EGA_Context *operator->() const
+        {
+            return m_context.get();
+        }
+
+    protected:
+        friend class EGA_ContextPool;
+
+        EGA_ContextPool *m_pool;
+        std::unique_ptr<EGA_Context> m_context;
+
+        Lease(EGA_ContextPool *pool, std::unique_ptr<EGA_Context> context);
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+    };
+
+    // The functions and the variables of prototype are taken at this time.
+    // At most max_idle contexts are kept in the pool.
+    explicit EGA_ContextPool(EGA_Context& prototype, size_t max_idle = 64);
+
+    program_t compile(const char *text);
+    Lease acquire();
+    arg_t run(const program_t& program, const bindings_t& bindings = bindings_t());
+
+    size_t idle_count() const;
+
+protected:
+    EGA_Context m_base;
+    std::vector<std::unique_ptr<EGA_Context> > m_idle;
+    size_t m_max_idle;
+    mutable std::mutex m_mutex;
+
+    void release(std::unique_ptr<EGA_Context> context);
+
+    EGA_ContextPool(const EGA_ContextPool&) = delete;
+    EGA_ContextPool& operator=(const EGA_ContextPool&) = delete;
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -630,6 +1108,19 @@ protected:
 bool EGA_init(void);
 void EGA_uninit(void);
 
+void EGA_set_max_depth(size_t depth);
+size_t EGA_get_max_depth(void);
+
+void EGA_set_thread_count(size_t count);
+size_t EGA_get_thread_count(void);
+
+void EGA_set_program_cache_size(size_t size);
+void EGA_set_regex_cache_size(size_t size);
+arg_t EGA_get_program(const std::string& text);
+program_t EGA_compile(const char *text);
+arg_t EGA_run(const program_t& program, const bindings_t& bindings = bindings_t());
+args_t EGA_run_batch(const program_t& program, const columns_t& columns);
+
 void EGA_set_var(const std::string& name, arg_t ast);
 bool EGA_eval_text_ex(const char *text);
 
@@ -641,6 +1132,8 @@ arg_t EGA_eval_arg(const arg_t& ast, bool do_check);
 int EGA_get_int(const arg_t& ast);
 std::string EGA_get_str(const arg_t& ast);
 std::shared_ptr<AstContainer> EGA_get_array(const arg_t& ast);
+std::shared_ptr<AstDict> EGA_get_dict(const arg_t& ast);
+std::shared_ptr<AstBuffer> EGA_get_buffer(const arg_t& ast);
 void EGA_print_logo(const char *filename = nullptr);
 bool EGA_file_security(std::string& filename);
 void EGA_hit_security(void);
@@ -0,0 +1,483 @@
+// intvec.hpp --- vectorized operations on the arrays of 64-bit integers
+// Copyright (C) 2026 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <climits>
+#include <cassert>
+#include "bigint.hpp"
+
+// On GCC and Clang for x86, the AVX2 versions are compiled and chosen at
+// run time. Otherwise the scalar versions are used.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define INTVEC_AVX2
+    #include <immintrin.h>
+    #define INTVEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum IntVecOp
+{
+    INTVEC_ADD,
+    INTVEC_SUB,
+    INTVEC_MUL,
+    INTVEC_AND,
+    INTVEC_OR,
+    INTVEC_XOR
+};
+
+// The maximum count of intvec_sum.
+#define INTVEC_SUM_MAX ((size_t)1 << 30)
+
+inline bool
+intvec_has_avx2(void)
+{
+#ifdef INTVEC_AVX2
+    static const bool s_has = __builtin_cpu_supports("avx2");
+    return s_has;
+#else
+    return false;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// scalar versions
+
+// Sums p[0], ..., p[n - 1] into hi * 2^32 + lo, without overflow.
+inline void
+intvec_sum_scalar(const long long *p, size_t n, long long& hi, long long& lo)
+{
+    assert(n <= INTVEC_SUM_MAX);
+    long long h = 0;
+    unsigned long long l = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h += p[i] >> 32;
+        l += (unsigned long long)p[i] & 0xFFFFFFFF;
+    }
+    hi = h;
+    lo = (long long)l;
+}
+
+inline long long
+intvec_min_scalar(const long long *p, size_t n)
+{
+    assert(n > 0);
+    long long ret = p[0];
+    for (size_t i = 1; i < n; ++i)
+        ret = (p[i] < ret) ? p[i] : ret;
+    return ret;
+}
+
+inline long long
+intvec_max_scalar(const long long *p, size_t n)
+{
+    assert(n > 0);
+    long long ret = p[0];
+    for (size_t i = 1; i < n; ++i)
+        ret = (p[i] > ret) ? p[i] : ret;
+    return ret;
+}
+
+inline size_t
+intvec_count_scalar(const long long *p, size_t n, long long value)
+{
+    size_t ret = 0;
+    for (size_t i = 0; i < n; ++i)
+        ret += (p[i] == value);
+    return ret;
+}
+
+// out[i] = a[i * a_step] op b[i * b_step], where the steps are 0 or 1.
+// Returns false if an item overflows. Then out is incomplete.
+inline bool
+intvec_apply_scalar(IntVecOp op, const long long *a, size_t a_step,
+                    const long long *b, size_t b_step, long long *out, size_t n)
+{
+    unsigned long long ovf = 0;
+    switch (op)
+    {
+    case INTVEC_ADD:
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned long long x = a[i * a_step], y = b[i * b_step];
+            unsigned long long s = x + y;
+            out[i] = (long long)s;
+            ovf |= (x ^ s) & (y ^ s);
+        }
+        break;
+    case INTVEC_SUB:
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned long long x = a[i * a_step], y = b[i * b_step];
+            unsigned long long s = x - y;
+            out[i] = (long long)s;
+            ovf |= (x ^ y) & (x ^ s);
+        }
+        break;
+    case INTVEC_MUL:
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (bigint_mul_overflow(a[i * a_step], b[i * b_step], out[i]))
+                return false;
+        }
+        break;
+    case INTVEC_AND:
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i * a_step] & b[i * b_step];
+        break;
+    case INTVEC_OR:
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i * a_step] | b[i * b_step];
+        break;
+    case INTVEC_XOR:
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i * a_step] ^ b[i * b_step];
+        break;
+    }
+    return (long long)ovf >= 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AVX2 versions
+
+#ifdef INTVEC_AVX2
+
+INTVEC_TARGET_AVX2 inline long long
+intvec_hsum_avx2(__m256i v)
+{
+    long long tmp[4];
+    _mm256_storeu_si256((__m256i *)tmp, v);
+    return tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+INTVEC_TARGET_AVX2 inline void
+intvec_sum_avx2(const long long *p, size_t n, long long& hi, long long& lo)
+{
+    assert(n <= INTVEC_SUM_MAX);
+    // AVX2 has no 64-bit arithmetic shift. Sum the unsigned high halves and
+    // subtract 2^32 for each negative item.
+    const __m256i mask = _mm256_set1_epi64x(0xFFFFFFFF);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i h = zero, l = zero, neg = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        h = _mm256_add_epi64(h, _mm256_srli_epi64(x, 32));
+        l = _mm256_add_epi64(l, _mm256_and_si256(x, mask));
+        neg = _mm256_add_epi64(neg, _mm256_cmpgt_epi64(zero, x));
+    }
+    long long h2, l2;
+    intvec_sum_scalar(p + i, n - i, h2, l2);
+    hi = intvec_hsum_avx2(h) + intvec_hsum_avx2(neg) * 0x100000000LL + h2;
+    lo = intvec_hsum_avx2(l) + l2;
+}
+
+INTVEC_TARGET_AVX2 inline long long
+intvec_min_avx2(const long long *p, size_t n)
+{
+    assert(n > 0);
+    __m256i m = _mm256_set1_epi64x(p[0]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(m, x));
+    }
+    long long tmp[4];
+    _mm256_storeu_si256((__m256i *)tmp, m);
+    long long ret = intvec_min_scalar(tmp, 4);
+    for (; i < n; ++i)
+        ret = (p[i] < ret) ? p[i] : ret;
+    return ret;
+}
+
+INTVEC_TARGET_AVX2 inline long long
+intvec_max_avx2(const long long *p, size_t n)
+{
+    assert(n > 0);
+    __m256i m = _mm256_set1_epi64x(p[0]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(x, m));
+    }
+    long long tmp[4];
+    _mm256_storeu_si256((__m256i *)tmp, m);
+    long long ret = intvec_max_scalar(tmp, 4);
+    for (; i < n; ++i)
+        ret = (p[i] > ret) ? p[i] : ret;
+    return ret;
+}
+
+INTVEC_TARGET_AVX2 inline size_t
+intvec_count_avx2(const long long *p, size_t n, long long value)
+{
+    const __m256i v = _mm256_set1_epi64x(value);
+    __m256i count = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        count = _mm256_sub_epi64(count, _mm256_cmpeq_epi64(x, v));
+    }
+    return size_t(intvec_hsum_avx2(count)) + intvec_count_scalar(p + i, n - i, value);
+}
+
+INTVEC_TARGET_AVX2 inline __m256i
+intvec_load_avx2(const long long *p, size_t step, size_t i)
+{
+    if (step)
+        return _mm256_loadu_si256((const __m256i *)(p + i));
+    return _mm256_set1_epi64x(*p);
+}
+
+INTVEC_TARGET_AVX2 inline bool
+intvec_apply_avx2(IntVecOp op, const long long *a, size_t a_step,
+                  const long long *b, size_t b_step, long long *out, size_t n)
+{
+    // AVX2 has no 64-bit multiplication.
+    if (op == INTVEC_MUL)
+        return intvec_apply_scalar(op, a, a_step, b, b_step, out, n);
+
+    __m256i ovf = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = intvec_load_avx2(a, a_step, i);
+        __m256i y = intvec_load_avx2(b, b_step, i);
+        __m256i s;
+        switch (op)
+        {
+        case INTVEC_ADD:
+            s = _mm256_add_epi64(x, y);
+            ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(x, s),
+                                                        _mm256_xor_si256(y, s)));
+            break;
+        case INTVEC_SUB:
+            s = _mm256_sub_epi64(x, y);
+            ovf = _mm256_or_si256(ovf, _mm256_and_si256(_mm256_xor_si256(x, y),
+                                                        _mm256_xor_si256(x, s)));
+            break;
+        case INTVEC_AND:
+            s = _mm256_and_si256(x, y);
+            break;
+        case INTVEC_OR:
+            s = _mm256_or_si256(x, y);
+            break;
+        default:
+            s = _mm256_xor_si256(x, y);
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), s);
+    }
+
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(ovf)) != 0)
+        return false;
+
+    return intvec_apply_scalar(op, a + i * a_step, a_step, b + i * b_step, b_step,
+                               out + i, n - i);
+}
+
+#endif  // def INTVEC_AVX2
+
+//////////////////////////////////////////////////////////////////////////////
+// dispatchers
+
+inline void
+intvec_sum(const long long *p, size_t n, long long& hi, long long& lo)
+{
+#ifdef INTVEC_AVX2
+    if (intvec_has_avx2())
+        return intvec_sum_avx2(p, n, hi, lo);
+#endif
+    intvec_sum_scalar(p, n, hi, lo);
+}
+
+inline long long
+intvec_min(const long long *p, size_t n)
+{
+#ifdef INTVEC_AVX2
+    if (intvec_has_avx2())
+        return intvec_min_avx2(p, n);
+#endif
+    return intvec_min_scalar(p, n);
+}
+
+inline long long
+intvec_max(const long long *p, size_t n)
+{
+#ifdef INTVEC_AVX2
+    if (intvec_has_avx2())
+        return intvec_max_avx2(p, n);
+#endif
+    return intvec_max_scalar(p, n);
+}
+
+inline size_t
+intvec_count(const long long *p, size_t n, long long value)
+{
+#ifdef INTVEC_AVX2
+    if (intvec_has_avx2())
+        return intvec_count_avx2(p, n, value);
+#endif
+    return intvec_count_scalar(p, n, value);
+}
+
+inline bool
+intvec_apply(IntVecOp op, const long long *a, size_t a_step,
+             const long long *b, size_t b_step, long long *out, size_t n)
+{
+#ifdef INTVEC_AVX2
+    if (intvec_has_avx2())
+        return intvec_apply_avx2(op, a, a_step, b, b_step, out, n);
+#endif
+    return intvec_apply_scalar(op, a, a_step, b, b_step, out, n);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// sorting
+
+// Sorts the 64-bit integer keys stably by LSD radix sort.
+inline void
+intvec_radix_sort(const std::vector<long long>& keys, bool desc,
+                  std::vector<size_t>& indexes)
+{
+    struct Item
+    {
+        unsigned long long key;
+        size_t index;
+    };
+
+    size_t size = keys.size();
+    if (size < 2)
+    {
+        indexes.assign(size, 0);
+        return;
+    }
+
+    std::vector<Item> items(size), buffer(size);
+    size_t counts[8][256] = { { 0 } };
+    for (size_t i = 0; i < size; ++i)
+    {
+        // Flip the sign bit so that the unsigned order is the signed order.
+        unsigned long long key = (unsigned long long)keys[i] ^ 0x8000000000000000ULL;
+        if (desc)
+            key = ~key;
+        items[i].key = key;
+        items[i].index = i;
+        for (int digit = 0; digit < 8; ++digit)
+            ++counts[digit][(key >> (digit * 8)) & 0xFF];
+    }
+
+    for (int digit = 0; digit < 8; ++digit)
+    {
+        size_t *count = counts[digit];
+        int shift = digit * 8;
+        if (count[(items[0].key >> shift) & 0xFF] == size)
+            continue; // All the same digit
+
+        size_t total = 0;
+        for (size_t k = 0; k < 256; ++k)
+        {
+            size_t n = count[k];
+            count[k] = total;
+            total += n;
+        }
+        for (auto& item : items)
+            buffer[count[(item.key >> shift) & 0xFF]++] = item;
+        items.swap(buffer);
+    }
+
+    indexes.resize(size);
+    for (size_t i = 0; i < size; ++i)
+        indexes[i] = items[i].index;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+inline void
+intvec_unittest(void)
+{
+    std::vector<long long> v;
+    unsigned long long seed = 1;
+    for (size_t i = 0; i < 1003; ++i)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        long long x = (long long)seed;
+        if (i % 3 == 0)
+            x >>= 40;
+        if (i == 500)
+            x = LLONG_MIN;
+        if (i == 501)
+            x = LLONG_MAX;
+        v.push_back(x);
+    }
+
+    for (size_t n = 0; n <= v.size(); n += (n < 40) ? 1 : 321)
+    {
+        const long long *p = v.data();
+
+        // hi * 2^32 + lo is the exact sum.
+        long long hi, lo;
+        intvec_sum(p, n, hi, lo);
+        BigInt sum;
+        for (size_t i = 0; i < n; ++i)
+            sum += BigInt(p[i]);
+        assert((BigInt(hi) * BigInt(0x100000000LL) + BigInt(lo)).compare(sum) == 0);
+
+        if (n > 0)
+        {
+            assert(intvec_min(p, n) == intvec_min_scalar(p, n));
+            assert(intvec_max(p, n) == intvec_max_scalar(p, n));
+        }
+        assert(intvec_count(p, n, p[n / 2]) == intvec_count_scalar(p, n, p[n / 2]));
+
+        std::vector<long long> out1(n + 1), out2(n + 1);
+        const IntVecOp ops[] = { INTVEC_AND, INTVEC_OR, INTVEC_XOR };
+        for (auto op : ops)
+        {
+            assert(intvec_apply(op, p, 1, p + 1, 1, out1.data(), n));
+            assert(intvec_apply_scalar(op, p, 1, p + 1, 1, out2.data(), n));
+            assert(out1 == out2);
+        }
+    }
+
+    // The overflow is detected.
+    const long long small[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    long long out[9];
+    long long big = LLONG_MAX - 4;
+    assert(intvec_apply(INTVEC_ADD, small, 1, small, 1, out, 9) && out[8] == 18);
+    assert(!intvec_apply(INTVEC_ADD, small, 1, &big, 0, out, 9));
+    assert(intvec_apply(INTVEC_ADD, small, 1, &big, 0, out, 4) && out[3] == LLONG_MAX);
+    big = LLONG_MIN + 4;
+    assert(!intvec_apply(INTVEC_SUB, &big, 0, small, 1, out, 9));
+    assert(intvec_apply(INTVEC_SUB, &big, 0, small, 1, out, 4) && out[3] == LLONG_MIN);
+    big = LLONG_MAX / 5;
+    assert(!intvec_apply(INTVEC_MUL, small, 1, &big, 0, out, 9));
+    assert(intvec_apply(INTVEC_MUL, small, 1, &big, 0, out, 5) && out[4] == big * 5);
+
+    // The sort is stable, also for no key and one key.
+    for (size_t n : { size_t(0), size_t(1), size_t(2), size_t(300) })
+    {
+        std::vector<long long> keys(v.begin(), v.begin() + n);
+        for (size_t i = 0; i < n; i += 7)
+            keys[i] = 42;
+        for (bool desc : { false, true })
+        {
+            std::vector<size_t> indexes, expected(n);
+            for (size_t i = 0; i < n; ++i)
+                expected[i] = i;
+            std::stable_sort(expected.begin(), expected.end(), [&](size_t i, size_t j) {
+                return desc ? keys[i] > keys[j] : keys[i] < keys[j];
+            });
+            intvec_radix_sort(keys, desc, indexes);
+            assert(indexes == expected);
+        }
+    }
+}
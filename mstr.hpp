@@ -7,6 +7,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <climits>
 #include <cassert>
 
 inline std::string
@@ -112,46 +113,289 @@ mstr_reverse(std::string& ret)
     }
 }
 
-inline std::string
-mstr_to_string(long value)
+// The size of the buffer for mstr_format_int.
+#define MSTR_INT_BUFSIZE 24
+
+// Writes the decimal text of value backward from end. Returns the first char.
+// Two digits per division by the table of the digit pairs.
+inline char *
+mstr_format_int(char *end, long long value)
 {
-    if (value == 0)
-        return "0";
+    static const char s_pairs[] =
+        "00010203040506070809" "10111213141516171819"
+        "20212223242526272829" "30313233343536373839"
+        "40414243444546474849" "50515253545556575859"
+        "60616263646566676869" "70717273747576777879"
+        "80818283848586878889" "90919293949596979899";
 
+    unsigned long long uvalue = value;
     if (value < 0)
+        uvalue = 0 - uvalue;
+
+    char *pch = end;
+    while (uvalue >= 100)
+    {
+        const char *pair = &s_pairs[(uvalue % 100) * 2];
+        uvalue /= 100;
+        *--pch = pair[1];
+        *--pch = pair[0];
+    }
+    if (uvalue >= 10)
+    {
+        const char *pair = &s_pairs[uvalue * 2];
+        *--pch = pair[1];
+        *--pch = pair[0];
+    }
+    else
     {
-        std::string ret = "-";
-        ret += mstr_to_string(-value);
-        return ret;
+        *--pch = char('0' + uvalue);
     }
 
-    unsigned long uvalue = value;
+    if (value < 0)
+        *--pch = '-';
+    return pch;
+}
 
-    std::string ret;
-    while (uvalue != 0)
+inline void
+mstr_append_int(std::string& str, long long value)
+{
+    char buf[MSTR_INT_BUFSIZE];
+    char *end = buf + MSTR_INT_BUFSIZE;
+    char *pch = mstr_format_int(end, value);
+    str.append(pch, end - pch);
+}
+
+inline std::string
+mstr_to_string(long long value)
+{
+    char buf[MSTR_INT_BUFSIZE];
+    char *end = buf + MSTR_INT_BUFSIZE;
+    char *pch = mstr_format_int(end, value);
+    return std::string(pch, end - pch);
+}
+
+// Parses the decimal digits. Returns false if it overflows long long.
+inline bool
+mstr_parse_int(const char *digits, size_t len, bool negative, long long& value)
+{
+    unsigned long long limit = negative ? (1ULL << 63) : (1ULL << 63) - 1;
+    unsigned long long uvalue = 0;
+    for (size_t i = 0; i < len; ++i)
     {
-        ret += (char)('0' + (uvalue % 10));
-        uvalue /= 10;
+        unsigned digit = unsigned(digits[i] - '0');
+        if (uvalue > (limit - digit) / 10)
+            return false;
+        uvalue = uvalue * 10 + digit;
     }
+    value = negative ? (long long)(0 - uvalue) : (long long)uvalue;
+    return true;
+}
 
-    mstr_reverse(ret);
-    return ret;
+// Finds needle in hay from start. Returns npos if not found.
+// A short needle is searched by memchr on its first byte (vectorized by the C
+// library) and memcmp. A long needle is searched by Boyer-Moore-Horspool.
+inline size_t
+mstr_find(const char *hay, size_t hay_len, const char *needle, size_t needle_len,
+          size_t start = 0)
+{
+    if (start > hay_len || needle_len > hay_len - start)
+        return std::string::npos;
+    if (needle_len == 0)
+        return start;
+
+    const char *p = hay + start;
+    const char *end = hay + hay_len;
+    const char first = needle[0];
+
+    if (needle_len < 16)
+    {
+        const char *last = end - needle_len;
+        while (p <= last)
+        {
+            p = static_cast<const char *>(std::memchr(p, first, last - p + 1));
+            if (!p)
+                break;
+            if (std::memcmp(p + 1, needle + 1, needle_len - 1) == 0)
+                return p - hay;
+            ++p;
+        }
+        return std::string::npos;
+    }
+
+    size_t skip[256];
+    for (size_t i = 0; i < 256; ++i)
+        skip[i] = needle_len;
+    for (size_t i = 0; i + 1 < needle_len; ++i)
+        skip[(unsigned char)needle[i]] = needle_len - 1 - i;
+
+    const unsigned char tail = (unsigned char)needle[needle_len - 1];
+    while (p + needle_len <= end)
+    {
+        unsigned char ch = (unsigned char)p[needle_len - 1];
+        if (ch == tail && p[0] == first &&
+            std::memcmp(p, needle, needle_len - 1) == 0)
+        {
+            return p - hay;
+        }
+        p += skip[ch];
+    }
+    return std::string::npos;
+}
+
+inline size_t
+mstr_find(const std::string& str, const std::string& needle, size_t start = 0)
+{
+    return mstr_find(str.data(), str.size(), needle.data(), needle.size(), start);
+}
+
+// Counts sep in str, not overlapping.
+inline size_t
+mstr_count(const char *str, size_t len, const char *sep, size_t sep_len)
+{
+    if (sep_len == 0)
+        return 0;
+
+    size_t count = 0;
+    for (size_t i = mstr_find(str, len, sep, sep_len); i != std::string::npos;
+         i = mstr_find(str, len, sep, sep_len, i + sep_len))
+    {
+        ++count;
+    }
+    return count;
+}
+
+// Splits str by sep in one pass. Calls fn(offset, length) for each piece.
+// An empty sep splits str into the bytes. Returns the number of the pieces.
+template <typename T_FN>
+inline size_t
+mstr_split_each(const char *str, size_t len, const char *sep, size_t sep_len, T_FN fn)
+{
+    if (sep_len == 0)
+    {
+        for (size_t i = 0; i < len; ++i)
+            fn(i, size_t(1));
+        return len;
+    }
+
+    size_t count = 0, k = 0;
+    for (size_t i = mstr_find(str, len, sep, sep_len); i != std::string::npos;
+         i = mstr_find(str, len, sep, sep_len, k))
+    {
+        fn(k, i - k);
+        ++count;
+        k = i + sep_len;
+    }
+    fn(k, len - k);
+    return count + 1;
+}
+
+// Splits str into the lines in one pass. A line ends with "\n" or "\r\n",
+// which is not included. Calls fn(offset, length) for each line. The newline
+// at the end of str doesn't make an empty line. Returns the number of the lines.
+template <typename T_FN>
+inline size_t
+mstr_lines_each(const char *str, size_t len, T_FN fn)
+{
+    size_t count = 0, k = 0;
+    while (k < len)
+    {
+        const char *nl = (const char *)std::memchr(str + k, '\n', len - k);
+        size_t end = nl ? size_t(nl - str) : len;
+        size_t line_end = end;
+        if (line_end > k && str[line_end - 1] == '\r')
+            --line_end;
+        fn(k, line_end - k);
+        ++count;
+        k = end + 1;
+    }
+    return count;
+}
+
+// Replaces all from in str with to, into ret in one pass.
+// Returns the number of the replacements.
+inline size_t
+mstr_replace_all(const std::string& str, const std::string& from, const std::string& to,
+                 std::string& ret)
+{
+    if (from.empty())
+    {
+        // Inserts to before each character and at the end.
+        ret.clear();
+        if (to.empty())
+        {
+            ret = str;
+            return 0;
+        }
+        ret.reserve(str.size() + (str.size() + 1) * to.size());
+        for (auto ch : str)
+        {
+            ret += to;
+            ret += ch;
+        }
+        ret += to;
+        return str.size() + 1;
+    }
+
+    size_t count = 0;
+    for (size_t i = mstr_find(str, from); i != std::string::npos;
+         i = mstr_find(str, from, i + from.size()))
+    {
+        ++count;
+    }
+
+    ret.resize(str.size() - count * from.size() + count * to.size());
+    if (count == 0)
+    {
+        ret = str;
+        return 0;
+    }
+
+    char *out = &ret[0];
+    size_t k = 0;
+    for (size_t i = mstr_find(str, from); i != std::string::npos;
+         i = mstr_find(str, from, k))
+    {
+        std::memcpy(out, str.data() + k, i - k);
+        out += i - k;
+        std::memcpy(out, to.data(), to.size());
+        out += to.size();
+        k = i + from.size();
+    }
+    std::memcpy(out, str.data() + k, str.size() - k);
+    return count;
 }
 
 inline bool
 mstr_replace_all(std::string& str, const std::string& from, const std::string& to)
 {
-    bool ret = false;
-    size_t i = 0;
-    for (;;) {
-        i = str.find(from, i);
-        if (i == std::string::npos)
-            break;
-        ret = true;
-        str.replace(i, from.size(), to);
-        i += to.size();
+    if (from.empty() || to.size() > from.size())
+    {
+        std::string ret;
+        if (!mstr_replace_all(str, from, to, ret))
+            return false;
+        str.swap(ret);
+        return true;
     }
-    return ret;
+
+    // The output never overtakes the input. Compact it in place.
+    size_t i = mstr_find(str, from);
+    if (i == std::string::npos)
+        return false;
+
+    char *data = &str[0];
+    size_t k = 0, out = 0;
+    for (; i != std::string::npos; i = mstr_find(str, from, k))
+    {
+        std::memmove(data + out, data + k, i - k);
+        out += i - k;
+        std::memcpy(data + out, to.data(), to.size());
+        out += to.size();
+        k = i + from.size();
+    }
+    std::memmove(data + out, data + k, str.size() - k);
+    out += str.size() - k;
+    str.resize(out);
+    return true;
 }
 
 inline void
@@ -182,15 +426,69 @@ mstr_unittest(void)
     str = mstr_join(list, "|");
     assert(str == "A|B|C");
 
+    assert(mstr_count("a::b::", 6, "::", 2) == 2);
+    assert(mstr_count("aaa", 3, "aa", 2) == 1);
+
+    std::string pieces, text;
+    auto add_piece = [&](size_t offset, size_t length) {
+        pieces += '[';
+        pieces += text.substr(offset, length);
+        pieces += ']';
+    };
+    text = "a::b::";
+    assert(mstr_split_each(text.data(), text.size(), "::", 2, add_piece) == 3);
+    assert(pieces == "[a][b][]");
+
+    pieces.clear();
+    text = "l1\r\n\nl3\n";
+    assert(mstr_lines_each(text.data(), text.size(), add_piece) == 3);
+    assert(pieces == "[l1][][l3]");
+
+    pieces.clear();
+    text = "l1\nl2";
+    assert(mstr_lines_each(text.data(), text.size(), add_piece) == 2);
+    assert(pieces == "[l1][l2]");
+
     mstr_reverse(str);
     assert(str == "C|B|A");
 
     str = mstr_to_string(0);
     assert(str == "0");
+    assert(mstr_to_string(7) == "7");
+    assert(mstr_to_string(-10) == "-10");
+    assert(mstr_to_string(12345) == "12345");
+    assert(mstr_to_string(LLONG_MAX) == "9223372036854775807");
+    assert(mstr_to_string(LLONG_MIN) == "-9223372036854775808");
+
+    long long ll = 0;
+    assert(mstr_parse_int("9223372036854775807", 19, false, ll) && ll == LLONG_MAX);
+    assert(mstr_parse_int("9223372036854775808", 19, true, ll) && ll == LLONG_MIN);
+    assert(!mstr_parse_int("9223372036854775808", 19, false, ll));
+    assert(mstr_parse_int("0042", 4, true, ll) && ll == -42);
 
     str = mstr_to_string(-12);
     assert(str == "-12");
 
     str = mstr_to_string(999);
     assert(str == "999");
+
+    str = mstr_to_string(-9223372036854775807LL - 1);
+    assert(str == "-9223372036854775808");
+
+    str = "abcabcabc";
+    assert(mstr_find(str, "cab") == 2);
+    assert(mstr_find(str, "cab", 3) == 5);
+    assert(mstr_find(str, "cax") == std::string::npos);
+    assert(mstr_find(str, "") == 0);
+    assert(mstr_find("xxxxxxxxxxxxxxxxxxxxxxxx0123456789ABCDEFGHxx", "0123456789ABCDEFGH") == 24);
+    assert(mstr_find("0123456789ABCDEFG", "0123456789ABCDEFGH") == std::string::npos);
+
+    mstr_replace_all(str, "b", "");
+    assert(str == "acacac");
+    mstr_replace_all(str, "c", "<C>");
+    assert(str == "a<C>a<C>a<C>");
+    mstr_replace_all(str, "<C>", "c");
+    assert(str == "acacac");
+    mstr_replace_all(str, "", "-");
+    assert(str == "-a-c-a-c-a-c-");
 }
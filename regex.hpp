@@ -0,0 +1,1292 @@
+// regex.hpp --- regular expressions by Thompson NFA and lazy DFA
+// Copyright (C) 2026 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+
+// Syntax:
+//   x          the byte x. A non-ASCII character is matched by its bytes.
+//   .          any character except a newline
+//   [abc]      a byte of the set. Ranges like [a-z] and the negation [^abc].
+//   \d \w \s   a digit, a word character, a space. \D \W \S are the negations.
+//   \b \B      a word boundary and not a word boundary
+//   \t \n \r \f \v \xHH \\ \. etc.  the escaped characters
+//   ^ $        the start and the end of the string
+//   (re)       a capture group. (?:re) is a group without capture.
+//   re1|re2    either
+//   re* re+ re? re{m} re{m,} re{m,n}  the repetitions. Append ? to be lazy.
+//
+// `.` and the negations like [^abc] and \D match a whole UTF-8 character.
+//
+// The matching takes linear time of the length of the text. No backtracking.
+// The program is run by the Pike VM (a Thompson NFA with the captures). A lazy
+// DFA decides first whether the text matches, without the captures.
+
+class RegexError : public std::runtime_error
+{
+public:
+    RegexError(const std::string& what) : std::runtime_error(what)
+    {
+    }
+};
+
+// The limits for the user-supplied patterns.
+#define REGEX_MAX_NESTING 1000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_PROGRAM 100000
+#define REGEX_MAX_DFA_STATES 2000
+
+enum RegexOp
+{
+    RX_BYTE,    // x: the byte
+    RX_CLASS,   // x: the index of the class
+    RX_ANY,     // any byte except a newline
+    RX_CONT,    // a trail byte of UTF-8
+    RX_MATCH,
+    RX_JMP,     // x: the target
+    RX_SPLIT,   // x: the preferred target, y: the other target
+    RX_SAVE,    // x: the slot of the captures
+    RX_BOL,
+    RX_EOL,
+    RX_WORDB,
+    RX_NWORDB
+};
+
+struct RegexInst
+{
+    RegexOp op;
+    int x;
+    int y;
+};
+
+struct RegexClass
+{
+    uint64_t bits[4];
+
+    bool has(unsigned char c) const
+    {
+        return (bits[c >> 6] >> (c & 63)) & 1;
+    }
+    void add(unsigned char c)
+    {
+        bits[c >> 6] |= uint64_t(1) << (c & 63);
+    }
+};
+
+inline bool
+regex_is_word(unsigned char c)
+{
+    return ('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') ||
+           ('a' <= c && c <= 'z') || c == '_';
+}
+
+class Regex
+{
+public:
+    explicit Regex(const std::string& pattern)
+    {
+        Parser parser(pattern, m_classes);
+        std::unique_ptr<Node> node = parser.parse();
+        m_groups = parser.groups();
+
+        emit(RX_SAVE, 0);
+        compile(node.get());
+        emit(RX_SAVE, 1);
+        emit(RX_MATCH);
+
+        m_dfa_ok = true;
+        for (auto& inst : m_prog)
+        {
+            if (inst.op == RX_WORDB || inst.op == RX_NWORDB)
+                m_dfa_ok = false;
+        }
+        init_first();
+    }
+
+    // The count of the capture groups.
+    size_t groups() const
+    {
+        return m_groups;
+    }
+
+    // Whether the whole text matches.
+    bool match(const char *text, size_t len) const
+    {
+        if (m_dfa_ok)
+            return dfa_match(m_anchored, text, len, 0, true);
+        std::vector<size_t> caps;
+        return pike(text, len, 0, true, caps);
+    }
+
+    // Finds the leftmost match at start or later. caps gets the 2 * (groups + 1)
+    // offsets of the match and the groups. An unmatched group is npos.
+    bool search(const char *text, size_t len, size_t start, std::vector<size_t>& caps) const
+    {
+        if (start > len)
+            return false;
+        if (m_dfa_ok && !dfa_match(m_unanchored, text, len, start, false))
+            return false;
+        return pike(text, len, start, false, caps);
+    }
+
+protected:
+    //////////////////////////////////////////////////////////////////////////
+    // parsing
+
+    struct Node
+    {
+        enum Kind { EMPTY, BYTE, CLASS, ANY, CAT, ALT, REPEAT, GROUP, BOL, EOL, WORDB, NWORDB };
+        Kind kind;
+        int value = 0;          // BYTE: the byte, CLASS: the index, GROUP: the index
+        bool multibyte = false; // CLASS: matches a whole UTF-8 character
+        int min = 0, max = 0;   // REPEAT: max < 0 for no limit
+        bool greedy = true;
+        std::vector<std::unique_ptr<Node>> kids;
+
+        Node(Kind k, int v = 0) : kind(k), value(v)
+        {
+        }
+    };
+
+    class Parser
+    {
+    public:
+        Parser(const std::string& pattern, std::vector<RegexClass>& classes)
+            : m_pat(pattern), m_pos(0), m_depth(0), m_groups(0), m_classes(classes)
+        {
+        }
+
+        std::unique_ptr<Node> parse()
+        {
+            std::unique_ptr<Node> node = parse_alt();
+            if (m_pos < m_pat.size())
+                throw RegexError("unmatched ')'");
+            return node;
+        }
+
+        size_t groups() const
+        {
+            return m_groups;
+        }
+
+    protected:
+        const std::string& m_pat;
+        size_t m_pos;
+        int m_depth;
+        size_t m_groups;
+        std::vector<RegexClass>& m_classes;
+
+        bool at_end() const
+        {
+            return m_pos >= m_pat.size();
+        }
+        char peek() const
+        {
+            return m_pat[m_pos];
+        }
+
+        std::unique_ptr<Node> parse_alt()
+        {
+            if (++m_depth > REGEX_MAX_NESTING)
+                throw RegexError("nesting too deep");
+
+            std::unique_ptr<Node> node = parse_cat();
+            if (!at_end() && peek() == '|')
+            {
+                std::unique_ptr<Node> alt(new Node(Node::ALT));
+                alt->kids.push_back(std::move(node));
+                while (!at_end() && peek() == '|')
+                {
+                    ++m_pos;
+                    alt->kids.push_back(parse_cat());
+                }
+                node = std::move(alt);
+            }
+
+            --m_depth;
+            return node;
+        }
+
+        std::unique_ptr<Node> parse_cat()
+        {
+            std::unique_ptr<Node> cat(new Node(Node::CAT));
+            while (!at_end() && peek() != '|' && peek() != ')')
+                cat->kids.push_back(parse_repeat());
+            if (cat->kids.size() == 1)
+                return std::move(cat->kids[0]);
+            return cat;
+        }
+
+        bool parse_number(int& value)
+        {
+            size_t start = m_pos;
+            value = 0;
+            while (!at_end() && '0' <= peek() && peek() <= '9')
+            {
+                value = value * 10 + (peek() - '0');
+                if (value > REGEX_MAX_REPEAT)
+                    throw RegexError("repetition count too large");
+                ++m_pos;
+            }
+            return m_pos > start;
+        }
+
+        // Parses {m}, {m,} or {m,n}. Otherwise it's not a repetition.
+        bool parse_braces(int& min, int& max)
+        {
+            size_t save = m_pos;
+            ++m_pos;
+            if (!parse_number(min))
+            {
+                m_pos = save;
+                return false;
+            }
+            max = min;
+            if (!at_end() && peek() == ',')
+            {
+                ++m_pos;
+                if (!parse_number(max))
+                    max = -1;
+            }
+            if (at_end() || peek() != '}')
+            {
+                m_pos = save;
+                return false;
+            }
+            ++m_pos;
+            if (max >= 0 && max < min)
+                throw RegexError("invalid repetition count");
+            return true;
+        }
+
+        std::unique_ptr<Node> parse_repeat()
+        {
+            std::unique_ptr<Node> atom = parse_atom();
+            bool repeated = false;
+            while (!at_end())
+            {
+                int min, max;
+                char ch = peek();
+                if (ch == '*')
+                {
+                    min = 0;
+                    max = -1;
+                    ++m_pos;
+                }
+                else if (ch == '+')
+                {
+                    min = 1;
+                    max = -1;
+                    ++m_pos;
+                }
+                else if (ch == '?')
+                {
+                    min = 0;
+                    max = 1;
+                    ++m_pos;
+                }
+                else if (ch != '{' || !parse_braces(min, max))
+                {
+                    break;
+                }
+
+                switch (atom->kind)
+                {
+                case Node::EMPTY: case Node::BOL: case Node::EOL:
+                case Node::WORDB: case Node::NWORDB:
+                    throw RegexError("nothing to repeat");
+                default:
+                    if (repeated)
+                        throw RegexError("nothing to repeat");
+                    break;
+                }
+                repeated = true;
+
+                std::unique_ptr<Node> node(new Node(Node::REPEAT));
+                node->min = min;
+                node->max = max;
+                if (!at_end() && peek() == '?')
+                {
+                    node->greedy = false;
+                    ++m_pos;
+                }
+                node->kids.push_back(std::move(atom));
+                atom = std::move(node);
+            }
+            return atom;
+        }
+
+        int new_class()
+        {
+            RegexClass cls;
+            std::memset(&cls, 0, sizeof(cls));
+            m_classes.push_back(cls);
+            return int(m_classes.size() - 1);
+        }
+
+        // Adds the set of \d, \w or \s. Returns false for the other letters.
+        static bool add_escape_class(RegexClass& cls, char ch)
+        {
+            switch (ch)
+            {
+            case 'd':
+                for (int c = '0'; c <= '9'; ++c)
+                    cls.add((unsigned char)c);
+                return true;
+            case 'w':
+                for (int c = 0; c < 128; ++c)
+                {
+                    if (regex_is_word((unsigned char)c))
+                        cls.add((unsigned char)c);
+                }
+                return true;
+            case 's':
+                for (const char *pch = " \t\n\r\f\v"; *pch; ++pch)
+                    cls.add((unsigned char)*pch);
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        int hex_digit(char ch)
+        {
+            if ('0' <= ch && ch <= '9')
+                return ch - '0';
+            if ('A' <= ch && ch <= 'F')
+                return ch - 'A' + 10;
+            if ('a' <= ch && ch <= 'f')
+                return ch - 'a' + 10;
+            throw RegexError("invalid escape");
+        }
+
+        // Parses the escaped character after the backslash.
+        unsigned char parse_escaped_char()
+        {
+            if (at_end())
+                throw RegexError("trailing backslash");
+            char ch = m_pat[m_pos++];
+            switch (ch)
+            {
+            case 't': return '\t';
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 'f': return '\f';
+            case 'v': return '\v';
+            case '0': return 0;
+            case 'x':
+                {
+                    if (m_pos + 2 > m_pat.size())
+                        throw RegexError("invalid escape");
+                    int hi = hex_digit(m_pat[m_pos]), lo = hex_digit(m_pat[m_pos + 1]);
+                    m_pos += 2;
+                    return (unsigned char)(hi * 16 + lo);
+                }
+            default:
+                if (('A' <= ch && ch <= 'Z') || ('a' <= ch && ch <= 'z') || ('0' <= ch && ch <= '9'))
+                    throw RegexError("invalid escape");
+                return (unsigned char)ch;
+            }
+        }
+
+        std::unique_ptr<Node> make_negated(int index)
+        {
+            RegexClass& cls = m_classes[index];
+            for (int i = 0; i < 4; ++i)
+                cls.bits[i] = ~cls.bits[i];
+            // A trail byte is consumed after a lead byte.
+            for (int c = 0x80; c < 0xC0; ++c)
+                cls.bits[c >> 6] &= ~(uint64_t(1) << (c & 63));
+            std::unique_ptr<Node> node(new Node(Node::CLASS, index));
+            node->multibyte = true;
+            return node;
+        }
+
+        std::unique_ptr<Node> parse_class()
+        {
+            ++m_pos;
+            bool negated = false;
+            if (!at_end() && peek() == '^')
+            {
+                negated = true;
+                ++m_pos;
+            }
+
+            int index = new_class();
+            bool first = true;
+            for (;;)
+            {
+                if (at_end())
+                    throw RegexError("missing ']'");
+                char ch = peek();
+                if (ch == ']' && !first)
+                {
+                    ++m_pos;
+                    break;
+                }
+                first = false;
+
+                unsigned char lo;
+                ++m_pos;
+                if (ch == '\\')
+                {
+                    if (!at_end() && add_escape_class(m_classes[index], peek()))
+                    {
+                        ++m_pos;
+                        continue;
+                    }
+                    if (!at_end() && (peek() == 'D' || peek() == 'W' || peek() == 'S'))
+                        throw RegexError("negated escape in a class");
+                    lo = parse_escaped_char();
+                }
+                else
+                {
+                    lo = (unsigned char)ch;
+                }
+
+                unsigned char hi = lo;
+                if (m_pos + 1 < m_pat.size() && peek() == '-' && m_pat[m_pos + 1] != ']')
+                {
+                    ++m_pos;
+                    char ch2 = m_pat[m_pos++];
+                    hi = (ch2 == '\\') ? parse_escaped_char() : (unsigned char)ch2;
+                    if (hi < lo)
+                        throw RegexError("invalid range");
+                }
+                for (int c = lo; c <= hi; ++c)
+                    m_classes[index].add((unsigned char)c);
+            }
+
+            if (negated)
+                return make_negated(index);
+            return std::unique_ptr<Node>(new Node(Node::CLASS, index));
+        }
+
+        std::unique_ptr<Node> parse_atom()
+        {
+            char ch = peek();
+            switch (ch)
+            {
+            case '(':
+                {
+                    ++m_pos;
+                    int group = -1;
+                    if (m_pat.compare(m_pos, 2, "?:") == 0)
+                        m_pos += 2;
+                    else
+                        group = int(++m_groups);
+
+                    std::unique_ptr<Node> node = parse_alt();
+                    if (at_end() || peek() != ')')
+                        throw RegexError("missing ')'");
+                    ++m_pos;
+
+                    if (group < 0)
+                        return node;
+                    std::unique_ptr<Node> grp(new Node(Node::GROUP, group));
+                    grp->kids.push_back(std::move(node));
+                    return grp;
+                }
+            case '[':
+                return parse_class();
+            case '.':
+                {
+                    ++m_pos;
+                    std::unique_ptr<Node> node(new Node(Node::ANY));
+                    node->multibyte = true;
+                    return node;
+                }
+            case '^':
+                ++m_pos;
+                return std::unique_ptr<Node>(new Node(Node::BOL));
+            case '$':
+                ++m_pos;
+                return std::unique_ptr<Node>(new Node(Node::EOL));
+            case '*': case '+': case '?':
+                throw RegexError("nothing to repeat");
+            case '\\':
+                {
+                    ++m_pos;
+                    if (at_end())
+                        throw RegexError("trailing backslash");
+                    char esc = peek();
+                    if (esc == 'b' || esc == 'B')
+                    {
+                        ++m_pos;
+                        return std::unique_ptr<Node>(new Node(esc == 'b' ? Node::WORDB : Node::NWORDB));
+                    }
+                    if (esc == 'd' || esc == 'w' || esc == 's' ||
+                        esc == 'D' || esc == 'W' || esc == 'S')
+                    {
+                        ++m_pos;
+                        int index = new_class();
+                        add_escape_class(m_classes[index], char(esc | 0x20));
+                        if (esc == 'D' || esc == 'W' || esc == 'S')
+                            return make_negated(index);
+                        return std::unique_ptr<Node>(new Node(Node::CLASS, index));
+                    }
+                    return std::unique_ptr<Node>(new Node(Node::BYTE, parse_escaped_char()));
+                }
+            default:
+                ++m_pos;
+                return std::unique_ptr<Node>(new Node(Node::BYTE, (unsigned char)ch));
+            }
+        }
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // compiling
+
+    std::vector<RegexInst> m_prog;
+    std::vector<RegexClass> m_classes;
+    size_t m_groups;
+    bool m_dfa_ok;
+    RegexClass m_first;     // the bytes that can start a match
+    bool m_first_ok;        // whether m_first is valid
+
+    int emit(RegexOp op, int x = 0, int y = 0)
+    {
+        if (m_prog.size() >= REGEX_MAX_PROGRAM)
+            throw RegexError("pattern too large");
+        RegexInst inst = { op, x, y };
+        m_prog.push_back(inst);
+        return int(m_prog.size() - 1);
+    }
+
+    int pc() const
+    {
+        return int(m_prog.size());
+    }
+
+    // Consumes the trail bytes of UTF-8 after a multibyte atom.
+    void emit_trail()
+    {
+        int split = emit(RX_SPLIT);
+        emit(RX_CONT);
+        emit(RX_JMP, split);
+        m_prog[split].x = split + 1;
+        m_prog[split].y = pc();
+    }
+
+    // Emits the loop of re* for a body that can't match empty. The body is
+    // compiled by compile_body.
+    template <typename T_BODY>
+    void emit_star(bool greedy, T_BODY compile_body)
+    {
+        int split = emit(RX_SPLIT);
+        compile_body();
+        emit(RX_JMP, split);
+        m_prog[split].x = greedy ? split + 1 : pc();
+        m_prog[split].y = greedy ? pc() : split + 1;
+    }
+
+    // Emits the loop of re+ as L: re; SPLIT L, next. The body is compiled by
+    // compile_body. The loop goes back after the body, not before it, so a
+    // body that matched empty doesn't die at a visited SPLIT and leave the
+    // match to a lower alternative.
+    template <typename T_BODY>
+    void emit_plus(bool greedy, T_BODY compile_body)
+    {
+        int loop = pc();
+        compile_body();
+        int split = emit(RX_SPLIT);
+        m_prog[split].x = greedy ? loop : split + 1;
+        m_prog[split].y = greedy ? split + 1 : loop;
+    }
+
+    // Emits re?. The body is compiled by compile_body.
+    template <typename T_BODY>
+    void emit_quest(bool greedy, T_BODY compile_body)
+    {
+        int split = emit(RX_SPLIT);
+        compile_body();
+        m_prog[split].x = greedy ? split + 1 : pc();
+        m_prog[split].y = greedy ? pc() : split + 1;
+    }
+
+    // Whether the node can match an empty string.
+    static bool nullable(const Node *node)
+    {
+        switch (node->kind)
+        {
+        case Node::BYTE:
+        case Node::CLASS:
+        case Node::ANY:
+            return false;
+        case Node::CAT:
+            for (auto& kid : node->kids)
+            {
+                if (!nullable(kid.get()))
+                    return false;
+            }
+            return true;
+        case Node::ALT:
+            for (auto& kid : node->kids)
+            {
+                if (nullable(kid.get()))
+                    return true;
+            }
+            return false;
+        case Node::REPEAT:
+            return node->min == 0 || nullable(node->kids[0].get());
+        case Node::GROUP:
+            return nullable(node->kids[0].get());
+        default:
+            // EMPTY and the assertions
+            return true;
+        }
+    }
+
+    void compile(const Node *node)
+    {
+        switch (node->kind)
+        {
+        case Node::EMPTY:
+            break;
+        case Node::BYTE:
+            emit(RX_BYTE, node->value);
+            break;
+        case Node::CLASS:
+            emit(RX_CLASS, node->value);
+            if (node->multibyte)
+                emit_trail();
+            break;
+        case Node::ANY:
+            emit(RX_ANY);
+            emit_trail();
+            break;
+        case Node::CAT:
+            for (auto& kid : node->kids)
+                compile(kid.get());
+            break;
+        case Node::ALT:
+            {
+                // SPLIT L1, next; L1: re1; JMP end; next: SPLIT L2, ...
+                std::vector<int> jumps;
+                for (size_t i = 0; i < node->kids.size(); ++i)
+                {
+                    if (i + 1 < node->kids.size())
+                    {
+                        int split = emit(RX_SPLIT);
+                        compile(node->kids[i].get());
+                        jumps.push_back(emit(RX_JMP));
+                        m_prog[split].x = split + 1;
+                        m_prog[split].y = pc();
+                    }
+                    else
+                    {
+                        compile(node->kids[i].get());
+                    }
+                }
+                for (int jump : jumps)
+                    m_prog[jump].x = pc();
+            }
+            break;
+        case Node::REPEAT:
+            {
+                const Node *kid = node->kids[0].get();
+                if (node->max < 0)
+                {
+                    // re{n,} is re{n-1} re+. re* is (?:re+)? if re can match
+                    // empty, as RE2 and Go do, to keep the priority.
+                    for (int i = 1; i < node->min; ++i)
+                        compile(kid);
+                    bool greedy = node->greedy;
+                    if (node->min > 0)
+                        emit_plus(greedy, [&]() { compile(kid); });
+                    else if (nullable(kid))
+                        emit_quest(greedy, [&]() { emit_plus(greedy, [&]() { compile(kid); }); });
+                    else
+                        emit_star(greedy, [&]() { compile(kid); });
+                }
+                else
+                {
+                    for (int i = 0; i < node->min; ++i)
+                        compile(kid);
+
+                    // re{2,4} is re re (re (re)?)?. The nested quests are flat.
+                    std::vector<int> splits;
+                    for (int i = node->min; i < node->max; ++i)
+                    {
+                        splits.push_back(emit(RX_SPLIT));
+                        compile(kid);
+                    }
+                    for (int split : splits)
+                    {
+                        m_prog[split].x = node->greedy ? split + 1 : pc();
+                        m_prog[split].y = node->greedy ? pc() : split + 1;
+                    }
+                }
+            }
+            break;
+        case Node::GROUP:
+            emit(RX_SAVE, node->value * 2);
+            compile(node->kids[0].get());
+            emit(RX_SAVE, node->value * 2 + 1);
+            break;
+        case Node::BOL:
+            emit(RX_BOL);
+            break;
+        case Node::EOL:
+            emit(RX_EOL);
+            break;
+        case Node::WORDB:
+            emit(RX_WORDB);
+            break;
+        case Node::NWORDB:
+            emit(RX_NWORDB);
+            break;
+        }
+    }
+
+    bool step(const RegexInst& inst, unsigned char c) const
+    {
+        switch (inst.op)
+        {
+        case RX_BYTE:
+            return c == inst.x;
+        case RX_CLASS:
+            return m_classes[inst.x].has(c);
+        case RX_ANY:
+            return c != '\n';
+        case RX_CONT:
+            return (c & 0xC0) == 0x80;
+        default:
+            return false;
+        }
+    }
+
+    static bool is_consuming(RegexOp op)
+    {
+        return op == RX_BYTE || op == RX_CLASS || op == RX_ANY || op == RX_CONT;
+    }
+
+    // Computes the bytes that can start a match, to skip the text quickly.
+    void init_first()
+    {
+        std::memset(&m_first, 0, sizeof(m_first));
+        m_first_ok = true;
+
+        std::vector<char> seen(m_prog.size());
+        std::vector<int> stack(1, 0);
+        while (stack.size())
+        {
+            int pc = stack.back();
+            stack.pop_back();
+            if (seen[pc])
+                continue;
+            seen[pc] = 1;
+
+            const RegexInst& inst = m_prog[pc];
+            switch (inst.op)
+            {
+            case RX_JMP:
+                stack.push_back(inst.x);
+                break;
+            case RX_SPLIT:
+                stack.push_back(inst.y);
+                stack.push_back(inst.x);
+                break;
+            case RX_SAVE:
+                stack.push_back(pc + 1);
+                break;
+            case RX_BYTE: case RX_CLASS: case RX_ANY: case RX_CONT:
+                for (int c = 0; c < 256; ++c)
+                {
+                    if (step(inst, (unsigned char)c))
+                        m_first.add((unsigned char)c);
+                }
+                break;
+            default:
+                // An empty match or an assertion
+                m_first_ok = false;
+                return;
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Pike VM
+
+    // The threads in the order of the priority. The captures are by pc.
+    struct ThreadList
+    {
+        std::vector<int> dense;
+        std::vector<int> sparse;
+        std::vector<size_t> caps;
+
+        void init(size_t size, size_t ncap)
+        {
+            dense.reserve(size);
+            sparse.assign(size, 0);
+            caps.assign(size * ncap, std::string::npos);
+        }
+        bool has(int pc) const
+        {
+            size_t i = sparse[pc];
+            return i < dense.size() && dense[i] == pc;
+        }
+        void add(int pc)
+        {
+            sparse[pc] = int(dense.size());
+            dense.push_back(pc);
+        }
+    };
+
+    struct Job
+    {
+        int pc;
+        int slot;       // If slot >= 0, then restore the capture.
+        size_t value;
+    };
+
+    struct PikeState
+    {
+        const unsigned char *text;
+        size_t len;
+        size_t ncap;
+        std::vector<Job> jobs;
+        std::vector<size_t> cur;
+    };
+
+    bool is_boundary(const PikeState& st, size_t pos) const
+    {
+        bool before = pos > 0 && regex_is_word(st.text[pos - 1]);
+        bool after = pos < st.len && regex_is_word(st.text[pos]);
+        return before != after;
+    }
+
+    // Adds the thread at pc and the threads reachable by the empty moves.
+    void add_thread(PikeState& st, ThreadList& list, int pc0, size_t pos, const size_t *caps) const
+    {
+        st.cur.assign(caps, caps + st.ncap);
+        st.jobs.clear();
+        Job first = { pc0, -1, 0 };
+        st.jobs.push_back(first);
+        while (st.jobs.size())
+        {
+            Job job = st.jobs.back();
+            st.jobs.pop_back();
+            if (job.slot >= 0)
+            {
+                st.cur[job.slot] = job.value;
+                continue;
+            }
+
+            int pc = job.pc;
+            for (;;)
+            {
+                if (list.has(pc))
+                    break;
+                list.add(pc);
+
+                const RegexInst& inst = m_prog[pc];
+                if (inst.op == RX_JMP)
+                {
+                    pc = inst.x;
+                    continue;
+                }
+                if (inst.op == RX_SPLIT)
+                {
+                    Job other = { inst.y, -1, 0 };
+                    st.jobs.push_back(other);
+                    pc = inst.x;
+                    continue;
+                }
+                if (inst.op == RX_SAVE)
+                {
+                    Job restore = { 0, inst.x, st.cur[inst.x] };
+                    st.jobs.push_back(restore);
+                    st.cur[inst.x] = pos;
+                    ++pc;
+                    continue;
+                }
+
+                bool pass;
+                switch (inst.op)
+                {
+                case RX_BOL: pass = (pos == 0); break;
+                case RX_EOL: pass = (pos == st.len); break;
+                case RX_WORDB: pass = is_boundary(st, pos); break;
+                case RX_NWORDB: pass = !is_boundary(st, pos); break;
+                default:
+                    // A consuming instruction or MATCH. Keep the captures.
+                    std::copy(st.cur.begin(), st.cur.end(), list.caps.begin() + pc * st.ncap);
+                    pass = false;
+                    break;
+                }
+                if (!pass)
+                    break;
+                ++pc;
+            }
+        }
+    }
+
+    bool pike(const char *text, size_t len, size_t start, bool full,
+              std::vector<size_t>& caps) const
+    {
+        PikeState st;
+        st.text = (const unsigned char *)text;
+        st.len = len;
+        st.ncap = (m_groups + 1) * 2;
+
+        ThreadList clist, nlist;
+        clist.init(m_prog.size(), st.ncap);
+        nlist.init(m_prog.size(), st.ncap);
+        std::vector<size_t> empty(st.ncap, std::string::npos);
+
+        bool matched = false;
+        for (size_t pos = start; ; ++pos)
+        {
+            if (!matched && (!full || pos == start))
+            {
+                if (clist.dense.empty() && m_first_ok && !full)
+                {
+                    // Skip to the byte that can start a match.
+                    while (pos < len && !m_first.has(st.text[pos]))
+                        ++pos;
+                    if (pos >= len)
+                        break;
+                }
+                add_thread(st, clist, 0, pos, empty.data());
+            }
+            if (clist.dense.empty())
+            {
+                if (matched || full || pos >= len)
+                    break;
+                continue;
+            }
+
+            nlist.dense.clear();
+            for (size_t i = 0; i < clist.dense.size(); ++i)
+            {
+                int pc = clist.dense[i];
+                const RegexInst& inst = m_prog[pc];
+                const size_t *tcaps = &clist.caps[pc * st.ncap];
+                if (inst.op == RX_MATCH)
+                {
+                    if (full && pos != len)
+                        continue;
+                    matched = true;
+                    caps.assign(tcaps, tcaps + st.ncap);
+                    break;  // Cut off the threads of lower priority.
+                }
+                if (pos < len && step(inst, st.text[pos]))
+                    add_thread(st, nlist, pc + 1, pos + 1, tcaps);
+            }
+            std::swap(clist, nlist);
+            if (pos >= len)
+                break;
+        }
+        return matched;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // lazy DFA
+
+    struct DState
+    {
+        std::vector<int> pcs;   // consuming, MATCH and EOL instructions
+        bool accept_now;        // it contains MATCH
+        int accept_end[2];      // it matches at the end of text, by at_begin. -1 if unknown
+        int next[256];          // -1 if not computed yet
+    };
+
+    struct Dfa
+    {
+        bool unanchored;
+        std::vector<std::unique_ptr<DState>> states;
+        std::map<std::vector<int>, int> index;
+        int start[2];           // by at_begin. -1 if not computed yet
+        std::mutex mutex;
+
+        explicit Dfa(bool u) : unanchored(u)
+        {
+            start[0] = start[1] = -1;
+        }
+        void clear()
+        {
+            states.clear();
+            index.clear();
+            start[0] = start[1] = -1;
+        }
+    };
+
+    mutable Dfa m_anchored{false};
+    mutable Dfa m_unanchored{true};
+
+    // Follows the empty moves from the seeds. If at_end, then EOL passes.
+    void closure(std::vector<int>& seeds, bool at_begin, bool at_end,
+                 std::vector<int>& out) const
+    {
+        std::vector<char> seen(m_prog.size());
+        out.clear();
+        while (seeds.size())
+        {
+            int pc = seeds.back();
+            seeds.pop_back();
+            if (seen[pc])
+                continue;
+            seen[pc] = 1;
+
+            const RegexInst& inst = m_prog[pc];
+            switch (inst.op)
+            {
+            case RX_JMP:
+                seeds.push_back(inst.x);
+                break;
+            case RX_SPLIT:
+                seeds.push_back(inst.y);
+                seeds.push_back(inst.x);
+                break;
+            case RX_SAVE:
+                seeds.push_back(pc + 1);
+                break;
+            case RX_BOL:
+                if (at_begin)
+                    seeds.push_back(pc + 1);
+                break;
+            case RX_EOL:
+                if (at_end)
+                    seeds.push_back(pc + 1);
+                else
+                    out.push_back(pc);  // pending until the end
+                break;
+            default:
+                out.push_back(pc);
+                break;
+            }
+        }
+        std::sort(out.begin(), out.end());
+    }
+
+    int add_state(Dfa& dfa, std::vector<int>& pcs) const
+    {
+        auto it = dfa.index.find(pcs);
+        if (it != dfa.index.end())
+            return it->second;
+
+        std::unique_ptr<DState> state(new DState);
+        state->accept_now = false;
+        for (int pc : pcs)
+        {
+            if (m_prog[pc].op == RX_MATCH)
+                state->accept_now = true;
+        }
+        state->accept_end[0] = state->accept_end[1] = -1;
+        std::fill(state->next, state->next + 256, -1);
+        state->pcs.swap(pcs);
+
+        int id = int(dfa.states.size());
+        dfa.index[state->pcs] = id;
+        dfa.states.push_back(std::move(state));
+        return id;
+    }
+
+    int start_state(Dfa& dfa, bool at_begin) const
+    {
+        int& id = dfa.start[at_begin];
+        if (id < 0)
+        {
+            std::vector<int> seeds(1, 0), pcs;
+            closure(seeds, at_begin, false, pcs);
+            id = add_state(dfa, pcs);
+        }
+        return id;
+    }
+
+    int next_state(Dfa& dfa, int id, unsigned char c) const
+    {
+        int next = dfa.states[id]->next[c];
+        if (next >= 0)
+            return next;
+
+        std::vector<int> seeds, pcs;
+        for (int pc : dfa.states[id]->pcs)
+        {
+            if (is_consuming(m_prog[pc].op) && step(m_prog[pc], c))
+                seeds.push_back(pc + 1);
+        }
+        if (dfa.unanchored)
+            seeds.push_back(0);     // A match can start at any position.
+        closure(seeds, false, false, pcs);
+
+        if (dfa.states.size() >= REGEX_MAX_DFA_STATES)
+        {
+            // Too many states. Start over the cache.
+            dfa.clear();
+            return add_state(dfa, pcs);
+        }
+
+        next = add_state(dfa, pcs);
+        dfa.states[id]->next[c] = next;
+        return next;
+    }
+
+    // If at_begin, then the end is also the beginning, so BOL after EOL
+    // passes, as in $^ on the empty text.
+    bool accepts_at_end(Dfa& dfa, int id, bool at_begin) const
+    {
+        DState& state = *dfa.states[id];
+        int& accept_end = state.accept_end[at_begin];
+        if (accept_end < 0)
+        {
+            std::vector<int> seeds(state.pcs), pcs;
+            closure(seeds, at_begin, true, pcs);
+            accept_end = 0;
+            for (int pc : pcs)
+            {
+                if (m_prog[pc].op == RX_MATCH)
+                    accept_end = 1;
+            }
+        }
+        return accept_end != 0;
+    }
+
+    // If full, then whether text[start...] matches wholly. Otherwise whether
+    // a match exists in text[start...].
+    bool dfa_match(Dfa& dfa, const char *text, size_t len, size_t start, bool full) const
+    {
+        std::lock_guard<std::mutex> lock(dfa.mutex);
+
+        const unsigned char *s = (const unsigned char *)text;
+        int id = start_state(dfa, start == 0);
+        for (size_t pos = start; pos < len; ++pos)
+        {
+            if (!full && dfa.states[id]->accept_now)
+                return true;
+            if (full && dfa.states[id]->pcs.empty())
+                return false;
+            id = next_state(dfa, id, s[pos]);
+        }
+        if (!full && dfa.states[id]->accept_now)
+            return true;
+        return accepts_at_end(dfa, id, len == 0);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// unittest
+
+inline bool
+regex_search_test(const char *pattern, const char *text, size_t pos, size_t len)
+{
+    Regex re(pattern);
+    std::vector<size_t> caps;
+    if (!re.search(text, std::strlen(text), 0, caps))
+        return pos == std::string::npos;
+    return caps[0] == pos && caps[1] - caps[0] == len;
+}
+
+inline bool
+regex_error_test(const char *pattern)
+{
+    try
+    {
+        Regex re(pattern);
+    }
+    catch (const RegexError&)
+    {
+        return true;
+    }
+    return false;
+}
+
+inline void
+regex_unittest(void)
+{
+    const size_t npos = std::string::npos;
+
+    assert(Regex("abc").match("abc", 3));
+    assert(!Regex("abc").match("abcd", 4));
+    assert(Regex("a*").match("", 0));
+    assert(Regex("a|b|c").match("b", 1));
+    assert(Regex("(ab)+").match("ababab", 6));
+    assert(!Regex("(ab)+").match("ababa", 5));
+    assert(Regex("a{2,3}").match("aaa", 3));
+    assert(!Regex("a{2,3}").match("aaaa", 4));
+    assert(Regex("a{2,}").match("aaaa", 4));
+    assert(Regex("[a-c]+\\d\\s\\w").match("abc1 _", 6));
+    assert(Regex("[^a]").match("\xE3\x81\x82", 3));
+    assert(Regex("..").match("a\xE3\x81\x82", 4));
+    assert(!Regex(".").match("\n", 1));
+    assert(Regex("^a$").match("a", 1));
+    assert(Regex("x{1}y\\{").match("xy{", 3));
+    assert(Regex("\\bab\\b").match("ab", 2));
+    assert(Regex("(?:a*)*b").match("aab", 3));
+
+    assert(regex_search_test("b+", "aabbbc", 2, 3));
+    assert(regex_search_test("b+?", "aabbbc", 2, 1));
+    assert(regex_search_test("x", "abc", npos, 0));
+    assert(regex_search_test("", "abc", 0, 0));
+    assert(regex_search_test("c$", "abcabc", 5, 1));
+    assert(regex_search_test("^b", "abc", npos, 0));
+    assert(regex_search_test("a|ab", "ab", 0, 1));      // leftmost-first
+    assert(regex_search_test("\\bcat\\b", "concat cat", 7, 3));
+    assert(regex_search_test("\\Bcat", "concat cat", 3, 3));
+
+    // The captures
+    {
+        Regex re("(\\w+)@(\\w+)(x)?");
+        std::vector<size_t> caps;
+        assert(re.groups() == 3);
+        assert(re.search("to: me@host.", 12, 0, caps));
+        assert(caps[2] == 4 && caps[3] == 6 && caps[4] == 7 && caps[5] == 11);
+        assert(caps[6] == npos && caps[7] == npos);
+    }
+
+    // A loop of a body that can match empty keeps the priority of the body,
+    // as in RE2 and Go.
+    assert(regex_search_test("(a?\?)+", "aa", 0, 0));
+    assert(regex_search_test("(?:a?\?)*a", "aa", 0, 1));
+    assert(regex_search_test("(?:a?)*?b", "aab", 0, 3));
+    {
+        std::vector<size_t> caps;
+        assert(Regex("b(1?\?)+").search("b1", 2, 0, caps));
+        assert(caps[0] == 0 && caps[1] == 1 && caps[2] == 1 && caps[3] == 1);
+        assert(Regex("(a|)+b").search("aab", 3, 0, caps));
+        assert(caps[1] == 3 && caps[2] == 1 && caps[3] == 2);
+        assert(Regex("(.*?)+a").search("11a", 3, 0, caps));
+        assert(caps[1] == 3 && caps[2] == 0 && caps[3] == 2);
+    }
+
+    // The end of the empty text is also the beginning.
+    assert(Regex("$^").match("", 0));
+    assert(Regex("(?:$)(?:^)").match("", 0));
+    assert(Regex("$(^){1,3}").match("", 0));
+    assert(!Regex("$^").match("a", 1));
+    assert(regex_search_test("$^", "", 0, 0));
+    assert(regex_search_test("$(^){1,3}", "", 0, 0));
+    assert(regex_search_test("$^", "a", npos, 0));
+
+    // No backtracking blowups
+    {
+        std::string text(5000, 'a');
+        assert(!Regex("(a*)*b").match(text.data(), text.size()));
+        assert(!Regex("(a|aa)+$b").match(text.data(), text.size()));
+        std::vector<size_t> caps;
+        assert(!Regex("(a+)+b").search(text.data(), text.size(), 0, caps));
+        assert(!Regex("(a|a)*\\bb").search(text.data(), text.size(), 0, caps));
+    }
+
+    assert(regex_error_test("("));
+    assert(regex_error_test(")"));
+    assert(regex_error_test("[a"));
+    assert(regex_error_test("*a"));
+    assert(regex_error_test("a**"));
+    assert(regex_error_test("a{3,2}"));
+    assert(regex_error_test("\\"));
+    assert(regex_error_test("a{1001}"));
+    assert(regex_error_test(std::string(2000, '(').c_str()));
+}
@@ -0,0 +1,509 @@
+// utfvec.hpp --- vectorized UTF-8 <--> UTF-16 conversion
+// Copyright (C) 2026 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// This file is public domain software.
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <cassert>
+
+// The UTF-16 text is stored in a byte string in the native byte order, as
+// wchar_t on Windows and char16_t elsewhere.
+//
+// The runs of ASCII characters are converted by 16 bytes per step by SSE2 and
+// 32 bytes per step by AVX2. On GCC and Clang for x86, the AVX2 versions are
+// compiled and chosen at run time. Otherwise the scalar versions are used.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define UTFVEC_AVX2
+    #include <immintrin.h>
+    #define UTFVEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define UTFVEC_SSE2
+    #include <emmintrin.h>
+#endif
+
+// The invalid sequences are replaced with this character.
+#define UTFVEC_DEFCHAR '?'
+
+inline bool
+utfvec_has_avx2(void)
+{
+#ifdef UTFVEC_AVX2
+    static const bool s_has = __builtin_cpu_supports("avx2");
+    return s_has;
+#else
+    return false;
+#endif
+}
+
+inline void
+utfvec_put16(char *dst, unsigned value)
+{
+    char16_t ch = char16_t(value);
+    std::memcpy(dst, &ch, sizeof(ch));
+}
+
+inline unsigned
+utfvec_get16(const char *src)
+{
+    char16_t ch;
+    std::memcpy(&ch, src, sizeof(ch));
+    return ch;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// ASCII runs
+//
+// The functions below convert the leading ASCII characters of src in whole
+// blocks. They return the count of the converted characters.
+
+inline size_t
+utfvec_widen_ascii_scalar(const char *src, size_t len, char *dst)
+{
+    size_t i = 0;
+    for (; i < len && !(src[i] & 0x80); ++i)
+        utfvec_put16(dst + i * 2, (unsigned char)src[i]);
+    return i;
+}
+
+inline size_t
+utfvec_narrow_ascii_scalar(const char *src, size_t count, char *dst)
+{
+    size_t i = 0;
+    for (; i < count; ++i)
+    {
+        unsigned ch = utfvec_get16(src + i * 2);
+        if (ch >= 0x80)
+            break;
+        dst[i] = char(ch);
+    }
+    return i;
+}
+
+#ifdef UTFVEC_SSE2
+inline size_t
+utfvec_widen_ascii_sse2(const char *src, size_t len, char *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(v))
+            break;
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(v, zero));
+    }
+    return i;
+}
+
+inline size_t
+utfvec_narrow_ascii_sse2(const char *src, size_t count, char *dst)
+{
+    const __m128i mask = _mm_set1_epi16(short(0xFF80));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+        __m128i high = _mm_and_si128(_mm_or_si128(v1, v2), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, zero)) != 0xFFFF)
+            break;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(v1, v2));
+    }
+    return i;
+}
+#endif  // def UTFVEC_SSE2
+
+#ifdef UTFVEC_AVX2
+UTFVEC_TARGET_AVX2 inline size_t
+utfvec_widen_ascii_avx2(const char *src, size_t len, char *dst)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (_mm256_movemask_epi8(v))
+            break;
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), lo);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), hi);
+    }
+    return i;
+}
+
+UTFVEC_TARGET_AVX2 inline size_t
+utfvec_narrow_ascii_avx2(const char *src, size_t count, char *dst)
+{
+    const __m256i mask = _mm256_set1_epi16(short(0xFF80));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(src + i * 2 + 32));
+        if (!_mm256_testz_si256(_mm256_or_si256(v1, v2), mask))
+            break;
+        // packus works in the 128-bit lanes. Put the quadwords in order.
+        __m256i packed = _mm256_packus_epi16(v1, v2);
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    return i;
+}
+#endif  // def UTFVEC_AVX2
+
+inline size_t
+utfvec_widen_ascii(const char *src, size_t len, char *dst)
+{
+    size_t i = 0;
+#ifdef UTFVEC_AVX2
+    if (utfvec_has_avx2())
+        i = utfvec_widen_ascii_avx2(src, len, dst);
+#endif
+#ifdef UTFVEC_SSE2
+    i += utfvec_widen_ascii_sse2(src + i, len - i, dst + i * 2);
+#else
+    i += utfvec_widen_ascii_scalar(src + i, len - i, dst + i * 2);
+#endif
+    return i;
+}
+
+inline size_t
+utfvec_narrow_ascii(const char *src, size_t count, char *dst)
+{
+    size_t i = 0;
+#ifdef UTFVEC_AVX2
+    if (utfvec_has_avx2())
+        i = utfvec_narrow_ascii_avx2(src, count, dst);
+#endif
+#ifdef UTFVEC_SSE2
+    i += utfvec_narrow_ascii_sse2(src + i * 2, count - i, dst + i);
+#else
+    i += utfvec_narrow_ascii_scalar(src + i * 2, count - i, dst + i);
+#endif
+    return i;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// conversion
+
+// Decodes one character of UTF-8 at src[0]. Sets the length of the sequence
+// to len. Returns the code point, or -1 for an invalid sequence (then len is
+// the length of the maximal invalid subpart).
+inline long
+utfvec_decode_u8(const unsigned char *src, size_t avail, size_t& len)
+{
+    unsigned c = src[0];
+    len = 1;
+    if (c < 0x80)
+        return long(c);
+
+    size_t need;
+    unsigned lo = 0x80, hi = 0xBF;
+    unsigned long cp;
+    if (0xC2 <= c && c <= 0xDF)
+    {
+        need = 2;
+        cp = c & 0x1F;
+    }
+    else if (0xE0 <= c && c <= 0xEF)
+    {
+        need = 3;
+        cp = c & 0x0F;
+        if (c == 0xE0)
+            lo = 0xA0;  // overlong
+        else if (c == 0xED)
+            hi = 0x9F;  // surrogate
+    }
+    else if (0xF0 <= c && c <= 0xF4)
+    {
+        need = 4;
+        cp = c & 0x07;
+        if (c == 0xF0)
+            lo = 0x90;  // overlong
+        else if (c == 0xF4)
+            hi = 0x8F;  // over U+10FFFF
+    }
+    else
+    {
+        return -1;
+    }
+
+    for (size_t k = 1; k < need; ++k)
+    {
+        if (k >= avail)
+            return -1;
+        unsigned b = src[k];
+        if (b < lo || hi < b)
+            return -1;
+        cp = (cp << 6) | (b & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+        len = k + 1;
+    }
+    return long(cp);
+}
+
+// The size of the UTF-16 output buffer for len bytes of UTF-8.
+inline size_t
+utfvec_u16_size(size_t len)
+{
+    return len * 2;
+}
+
+// The size of the UTF-8 output buffer for count units of UTF-16.
+inline size_t
+utfvec_u8_size(size_t count)
+{
+    return count * 3;
+}
+
+// Converts UTF-8 to UTF-16. dst needs utfvec_u16_size(len) bytes.
+// Returns the size of the output in bytes.
+inline size_t
+utfvec_u8_to_u16(const char *src, size_t len, char *dst)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    char *d = dst;
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t n = utfvec_widen_ascii(src + i, len - i, d);
+        i += n;
+        d += n * 2;
+
+        // Convert by each character until the next ASCII character.
+        while (i < len)
+        {
+            size_t seq;
+            long cp = utfvec_decode_u8(s + i, len - i, seq);
+            i += seq;
+            if (cp < 0)
+            {
+                utfvec_put16(d, UTFVEC_DEFCHAR);
+                d += 2;
+            }
+            else if (cp >= 0x10000)
+            {
+                cp -= 0x10000;
+                utfvec_put16(d, 0xD800 + unsigned(cp >> 10));
+                utfvec_put16(d + 2, 0xDC00 + unsigned(cp & 0x3FF));
+                d += 4;
+            }
+            else
+            {
+                utfvec_put16(d, unsigned(cp));
+                d += 2;
+                if (cp < 0x80)
+                    break;
+            }
+        }
+    }
+    return size_t(d - dst);
+}
+
+// Converts UTF-16 of count units to UTF-8. dst needs utfvec_u8_size(count)
+// bytes. Returns the size of the output in bytes.
+inline size_t
+utfvec_u16_to_u8(const char *src, size_t count, char *dst)
+{
+    char *d = dst;
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t n = utfvec_narrow_ascii(src + i * 2, count - i, d);
+        i += n;
+        d += n;
+
+        // Convert by each unit until the next ASCII character.
+        while (i < count)
+        {
+            unsigned long cp = utfvec_get16(src + i * 2);
+            ++i;
+            if (cp < 0x80)
+            {
+                *d++ = char(cp);
+                break;
+            }
+            if (cp < 0x800)
+            {
+                *d++ = char(0xC0 | (cp >> 6));
+                *d++ = char(0x80 | (cp & 0x3F));
+                continue;
+            }
+            if (0xD800 <= cp && cp <= 0xDFFF)
+            {
+                unsigned long low = (i < count) ? utfvec_get16(src + i * 2) : 0;
+                if (cp >= 0xDC00 || low < 0xDC00 || 0xDFFF < low)
+                {
+                    // A lone surrogate
+                    *d++ = UTFVEC_DEFCHAR;
+                    continue;
+                }
+                ++i;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                *d++ = char(0xF0 | (cp >> 18));
+                *d++ = char(0x80 | ((cp >> 12) & 0x3F));
+                *d++ = char(0x80 | ((cp >> 6) & 0x3F));
+                *d++ = char(0x80 | (cp & 0x3F));
+                continue;
+            }
+            *d++ = char(0xE0 | (cp >> 12));
+            *d++ = char(0x80 | ((cp >> 6) & 0x3F));
+            *d++ = char(0x80 | (cp & 0x3F));
+        }
+    }
+    return size_t(d - dst);
+}
+
+// The size of the input of a chunk. The output of a chunk is made on the
+// stack and appended, so the result string is not filled in advance.
+#define UTFVEC_CHUNK 4096
+
+// Converts UTF-8 to UTF-16 and appends it to out.
+inline void
+utfvec_u16_from_u8(const char *src, size_t len, std::string& out)
+{
+    char buf[utfvec_u16_size(UTFVEC_CHUNK)];
+    out.reserve(out.size() + utfvec_u16_size(len));
+    while (len > 0)
+    {
+        size_t n = len;
+        if (n > UTFVEC_CHUNK)
+        {
+            // Don't split a sequence. Split before the last lead byte
+            // if it is followed by three trail bytes or less.
+            n = UTFVEC_CHUNK;
+            size_t k = 1;
+            while (k < 4 && (src[n - k] & 0xC0) == 0x80)
+                ++k;
+            if ((src[n - k] & 0xC0) == 0xC0)
+                n -= k;
+        }
+        out.append(buf, utfvec_u8_to_u16(src, n, buf));
+        src += n;
+        len -= n;
+    }
+}
+
+// Converts UTF-16 of count units to UTF-8 and appends it to out.
+inline void
+utfvec_u8_from_u16(const char *src, size_t count, std::string& out)
+{
+    char buf[utfvec_u8_size(UTFVEC_CHUNK)];
+    out.reserve(out.size() + count);
+    while (count > 0)
+    {
+        size_t n = count;
+        if (n > UTFVEC_CHUNK)
+        {
+            // Don't split a surrogate pair.
+            n = UTFVEC_CHUNK;
+            unsigned last = utfvec_get16(src + (n - 1) * 2);
+            if (0xD800 <= last && last <= 0xDBFF)
+                --n;
+        }
+        out.append(buf, utfvec_u16_to_u8(src, n, buf));
+        src += n * 2;
+        count -= n;
+    }
+}
+
+inline std::string
+utfvec_u16_from_u8(const std::string& str)
+{
+    std::string ret;
+    utfvec_u16_from_u8(str.data(), str.size(), ret);
+    return ret;
+}
+
+inline std::string
+utfvec_u8_from_u16(const std::string& str)
+{
+    std::string ret;
+    utfvec_u8_from_u16(str.data(), str.size() / 2, ret);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// unittest
+
+inline std::string
+utfvec_units(const char16_t *units)
+{
+    std::string ret;
+    for (; *units; ++units)
+    {
+        char buf[2];
+        utfvec_put16(buf, *units);
+        ret.append(buf, 2);
+    }
+    return ret;
+}
+
+inline void
+utfvec_unittest(void)
+{
+    assert(utfvec_u16_from_u8("") == "");
+    assert(utfvec_u16_from_u8("abc") == utfvec_units(u"abc"));
+    assert(utfvec_u16_from_u8("\xC3\xA9\xE3\x81\x82\xF0\x9F\x98\x80") == utfvec_units(u"\u00E9\u3042\U0001F600"));
+
+    // The invalid sequences
+    assert(utfvec_u16_from_u8("\x80") == utfvec_units(u"?"));
+    assert(utfvec_u16_from_u8("\xC0\xAF") == utfvec_units(u"??"));            // overlong
+    assert(utfvec_u16_from_u8("\xE0\x80\xAF") == utfvec_units(u"???"));       // overlong
+    assert(utfvec_u16_from_u8("\xED\xA0\x80") == utfvec_units(u"???"));       // surrogate
+    assert(utfvec_u16_from_u8("\xF4\x90\x80\x80") == utfvec_units(u"????"));  // too large
+    assert(utfvec_u16_from_u8("\xE3\x81") == utfvec_units(u"?"));             // truncated
+    assert(utfvec_u16_from_u8("\xE3\x81x") == utfvec_units(u"?x"));
+
+    assert(utfvec_u8_from_u16(utfvec_units(u"abc\u00E9\u3042\U0001F600")) ==
+           "abc\xC3\xA9\xE3\x81\x82\xF0\x9F\x98\x80");
+    assert(utfvec_u8_from_u16(utfvec_units(u"\xD800x\xDC00")) == "?x?");
+    assert(utfvec_u8_from_u16(std::string("a\0b", 3)) == "a");
+
+    // The chunks
+    for (size_t pos = UTFVEC_CHUNK - 4; pos <= UTFVEC_CHUNK; ++pos)
+    {
+        std::string u8(pos, 'a');
+        u8 += "\xF0\x9F\x98\x80\xE3\x81\x82\x80z";
+        u8 += std::string(UTFVEC_CHUNK, 'b');
+        std::string u16 = utfvec_u16_from_u8(u8);
+        std::string tail = utfvec_units(u"\U0001F600\u3042?z");
+        assert(u16.size() == (pos + 5 + UTFVEC_CHUNK) * 2);
+        assert(u16.compare(pos * 2, tail.size(), tail) == 0);
+        std::string back = utfvec_u8_from_u16(u16);
+        assert(back.size() == u8.size());
+        assert(back.compare(pos, 8, "\xF0\x9F\x98\x80\xE3\x81\x82?") == 0);
+    }
+
+    // The long runs through the vector paths
+    for (size_t len = 0; len < 100; ++len)
+    {
+        for (size_t pos = 0; pos <= len; ++pos)
+        {
+            std::string u8(len, 'a');
+            std::u16string u16(len, u'a');
+            if (pos < len)
+            {
+                u8.replace(pos, 1, "\xE3\x81\x82");
+                u16[pos] = u'\u3042';
+            }
+            std::string units = utfvec_units(u16.c_str());
+            assert(utfvec_u16_from_u8(u8) == units);
+            assert(utfvec_u8_from_u16(units) == u8);
+
+            std::string out(len * 2 + 64, 'z');
+            size_t n = utfvec_widen_ascii_scalar(u8.data(), u8.size(), &out[0]);
+            assert(n == pos);
+            assert(utfvec_widen_ascii(u8.data(), u8.size(), &out[0]) <= pos);
+            assert(utfvec_narrow_ascii(units.data(), len, &out[0]) <= pos);
+            assert(utfvec_narrow_ascii_scalar(units.data(), len, &out[0]) == pos);
+        }
+    }
+}